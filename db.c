@@ -4,91 +4,1248 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 
-#define MAX_INDEX 1024
-#define MAX_KEY   64
+#define INDEX_INITIAL_CAPACITY 1024
+#define SWEEP_SLOTS_PER_PASS 4096
 
+// A deleted key's record has this val_len and no value
+#define RECORD_TOMBSTONE UINT32_MAX
+
+// Every record is this header followed by the key and value bytes
+struct record_header {
+    uint32_t key_len;
+    uint32_t val_len;
+    uint64_t expires_at;    // Milliseconds since the epoch; 0 never expires
+};
+
+// The header of a log from before segments, which db_open converts
+struct legacy_record_header {
+    uint32_t key_len;
+    uint32_t val_len;
+};
+
+// A hint file holds one of these per record of its segment, each
+// followed by the key: enough to index the segment without its values
+struct hint_header {
+    uint64_t offset;
+    struct record_header record;
+};
+
+// Slot of the key index: an open-addressing hash table with linear
+// probing. A NULL key marks an empty slot
 struct index_entry {
-    char key[MAX_KEY];
+    char *key;
+    uint32_t key_len;
+    uint32_t segment;   // Id of the segment with the latest record
+    uint64_t hash;
     off_t offset;
+    uint64_t size;      // Of the whole record
+    uint64_t expires_at;
+};
+
+// A closed segment mapped into memory. Values handed out by
+// db_get_value point into it, so it outlives its segment until the last
+// of them is released
+struct mapping {
+    char *data;
+    size_t size;
+    unsigned refs;
+    bool retired;       // Its segment is gone
 };
 
-static int db_fd = -1;
-static struct index_entry db_index[MAX_INDEX];
+// One log file. Only the last segment is appended to; the rest never
+// change until a merge replaces them
+struct segment {
+    uint32_t id;
+    int fd;
+    off_t size;
+    struct mapping *map;    // NULL unless closed and mmap_segments is set
+};
+
+struct buffer {
+    char *data;
+    size_t used;
+    size_t capacity;
+};
+
+// Records as they will be written: header, key, value, one after another
+struct db_batch {
+    struct buffer records;
+};
+
+static char *db_path = NULL;
+static struct db_options db_opts;
+
+static struct index_entry *db_index = NULL;
+static size_t index_capacity = 0;   // Power of two
 static size_t index_size = 0;
 
+static struct segment *segments = NULL;   // By id; the last is active
+static size_t num_segments = 0;
+static uint32_t next_segment_id = 1;
+static struct buffer active_hints;        // Hints of the active segment
+static uint64_t total_bytes = 0;          // Of every segment
+static uint64_t live_bytes = 0;           // Of the records the index points to
+static bool active_dirty = false;         // Written since the last sync
 
-static void load_index() {
-    off_t offset = 0;
+// db_lock guards everything above. Merges run one at a time and only
+// take db_lock to check records and to swap their output in
+static pthread_mutex_t db_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t merge_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t background_wakeup = PTHREAD_COND_INITIALIZER;
+static pthread_t merge_thread;
+static pthread_t sync_thread;
+static pthread_t sweep_thread;
+static bool merge_thread_running = false;
+static bool sync_thread_running = false;
+static bool sweep_thread_running = false;
+static size_t sweep_next_slot = 0;        // Where the sweeper picks up
+static bool stopping = false;
 
-    while (1) {
-        uint32_t key_len, val_len;
-        ssize_t r;
+static uint64_t now_ms() {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
 
-        r = pread(db_fd, &key_len, sizeof(key_len), offset);
-        if (r <= 0) break;
+static bool is_expired(uint64_t expires_at, uint64_t now) {
+    return expires_at != 0 && expires_at <= now;
+}
 
-        pread(db_fd, &val_len, sizeof(val_len), offset + 4);
+static uint64_t record_size(const struct record_header *header) {
+    uint64_t size = sizeof(*header) + (uint64_t)header->key_len;
+    return header->val_len == RECORD_TOMBSTONE ? size : size + header->val_len;
+}
+
+// 64-bit FNV-1a
+static uint64_t key_hash(const char *key, uint32_t key_len) {
+    uint64_t hash = 14695981039346656037ull;
+    for (uint32_t i = 0; i < key_len; i++) {
+        hash = (hash ^ (uint8_t)key[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+// The slot holding key, or the empty slot where it would go
+static struct index_entry *index_slot(const char *key, uint32_t key_len, uint64_t hash) {
+    size_t mask = index_capacity - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        struct index_entry *entry = &db_index[i];
+        if (!entry->key) {
+            return entry;
+        }
+        if (entry->hash == hash && entry->key_len == key_len &&
+            memcmp(entry->key, key, key_len) == 0) {
+            return entry;
+        }
+    }
+}
 
-        char key[MAX_KEY];
-        pread(db_fd, key, key_len, offset + 8);
-        key[key_len] = '\0';
+static struct index_entry *index_find(const char *key, uint32_t key_len) {
+    struct index_entry *entry = index_slot(key, key_len, key_hash(key, key_len));
+    return entry->key ? entry : NULL;
+}
+
+// Double the table, rehashing every key into it
+static void index_grow() {
+    struct index_entry *old = db_index;
+    size_t old_capacity = index_capacity;
+
+    index_capacity = old_capacity ? old_capacity * 2 : INDEX_INITIAL_CAPACITY;
+    db_index = calloc(index_capacity, sizeof(struct index_entry));
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (old[i].key) {
+            *index_slot(old[i].key, old[i].key_len, old[i].hash) = old[i];
+        }
+    }
+    free(old);
+}
+
+// Point key at a record, adding it if it's new
+static void index_put(const char *key, uint32_t key_len, uint32_t segment,
+                      off_t offset, uint64_t size, uint64_t expires_at) {
+    // Keep the load factor under 3/4 so probe runs stay short
+    if ((index_size + 1) * 4 > index_capacity * 3) {
+        index_grow();
+    }
 
-        strncpy(db_index[index_size].key, key, MAX_KEY);
-        db_index[index_size].offset = offset;
+    uint64_t hash = key_hash(key, key_len);
+    struct index_entry *entry = index_slot(key, key_len, hash);
+    if (!entry->key) {
+        entry->key = malloc(key_len);
+        memcpy(entry->key, key, key_len);
+        entry->key_len = key_len;
+        entry->hash = hash;
         index_size++;
+    } else {
+        live_bytes -= entry->size;
+    }
+    entry->segment = segment;
+    entry->offset = offset;
+    entry->size = size;
+    entry->expires_at = expires_at;
+    live_bytes += size;
+}
+
+// Take a key out of the index. Later entries of its probe run shift back
+// into the gap, so lookups never stop early at it
+static void index_remove(struct index_entry *entry) {
+    live_bytes -= entry->size;
+    free(entry->key);
+    index_size--;
+
+    size_t mask = index_capacity - 1;
+    size_t hole = entry - db_index;
+    for (size_t i = (hole + 1) & mask; db_index[i].key; i = (i + 1) & mask) {
+        size_t home = db_index[i].hash & mask;
+        // Only an entry whose home is at or before the hole may fill it
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            db_index[hole] = db_index[i];
+            hole = i;
+        }
+    }
+    db_index[hole].key = NULL;
+}
+
+// What a record, read in log order, does to the index: deletes and
+// expired records remove the key, anything older included
+static void index_apply(const char *key, const struct record_header *header,
+                        uint32_t segment, off_t offset, uint64_t now) {
+    if (header->val_len == RECORD_TOMBSTONE || is_expired(header->expires_at, now)) {
+        struct index_entry *entry = index_find(key, header->key_len);
+        if (entry) index_remove(entry);
+        return;
+    }
+    index_put(key, header->key_len, segment, offset, record_size(header), header->expires_at);
+}
+
+static void index_free() {
+    for (size_t i = 0; i < index_capacity; i++) {
+        free(db_index[i].key);
+    }
+    free(db_index);
+    db_index = NULL;
+    index_capacity = 0;
+    index_size = 0;
+}
+
+static void buffer_append(struct buffer *buffer, const void *data, size_t size) {
+    if (buffer->used + size > buffer->capacity) {
+        size_t capacity = buffer->capacity ? buffer->capacity : 4096;
+        while (capacity < buffer->used + size) {
+            capacity *= 2;
+        }
+        buffer->data = realloc(buffer->data, capacity);
+        buffer->capacity = capacity;
+    }
+    memcpy(buffer->data + buffer->used, data, size);
+    buffer->used += size;
+}
+
+static void append_hint(struct buffer *hints, off_t offset,
+                        const struct record_header *record, const char *key) {
+    struct hint_header hint = {offset, *record};
+    buffer_append(hints, &hint, sizeof(hint));
+    buffer_append(hints, key, record->key_len);
+}
+
+static int write_all(int fd, const void *data, size_t size) {
+    const char *bytes = data;
+    while (size > 0) {
+        ssize_t written = write(fd, bytes, size);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        bytes += written;
+        size -= written;
+    }
+    return 0;
+}
+
+static int writev_all(int fd, struct iovec *iov, int iovcnt) {
+    while (iovcnt > 0) {
+        ssize_t written = writev(fd, iov, iovcnt);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        while (iovcnt > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return 0;
+}
+
+// The whole of a file, or NULL if it can't be read
+static char *read_file(int fd, off_t size) {
+    char *data = malloc(size ? size : 1);
+    off_t done = 0;
+    while (done < size) {
+        ssize_t r = pread(fd, data + done, size - done, done);
+        if (r <= 0) {
+            if (r < 0 && errno == EINTR) continue;
+            free(data);
+            return NULL;
+        }
+        done += r;
+    }
+    return data;
+}
+
+static void segment_file(char *name, size_t size, uint32_t id, const char *suffix) {
+    snprintf(name, size, "%s.%u%s", db_path, id, suffix);
+}
+
+// Write a file under a temporary name, sync it and move it into place,
+// so it's either whole or absent
+static int write_file_atomic(const char *name, const void *data, size_t size) {
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", name);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return -1;
+    if (write_all(fd, data, size) != 0 || fsync(fd) != 0) {
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+    close(fd);
+    return rename(tmp, name);
+}
+
+static int write_hints(uint32_t id, const struct buffer *hints) {
+    char name[4096];
+    segment_file(name, sizeof(name), id, ".hint");
+    return write_file_atomic(name, hints->data, hints->used);
+}
+
+static struct segment *find_segment(uint32_t id) {
+    size_t lo = 0, hi = num_segments;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (segments[mid].id < id) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo < num_segments && segments[lo].id == id ? &segments[lo] : NULL;
+}
+
+// Open segment id and add it after the others
+static int open_segment(uint32_t id, struct segment *segment) {
+    char name[4096];
+    segment_file(name, sizeof(name), id, "");
+    int fd = open(name, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (fd < 0) return -1;
+
+    segment->id = id;
+    segment->fd = fd;
+    segment->size = lseek(fd, 0, SEEK_END);
+    segment->map = NULL;
+    return 0;
+}
+
+static int add_segment(uint32_t id) {
+    struct segment segment;
+    if (open_segment(id, &segment) != 0) return -1;
+
+    segments = realloc(segments, sizeof(struct segment) * (num_segments + 1));
+    segments[num_segments++] = segment;
+    if (id >= next_segment_id) {
+        next_segment_id = id + 1;
+    }
+    return 0;
+}
+
+// Map a closed segment if the options ask for it. Reads fall back to
+// pread() if it can't be
+static void map_segment(struct segment *segment) {
+    if (!db_opts.mmap_segments || segment->map || segment->size == 0) return;
+    void *data = mmap(NULL, segment->size, PROT_READ, MAP_SHARED, segment->fd, 0);
+    if (data == MAP_FAILED) return;
+
+    segment->map = calloc(1, sizeof(struct mapping));
+    segment->map->data = data;
+    segment->map->size = segment->size;
+}
+
+static void release_mapping(struct mapping *map) {
+    munmap(map->data, map->size);
+    free(map);
+}
+
+// Caller holds db_lock
+static void unmap_segment(struct segment *segment) {
+    if (!segment->map) return;
+    if (segment->map->refs == 0) {
+        release_mapping(segment->map);
+    } else {
+        segment->map->retired = true;   // The last db_release_value unmaps it
+    }
+    segment->map = NULL;
+}
+
+// Close the active segment, leaving its hints behind, and start segment
+// id. Caller holds db_lock
+static int roll_segment(uint32_t id) {
+    struct segment *active = &segments[num_segments - 1];
+    if (fsync(active->fd) != 0 || write_hints(active->id, &active_hints) != 0) {
+        return -1;
+    }
+    active_hints.used = 0;
+    active_dirty = false;
+    map_segment(active);
+    return add_segment(id);
+}
+
+// Append size bytes to the active segment with one writev() and sync as
+// the mode says. Returns the offset they start at, or -1 having written
+// nothing. Caller holds db_lock
+static off_t append_active(struct iovec *iov, int iovcnt, uint64_t size) {
+    struct segment *active = &segments[num_segments - 1];
+    off_t offset = active->size;
+    if (writev_all(active->fd, iov, iovcnt) != 0 ||
+        (db_opts.sync_mode == DB_SYNC_ALWAYS && fsync(active->fd) != 0)) {
+        // Later records must still land where the index expects them
+        if (ftruncate(active->fd, offset) != 0) {
+            perror("db: dropping a failed write");
+        }
+        return -1;
+    }
+    active->size += size;
+    total_bytes += size;
+    active_dirty = db_opts.sync_mode != DB_SYNC_ALWAYS;
+    return offset;
+}
+
+// Index a record of the active segment. Caller holds db_lock
+static void add_record(off_t offset, const struct record_header *header, const char *key) {
+    append_hint(&active_hints, offset, header, key);
+    index_apply(key, header, segments[num_segments - 1].id, offset, now_ms());
+}
+
+// Close the active segment if it's full. Caller holds db_lock
+static int maybe_roll_segment() {
+    if (segments[num_segments - 1].size < db_opts.segment_size) {
+        return 0;
+    }
+    return roll_segment(next_segment_id);
+}
+
+// Hints for each whole record in data. Returns the length of those
+// records; anything after it is a torn write
+static size_t collect_hints(const char *data, size_t size, struct buffer *hints) {
+    size_t offset = 0;
+    while (offset + sizeof(struct record_header) <= size) {
+        struct record_header header;
+        memcpy(&header, data + offset, sizeof(header));
+        uint64_t length = record_size(&header);
+        if (length > size - offset) break;
+
+        append_hint(hints, offset, &header, data + offset + sizeof(header));
+        offset += length;
+    }
+    return offset;
+}
+
+static void index_hints(uint32_t id, const char *hints, size_t size) {
+    uint64_t now = now_ms();
+    size_t offset = 0;
+    while (offset + sizeof(struct hint_header) <= size) {
+        struct hint_header hint;
+        memcpy(&hint, hints + offset, sizeof(hint));
+        if (hint.record.key_len > size - offset - sizeof(hint)) break;
+
+        index_apply(hints + offset + sizeof(hint), &hint.record, id, hint.offset, now);
+        offset += sizeof(hint) + hint.record.key_len;
+    }
+}
+
+// Rewrite a log from before segments as segment id, in today's format
+static int convert_legacy_log(const char *filename, uint32_t id) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return -1;
+    off_t size = lseek(fd, 0, SEEK_END);
+    char *data = read_file(fd, size);
+    close(fd);
+    if (!data) return -1;
+
+    struct buffer records = {0};
+    size_t offset = 0;
+    while (offset + sizeof(struct legacy_record_header) <= (size_t)size) {
+        struct legacy_record_header legacy;
+        memcpy(&legacy, data + offset, sizeof(legacy));
+        uint64_t length = sizeof(legacy) + (uint64_t)legacy.key_len + legacy.val_len;
+        if (length > size - offset) break;
+
+        struct record_header header = {legacy.key_len, legacy.val_len, 0};
+        buffer_append(&records, &header, sizeof(header));
+        buffer_append(&records, data + offset + sizeof(legacy), legacy.key_len + legacy.val_len);
+        offset += length;
+    }
+    free(data);
+
+    char name[4096];
+    segment_file(name, sizeof(name), id, "");
+    int result = write_file_atomic(name, records.data, records.used);
+    free(records.data);
+    if (result == 0) {
+        unlink(filename);
+    }
+    return result;
+}
+
+// Index a segment from its hint file, or by reading it if it has none.
+// The active segment keeps its hints in memory instead
+static int load_segment(struct segment *segment, bool active) {
+    char name[4096];
+    segment_file(name, sizeof(name), segment->id, ".hint");
+    int hint_fd = active ? -1 : open(name, O_RDONLY);
+    if (hint_fd >= 0) {
+        off_t size = lseek(hint_fd, 0, SEEK_END);
+        char *hints = read_file(hint_fd, size);
+        close(hint_fd);
+        if (!hints) return -1;
+        index_hints(segment->id, hints, size);
+        free(hints);
+        total_bytes += segment->size;
+        return 0;
+    }
+
+    char *data = read_file(segment->fd, segment->size);
+    if (!data) return -1;
+    struct buffer hints = {0};
+    size_t valid = collect_hints(data, segment->size, &hints);
+    free(data);
+
+    // Drop a torn tail so new records follow a whole one
+    if ((off_t)valid < segment->size) {
+        if (ftruncate(segment->fd, valid) != 0) return -1;
+        segment->size = valid;
+    }
+    index_hints(segment->id, hints.data, hints.used);
+    total_bytes += segment->size;
+
+    if (active) {
+        free(active_hints.data);
+        active_hints = hints;
+        return 0;
+    }
+    int result = write_hints(segment->id, &hints);
+    free(hints.data);
+    return result;
+}
+
+static int compare_ids(const void *a, const void *b) {
+    uint32_t left = *(const uint32_t *)a;
+    uint32_t right = *(const uint32_t *)b;
+    return (left > right) - (left < right);
+}
+
+// Ids of the segments on disk, in order. Clears away what an interrupted
+// write or merge left behind
+static uint32_t *list_segments(size_t *count) {
+    char dir[4096];
+    const char *base = strrchr(db_path, '/');
+    if (base) {
+        snprintf(dir, sizeof(dir), "%.*s", (int)(base - db_path), db_path);
+        base++;
+    } else {
+        strcpy(dir, ".");
+        base = db_path;
+    }
+    size_t base_len = strlen(base);
+
+    // A merge that got as far as this marker had its output in place;
+    // the segments it replaced may not all be gone yet
+    char marker[4096];
+    snprintf(marker, sizeof(marker), "%s.merged", db_path);
+    uint32_t merged_through = 0;
+    int marker_fd = open(marker, O_RDONLY);
+    if (marker_fd >= 0) {
+        if (pread(marker_fd, &merged_through, sizeof(merged_through), 0) != sizeof(merged_through)) {
+            merged_through = 0;
+        }
+        close(marker_fd);
+    }
+
+    uint32_t *ids = NULL;
+    *count = 0;
+    DIR *listing = opendir(dir[0] ? dir : "/");
+    if (!listing) return NULL;
+    struct dirent *file;
+    while ((file = readdir(listing)) != NULL) {
+        const char *name = file->d_name;
+        if (strncmp(name, base, base_len) != 0 || name[base_len] != '.') continue;
+        char *end;
+        unsigned long id = strtoul(name + base_len + 1, &end, 10);
+        if (end == name + base_len + 1) continue;
+
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/%s", dir[0] ? dir : "", name);
+        size_t suffix_len = strlen(end);
+        if (suffix_len >= 4 && strcmp(end + suffix_len - 4, ".tmp") == 0) {
+            unlink(path);
+        } else if (id <= merged_through && (*end == '\0' || strcmp(end, ".hint") == 0)) {
+            unlink(path);
+        } else if (*end == '\0') {
+            ids = realloc(ids, sizeof(uint32_t) * (*count + 1));
+            ids[(*count)++] = (uint32_t)id;
+        }
+    }
+    closedir(listing);
+    unlink(marker);
 
-        offset += 8 + key_len + val_len;
+    if (*count > 0) {
+        qsort(ids, *count, sizeof(uint32_t), compare_ids);
     }
+    return ids;
 }
 
+static void *merge_main(void *arg);
+static void *sync_main(void *arg);
+static void *sweep_main(void *arg);
+
 int db_open(const char *filename) {
-    db_fd = open(filename, O_RDWR | O_CREAT, 0644);
-    if (db_fd < 0) return -1;
+    return db_open_with_options(filename, NULL);
+}
+
+int db_open_with_options(const char *filename, const struct db_options *options) {
+    // Fields left zero get their defaults, so callers set only what they need
+    db_opts = options ? *options : (struct db_options){0};
+    if (db_opts.segment_size < 0) return -1;
+    if (db_opts.segment_size == 0) db_opts.segment_size = DB_DEFAULT_SEGMENT_SIZE;
+    if (db_opts.merge_interval_ms == 0) db_opts.merge_interval_ms = DB_DEFAULT_MERGE_INTERVAL_MS;
+    if (db_opts.sync_interval_ms == 0) db_opts.sync_interval_ms = DB_DEFAULT_SYNC_INTERVAL_MS;
+    if (db_opts.sweep_interval_ms == 0) db_opts.sweep_interval_ms = DB_DEFAULT_SWEEP_INTERVAL_MS;
+
+    db_path = strdup(filename);
+    next_segment_id = 1;
+    total_bytes = 0;
+    live_bytes = 0;
+    index_grow();
 
-    load_index();
+    size_t count;
+    uint32_t *ids = list_segments(&count);
+
+    // A single log from before segments is the first segment
+    if (count == 0 && access(filename, F_OK) == 0 && convert_legacy_log(filename, 1) == 0) {
+        ids = malloc(sizeof(uint32_t));
+        ids[0] = 1;
+        count = 1;
+    }
+
+    // Segments closed cleanly have hints; a last one without is where
+    // appending left off
+    for (size_t i = 0; i < count; i++) {
+        if (add_segment(ids[i]) != 0) {
+            free(ids);
+            return -1;
+        }
+    }
+    free(ids);
+
+    char hint_name[4096];
+    bool resume_last = false;
+    if (num_segments > 0) {
+        segment_file(hint_name, sizeof(hint_name), segments[num_segments - 1].id, ".hint");
+        resume_last = access(hint_name, F_OK) != 0;
+    }
+    for (size_t i = 0; i < num_segments; i++) {
+        bool active = resume_last && i == num_segments - 1;
+        if (load_segment(&segments[i], active) != 0) return -1;
+    }
+    if (!resume_last && add_segment(next_segment_id) != 0) return -1;
+    for (size_t i = 0; i + 1 < num_segments; i++) {
+        map_segment(&segments[i]);
+    }
+
+    stopping = false;
+    active_dirty = false;
+    if (db_opts.merge_interval_ms != DB_NEVER &&
+        pthread_create(&merge_thread, NULL, merge_main, NULL) == 0) {
+        merge_thread_running = true;
+    }
+    if (db_opts.sync_mode == DB_SYNC_PERIODIC) {
+        if (pthread_create(&sync_thread, NULL, sync_main, NULL) == 0) {
+            sync_thread_running = true;
+        }
+    }
+    sweep_next_slot = 0;
+    if (db_opts.sweep_interval_ms != DB_NEVER &&
+        pthread_create(&sweep_thread, NULL, sweep_main, NULL) == 0) {
+        sweep_thread_running = true;
+    }
     return 0;
 }
 
 void db_close() {
-    if (db_fd >= 0) close(db_fd);
+    pthread_mutex_lock(&db_lock);
+    stopping = true;
+    pthread_cond_broadcast(&background_wakeup);
+    pthread_mutex_unlock(&db_lock);
+    if (merge_thread_running) {
+        pthread_join(merge_thread, NULL);
+        merge_thread_running = false;
+    }
+    if (sync_thread_running) {
+        pthread_join(sync_thread, NULL);
+        sync_thread_running = false;
+    }
+    if (sweep_thread_running) {
+        pthread_join(sweep_thread, NULL);
+        sweep_thread_running = false;
+    }
+
+    // Leave hints for the active segment too, so the next open reads no
+    // values; an empty one isn't worth keeping
+    if (num_segments > 0) {
+        struct segment *active = &segments[num_segments - 1];
+        if (active->size == 0) {
+            char name[4096];
+            segment_file(name, sizeof(name), active->id, "");
+            unlink(name);
+        } else {
+            fsync(active->fd);
+            write_hints(active->id, &active_hints);
+        }
+    }
+
+    for (size_t i = 0; i < num_segments; i++) {
+        unmap_segment(&segments[i]);
+        close(segments[i].fd);
+    }
+    free(segments);
+    segments = NULL;
+    num_segments = 0;
+    free(active_hints.data);
+    active_hints = (struct buffer){0};
+    free(db_path);
+    db_path = NULL;
+    index_free();
+}
+
+// Append a record, its header in iov[0], and index it
+static int append_record(struct iovec *iov, int iovcnt, const struct record_header *header,
+                         const char *key) {
+    pthread_mutex_lock(&db_lock);
+    off_t offset = append_active(iov, iovcnt, record_size(header));
+    int result = -1;
+    if (offset >= 0) {
+        add_record(offset, header, key);
+        result = maybe_roll_segment();
+    }
+    pthread_mutex_unlock(&db_lock);
+    return result;
+}
+
+static int write_record(const char *key, const char *value, uint64_t expires_at) {
+    if (!value) return -1;    // Only db_del writes tombstones
+    struct record_header header = {strlen(key), strlen(value), expires_at};
+    struct iovec iov[3] = {
+        {&header, sizeof(header)},
+        {(void *)key, header.key_len},
+        {(void *)value, header.val_len},
+    };
+    return append_record(iov, 3, &header, key);
+}
+
+static int write_tombstone(const char *key) {
+    struct record_header header = {strlen(key), RECORD_TOMBSTONE, 0};
+    struct iovec iov[2] = {
+        {&header, sizeof(header)},
+        {(void *)key, header.key_len},
+    };
+    return append_record(iov, 2, &header, key);
 }
 
 int db_set(const char *key, const char *value) {
-    uint32_t key_len = strlen(key);
-    uint32_t val_len = strlen(value);
+    return write_record(key, value, 0);
+}
 
-    off_t offset = lseek(db_fd, 0, SEEK_END);
+int db_set_ttl(const char *key, const char *value, uint64_t ttl_ms) {
+    return write_record(key, value, now_ms() + ttl_ms);
+}
+
+int db_del(const char *key) {
+    uint32_t key_len = strlen(key);
+    pthread_mutex_lock(&db_lock);
+    struct index_entry *entry = index_find(key, key_len);
+    bool exists = entry && !is_expired(entry->expires_at, now_ms());
+    pthread_mutex_unlock(&db_lock);
 
-    write(db_fd, &key_len, 4);
-    write(db_fd, &val_len, 4);
-    write(db_fd, key, key_len);
-    write(db_fd, value, val_len);
+    // Nothing to hide, and an expired record already reads as deleted
+    if (!exists) return -1;
+    return write_tombstone(key);
+}
 
-    strncpy(db_index[index_size].key, key, MAX_KEY);
-    db_index[index_size].offset = offset;
-    index_size++;
+struct db_batch *db_batch_begin() {
+    return calloc(1, sizeof(struct db_batch));
+}
 
-    fsync(db_fd);
+int db_batch_put(struct db_batch *batch, const char *key, const char *value) {
+    if (!value) return -1;    // As for db_set
+    struct record_header header = {strlen(key), strlen(value), 0};
+    buffer_append(&batch->records, &header, sizeof(header));
+    buffer_append(&batch->records, key, header.key_len);
+    buffer_append(&batch->records, value, header.val_len);
     return 0;
 }
 
+int db_batch_commit(struct db_batch *batch) {
+    struct iovec iov = {batch->records.data, batch->records.used};
+    int result = 0;
+
+    pthread_mutex_lock(&db_lock);
+    off_t start = batch->records.used ? append_active(&iov, 1, batch->records.used) : 0;
+    if (start < 0) {
+        result = -1;
+    } else {
+        size_t offset = 0;
+        while (offset < batch->records.used) {
+            struct record_header header;
+            memcpy(&header, batch->records.data + offset, sizeof(header));
+            add_record(start + offset, &header, batch->records.data + offset + sizeof(header));
+            offset += record_size(&header);
+        }
+        result = maybe_roll_segment();
+    }
+    pthread_mutex_unlock(&db_lock);
+
+    free(batch->records.data);
+    free(batch);
+    return result;
+}
+
+
+// The live entry for key, dropping it if it has expired. Caller holds
+// db_lock
+static struct index_entry *find_live(const char *key, uint32_t key_len) {
+    if (index_capacity == 0) return NULL;    // Not open
+    struct index_entry *entry = index_find(key, key_len);
+    if (entry && is_expired(entry->expires_at, now_ms())) {
+        // The record stays in the log until a merge finds it dead
+        index_remove(entry);
+        entry = NULL;
+    }
+    return entry;
+}
+
+// Copy an entry's value into a new buffer with room for a terminator.
+// Caller holds db_lock
+static char *read_value(const struct index_entry *entry, uint32_t val_len) {
+    off_t offset = entry->offset + sizeof(struct record_header) + entry->key_len;
+    struct segment *segment = find_segment(entry->segment);
+    char *value = malloc(val_len + 1);
+    if (segment->map) {
+        memcpy(value, segment->map->data + offset, val_len);
+    } else if (pread(segment->fd, value, val_len, offset) != (ssize_t)val_len) {
+        free(value);
+        return NULL;
+    }
+    value[val_len] = '\0';
+    return value;
+}
+
+static uint32_t value_length(const struct index_entry *entry) {
+    return entry->size - sizeof(struct record_header) - entry->key_len;
+}
 
 char *db_get(const char *key) {
-    for (ssize_t i = index_size - 1; i >= 0; i--) {
-        if (strcmp(db_index[i].key, key) == 0) {
-            off_t offset = db_index[i].offset;
+    pthread_mutex_lock(&db_lock);
+    struct index_entry *entry = find_live(key, strlen(key));
+    char *value = entry ? read_value(entry, value_length(entry)) : NULL;
+    pthread_mutex_unlock(&db_lock);
+    return value;
+}
+
+int db_get_value(const char *key, struct db_value *value) {
+    pthread_mutex_lock(&db_lock);
+    struct index_entry *entry = find_live(key, strlen(key));
+    if (!entry) {
+        pthread_mutex_unlock(&db_lock);
+        return -1;
+    }
 
-            uint32_t key_len, val_len;
-            pread(db_fd, &key_len, 4, offset);
-            pread(db_fd, &val_len, 4, offset + 4);
+    value->len = value_length(entry);
+    struct segment *segment = find_segment(entry->segment);
+    if (segment->map) {
+        segment->map->refs++;
+        value->data = segment->map->data + entry->offset +
+                      sizeof(struct record_header) + entry->key_len;
+        value->owner = segment->map;
+    } else {
+        value->data = read_value(entry, value->len);
+        value->owner = NULL;
+    }
+    pthread_mutex_unlock(&db_lock);
+    return value->data ? 0 : -1;
+}
+
+void db_release_value(struct db_value *value) {
+    struct mapping *map = value->owner;
+    if (!map) {
+        free((char *)value->data);
+    } else {
+        pthread_mutex_lock(&db_lock);
+        if (--map->refs == 0 && map->retired) {
+            release_mapping(map);
+        }
+        pthread_mutex_unlock(&db_lock);
+    }
+    value->data = NULL;
+    value->owner = NULL;
+}
+
+// A merge output being filled: its records, their hints, and where each
+// record came from
+struct merge_output {
+    uint32_t id;
+    struct buffer data;
+    struct buffer hints;
+    struct buffer sources;   // struct merge_source per record
+};
+
+struct merge_source {
+    uint32_t segment;
+    off_t offset;
+};
+
+static int write_merge_output(struct merge_output *output) {
+    char name[4096];
+    segment_file(name, sizeof(name), output->id, ".tmp");
+    int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return -1;
+    int result = write_all(fd, output->data.data, output->data.used);
+    if (result == 0) result = fsync(fd);
+    close(fd);
+    if (result != 0) return -1;
+
+    segment_file(name, sizeof(name), output->id, ".hint.tmp");
+    fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return -1;
+    result = write_all(fd, output->hints.data, output->hints.used);
+    if (result == 0) result = fsync(fd);
+    close(fd);
+    return result;
+}
+
+static void free_merge_outputs(struct merge_output *outputs, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        free(outputs[i].data.data);
+        free(outputs[i].hints.data);
+        free(outputs[i].sources.data);
+    }
+    free(outputs);
+}
+
+// Swap the merge output in for the segments it replaces. Caller holds
+// db_lock. The output was written under temporary names; until the marker
+// exists, an open that finds both keeps both, and the output, having the
+// higher ids, wins
+// Remove every file a merge that failed wrote, under either name
+static void discard_merge_outputs(struct merge_output *outputs, size_t num_outputs) {
+    static const char *suffixes[] = {".tmp", ".hint.tmp", "", ".hint"};
+    char name[4096];
+    for (size_t i = 0; i < num_outputs; i++) {
+        for (size_t j = 0; j < sizeof(suffixes) / sizeof(suffixes[0]); j++) {
+            segment_file(name, sizeof(name), outputs[i].id, suffixes[j]);
+            unlink(name);
+        }
+    }
+}
+
+// Give the outputs their real names and open them as segments. On
+// failure nothing is left open
+static int open_merge_outputs(struct merge_output *outputs, size_t num_outputs,
+                              struct segment *opened) {
+    char from[4096], to[4096];
+    for (size_t i = 0; i < num_outputs; i++) {
+        segment_file(from, sizeof(from), outputs[i].id, ".tmp");
+        segment_file(to, sizeof(to), outputs[i].id, "");
+        if (rename(from, to) != 0) return -1;
+        segment_file(from, sizeof(from), outputs[i].id, ".hint.tmp");
+        segment_file(to, sizeof(to), outputs[i].id, ".hint");
+        if (rename(from, to) != 0) return -1;
+    }
+    for (size_t i = 0; i < num_outputs; i++) {
+        if (open_segment(outputs[i].id, &opened[i]) != 0) {
+            while (i-- > 0) {
+                close(opened[i].fd);
+            }
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int install_merge(struct merge_output *outputs, size_t num_outputs,
+                         size_t num_inputs) {
+    // Everything that can fail happens before the index or the segments
+    // change, so a failure leaves them as they were
+    struct segment *installed = malloc(sizeof(struct segment) * num_outputs);
+    if (open_merge_outputs(outputs, num_outputs, installed) != 0) {
+        free(installed);
+        return -1;
+    }
+    char to[4096];
+    uint32_t merged_through = segments[num_inputs - 1].id;
+    snprintf(to, sizeof(to), "%s.merged", db_path);
+    if (write_file_atomic(to, &merged_through, sizeof(merged_through)) != 0) {
+        for (size_t i = 0; i < num_outputs; i++) {
+            close(installed[i].fd);
+        }
+        free(installed);
+        return -1;
+    }
+
+    // Records overwritten since they were copied stay where they are
+    for (size_t i = 0; i < num_outputs; i++) {
+        const struct merge_source *sources = (const void *)outputs[i].sources.data;
+        size_t offset = 0;
+        for (size_t record = 0; offset < outputs[i].hints.used; record++) {
+            struct hint_header hint;
+            memcpy(&hint, outputs[i].hints.data + offset, sizeof(hint));
+            const char *key = outputs[i].hints.data + offset + sizeof(hint);
+            struct index_entry *entry = index_find(key, hint.record.key_len);
+            if (entry && entry->segment == sources[record].segment &&
+                entry->offset == sources[record].offset) {
+                entry->segment = outputs[i].id;
+                entry->offset = hint.offset;
+            }
+            offset += sizeof(hint) + hint.record.key_len;
+        }
+    }
+
+    // The inputs are the first segments; the output goes in their place
+    uint32_t *old_ids = malloc(sizeof(uint32_t) * num_inputs);
+    for (size_t i = 0; i < num_inputs; i++) {
+        old_ids[i] = segments[i].id;
+        total_bytes -= segments[i].size;
+        unmap_segment(&segments[i]);
+        close(segments[i].fd);
+    }
+    size_t num_rest = num_segments - num_inputs;
+    struct segment *merged = malloc(sizeof(struct segment) * (num_outputs + num_rest));
+    for (size_t i = 0; i < num_outputs; i++) {
+        merged[i] = installed[i];
+        total_bytes += merged[i].size;
+        map_segment(&merged[i]);
+    }
+    memcpy(merged + num_outputs, segments + num_inputs, sizeof(struct segment) * num_rest);
+    free(segments);
+    free(installed);
+    segments = merged;
+    num_segments = num_outputs + num_rest;
+
+    for (size_t i = 0; i < num_inputs; i++) {
+        segment_file(to, sizeof(to), old_ids[i], "");
+        unlink(to);
+        segment_file(to, sizeof(to), old_ids[i], ".hint");
+        unlink(to);
+    }
+    free(old_ids);
+    snprintf(to, sizeof(to), "%s.merged", db_path);
+    unlink(to);
+    return 0;
+}
+
+static int merge_segments() {
+    pthread_mutex_lock(&db_lock);
+    if (num_segments == 1 && segments[0].size == 0) {
+        pthread_mutex_unlock(&db_lock);
+        return 0;
+    }
+
+    // Close the active segment so all of the log can be merged. The
+    // output needs ids after the inputs but before anything written
+    // during the merge, so the new active segment leaves room for it
+    uint64_t input_bytes = 0;
+    for (size_t i = 0; i < num_segments; i++) {
+        input_bytes += segments[i].size;
+    }
+    uint32_t first_output = next_segment_id;
+    uint32_t max_outputs = input_bytes / db_opts.segment_size + 1;
+    if (roll_segment(first_output + max_outputs) != 0) {
+        pthread_mutex_unlock(&db_lock);
+        return -1;
+    }
+    size_t num_inputs = num_segments - 1;
+    struct segment *inputs = malloc(sizeof(struct segment) * num_inputs);
+    memcpy(inputs, segments, sizeof(struct segment) * num_inputs);
+    pthread_mutex_unlock(&db_lock);
+
+    // Inputs never change, so they're read without the lock; only the
+    // check of each record against the index takes it
+    struct merge_output *outputs = calloc(1, sizeof(struct merge_output));
+    size_t num_outputs = 1;
+    outputs[0].id = first_output;
+    uint64_t now = now_ms();
+    int result = 0;
+
+    for (size_t i = 0; i < num_inputs && result == 0; i++) {
+        // A mapped input stays mapped until install_merge
+        char *data = inputs[i].map ? inputs[i].map->data
+                                   : read_file(inputs[i].fd, inputs[i].size);
+        if (!data) {
+            result = -1;
+            break;
+        }
+
+        size_t offset = 0;
+        while (offset + sizeof(struct record_header) <= (size_t)inputs[i].size) {
+            struct record_header header;
+            memcpy(&header, data + offset, sizeof(header));
+            const char *key = data + offset + sizeof(header);
+            size_t size = record_size(&header);
+
+            // Tombstones are never in the index, so they're dropped along
+            // with everything older than them
+            pthread_mutex_lock(&db_lock);
+            struct index_entry *entry = index_find(key, header.key_len);
+            bool live = entry && entry->segment == inputs[i].id &&
+                        entry->offset == (off_t)offset;
+            if (live && is_expired(entry->expires_at, now)) {
+                index_remove(entry);    // Its record is about to go
+                live = false;
+            }
+            pthread_mutex_unlock(&db_lock);
+
+            if (live) {
+                struct merge_output *output = &outputs[num_outputs - 1];
+                if (output->data.used >= (size_t)db_opts.segment_size &&
+                    num_outputs < max_outputs) {
+                    result = write_merge_output(output);
+                    if (result != 0) break;
+                    outputs = realloc(outputs, sizeof(struct merge_output) * (num_outputs + 1));
+                    memset(&outputs[num_outputs], 0, sizeof(struct merge_output));
+                    outputs[num_outputs].id = first_output + num_outputs;
+                    output = &outputs[num_outputs++];
+                }
+
+                struct merge_source source = {inputs[i].id, offset};
+                append_hint(&output->hints, output->data.used, &header, key);
+                buffer_append(&output->sources, &source, sizeof(source));
+                buffer_append(&output->data, data + offset, size);
+            }
+            offset += size;
+        }
+        if (!inputs[i].map) free(data);
+    }
+    if (result == 0) {
+        result = write_merge_output(&outputs[num_outputs - 1]);
+    }
+
+    if (result == 0) {
+        pthread_mutex_lock(&db_lock);
+        result = install_merge(outputs, num_outputs, num_inputs);
+        pthread_mutex_unlock(&db_lock);
+    }
+    if (result != 0) {
+        discard_merge_outputs(outputs, num_outputs);
+    }
+    free(inputs);
+    free_merge_outputs(outputs, num_outputs);
+    return result;
+}
+
+int db_merge() {
+    pthread_mutex_lock(&merge_lock);
+    int result = merge_segments();
+    pthread_mutex_unlock(&merge_lock);
+    return result;
+}
+
+// Sleep on background_wakeup for up to ms, or until db_close. Caller
+// holds db_lock
+static void background_wait(unsigned ms) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += ms / 1000;
+    deadline.tv_nsec += (long)(ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(&background_wakeup, &db_lock, &deadline);
+}
+
+// Merge once there is a closed segment and half the log is garbage
+static void *merge_main(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&db_lock);
+    while (!stopping) {
+        background_wait(db_opts.merge_interval_ms);
+        if (stopping) break;
+
+        bool worth_it = num_segments > 1 && (total_bytes - live_bytes) * 2 > total_bytes;
+        if (worth_it) {
+            pthread_mutex_unlock(&db_lock);
+            db_merge();
+            pthread_mutex_lock(&db_lock);
+        }
+    }
+    pthread_mutex_unlock(&db_lock);
+    return NULL;
+}
+
+// Sync the active segment now and then for DB_SYNC_PERIODIC. The fsync
+// runs on a duplicate descriptor without db_lock, so writers carry on and
+// a merge may close the segment meanwhile
+static void *sync_main(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&db_lock);
+    while (!stopping) {
+        background_wait(db_opts.sync_interval_ms);
+        if (stopping || !active_dirty) continue;
+
+        int fd = dup(segments[num_segments - 1].fd);
+        active_dirty = false;
+        pthread_mutex_unlock(&db_lock);
+        if (fd >= 0) {
+            if (fsync(fd) != 0) perror("db: periodic sync");
+            close(fd);
+        }
+        pthread_mutex_lock(&db_lock);
+    }
+    pthread_mutex_unlock(&db_lock);
+    return NULL;
+}
 
-            char *value = malloc(val_len + 1);
-            pread(db_fd, value, val_len, offset + 8 + key_len);
-            value[val_len] = '\0';
+// Drop expired keys nobody reads, a slice of the index per pass, so they
+// stop holding memory and count as garbage for the merger. Their records
+// already say they're expired, so nothing is written
+static void *sweep_main(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&db_lock);
+    while (!stopping) {
+        background_wait(db_opts.sweep_interval_ms);
+        if (stopping) break;
 
-            return value;
+        uint64_t now = now_ms();
+        for (size_t n = 0; n < SWEEP_SLOTS_PER_PASS && n < index_capacity; n++) {
+            size_t slot = sweep_next_slot++ & (index_capacity - 1);
+            struct index_entry *entry = &db_index[slot];
+            // Removing shifts a later entry into this slot; look again
+            while (entry->key && is_expired(entry->expires_at, now)) {
+                index_remove(entry);
+            }
         }
     }
+    pthread_mutex_unlock(&db_lock);
     return NULL;
 }
@@ -1,14 +1,75 @@
 #ifndef DB_H
 #define DB_H
 
+#include <limits.h>
+#include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>  // for malloc/free
+#include <sys/types.h>
 
+#define DB_DEFAULT_SEGMENT_SIZE (64 * 1024 * 1024)
+#define DB_DEFAULT_MERGE_INTERVAL_MS 1000
+#define DB_DEFAULT_SYNC_INTERVAL_MS 100
+#define DB_DEFAULT_SWEEP_INTERVAL_MS 1000
+#define DB_NEVER UINT_MAX    // An interval that turns its background thread off
+
+// When writes reach the disk. A write is lost in a crash until it does
+enum db_sync_mode {
+    DB_SYNC_ALWAYS,     // Before db_set or db_batch_commit returns
+    DB_SYNC_PERIODIC,   // Every sync_interval_ms, by a background thread
+    DB_SYNC_NEVER,      // Whenever the OS gets to it
+};
+
+// A zero field takes its default
+struct db_options {
+    off_t segment_size;            // A segment is closed once it grows past this
+    unsigned merge_interval_ms;    // How often to look for garbage to merge
+    enum db_sync_mode sync_mode;
+    unsigned sync_interval_ms;     // For DB_SYNC_PERIODIC
+    unsigned sweep_interval_ms;    // How often to drop a slice of expired keys
+    bool mmap_segments;            // Read closed segments through mmap()
+};
+
+// The log is kept in segments <filename>.<id>, each closed one with a
+// <filename>.<id>.hint listing its keys. A file written before segments
+// existed becomes the first segment
 int db_open(const char *filename);
+int db_open_with_options(const char *filename, const struct db_options *options);
 void db_close();
 
+// -1 if value is NULL; deleting is db_del's job
 int db_set(const char *key, const char *value);
+// Set a key that reads as missing ttl_ms from now
+int db_set_ttl(const char *key, const char *value, uint64_t ttl_ms);
 char *db_get(const char *key);
+// Write a tombstone for the key. -1 if it doesn't exist
 int db_del(const char *key);
 
+// A value found by db_get_value. data isn't NUL-terminated
+struct db_value {
+    const char *data;
+    size_t len;
+    void *owner;
+};
+// Look up key without copying the value when its segment is mapped;
+// otherwise data is a private copy. Either way it stays valid, merges
+// included, until db_release_value, which must come before db_close.
+// -1 if the key doesn't exist
+int db_get_value(const char *key, struct db_value *value);
+void db_release_value(struct db_value *value);
+
+// Records put in a batch are written together by one writev() and synced
+// once. A crash can keep any prefix of them
+struct db_batch;
+struct db_batch *db_batch_begin();
+// -1 if value is NULL, leaving the batch as it was
+int db_batch_put(struct db_batch *batch, const char *key, const char *value);
+// Writes the batch and frees it, whether or not the write succeeded
+int db_batch_commit(struct db_batch *batch);
+
+// Rewrite the closed segments with only the records the index points to.
+// A background thread does this once half the log is garbage
+int db_merge();
+
 #endif
@@ -0,0 +1,75 @@
+#ifndef AGGREGATE_H
+#define AGGREGATE_H
+
+#include "db.h"
+#include "table.h"
+#include "cursor.h"
+#include <stdint.h>
+#include <stdio.h>
+
+typedef enum {
+    AGG_NONE,      // Not an aggregate: the GROUP BY column itself
+    AGG_COUNT,
+    AGG_SUM,
+    AGG_MIN,
+    AGG_MAX,
+    AGG_AVG,
+} AggregateFunc;
+
+// One output column of an aggregate query
+typedef struct {
+    AggregateFunc func;
+    int32_t column;        // The argument, or -1 for COUNT(*)
+} AggregateSpec;
+
+// Running state of one aggregate. Every function keeps all of it, which
+// is cheaper than branching on the function per row
+typedef struct {
+    uint64_t count;
+    int64_t sum;
+    int32_t min;
+    int32_t max;
+} Accumulator;
+
+// Streaming aggregation. Rows are folded into the accumulators of their
+// group as they are read, so nothing but one row per group is kept.
+// Groups are found through a hash table on the GROUP BY value; without
+// GROUP BY there is a single group
+typedef struct {
+    Schema* schema;
+    AggregateSpec* specs;
+    uint32_t num_specs;
+    int32_t group_column;        // -1 without GROUP BY
+    uint32_t key_size;           // Bytes of group key stored per group
+    char* row_key;               // A row's key, built here to look it up
+
+    // Groups in the order first seen
+    char* keys;                  // key_size bytes each, TEXT zero-padded
+    Accumulator* accumulators;   // num_specs each
+    uint32_t* hash_next;         // Next group in the same bucket
+    uint32_t num_groups;
+    uint32_t groups_capacity;
+
+    uint32_t* buckets;           // Bucket -> first group
+    uint32_t num_buckets;        // Power of two
+} Aggregation;
+
+Aggregation* aggregation_open(Schema* schema, const AggregateSpec* specs,
+                              uint32_t num_specs, int32_t group_column);
+
+// Fold one row into its group
+void aggregation_add_row(Aggregation* aggregation, const void* row);
+
+// Answer a whole-table aggregate without reading any row, when every spec
+// is COUNT(*) (summed from each leaf's cell count) or MIN or MAX of the
+// primary key (read from the first and last leaves). Returns false,
+// having done nothing, for anything else
+bool aggregation_from_tree(Aggregation* aggregation, Table* table);
+
+// Print one line per group, sorted by the GROUP BY value. Aggregates over
+// no rows, other than COUNT, print as NULL
+void aggregation_print(Aggregation* aggregation, FILE* out);
+
+void aggregation_free(Aggregation* aggregation);
+
+#endif // AGGREGATE_H
@@ -19,16 +19,27 @@
 #define LEAF_NODE_NUM_CELLS_OFFSET COMMON_NODE_HEADER_SIZE
 #define LEAF_NODE_NEXT_LEAF_SIZE sizeof(uint32_t)
 #define LEAF_NODE_NEXT_LEAF_OFFSET (LEAF_NODE_NUM_CELLS_OFFSET + LEAF_NODE_NUM_CELLS_SIZE)
-#define LEAF_NODE_HEADER_SIZE (COMMON_NODE_HEADER_SIZE + LEAF_NODE_NUM_CELLS_SIZE + LEAF_NODE_NEXT_LEAF_SIZE)
+#define LEAF_NODE_PREV_LEAF_SIZE sizeof(uint32_t)
+#define LEAF_NODE_PREV_LEAF_OFFSET (LEAF_NODE_NEXT_LEAF_OFFSET + LEAF_NODE_NEXT_LEAF_SIZE)
+#define LEAF_NODE_CONTENT_START_SIZE sizeof(uint16_t)
+#define LEAF_NODE_CONTENT_START_OFFSET (LEAF_NODE_PREV_LEAF_OFFSET + LEAF_NODE_PREV_LEAF_SIZE)
+#define LEAF_NODE_HEADER_SIZE (COMMON_NODE_HEADER_SIZE + LEAF_NODE_NUM_CELLS_SIZE + LEAF_NODE_NEXT_LEAF_SIZE + LEAF_NODE_PREV_LEAF_SIZE + LEAF_NODE_CONTENT_START_SIZE)
 
-// Leaf node body layout
-#define LEAF_NODE_KEY_SIZE sizeof(uint32_t)
+// Leaf node body layout (slotted page)
+// A directory of 2-byte cell offsets grows forward from the header while
+// cell contents grow backward from the end of the page.
+#define LEAF_NODE_SLOT_SIZE sizeof(uint16_t)
+#define LEAF_NODE_KEY_SIZE sizeof(uint64_t)
 #define LEAF_NODE_KEY_OFFSET 0
-#define LEAF_NODE_VALUE_SIZE_MAX 512  // Maximum value size
-#define LEAF_NODE_VALUE_OFFSET (LEAF_NODE_KEY_OFFSET + LEAF_NODE_KEY_SIZE)
-#define LEAF_NODE_CELL_SIZE (LEAF_NODE_KEY_SIZE + LEAF_NODE_VALUE_SIZE_MAX)
+#define LEAF_NODE_VALUE_SIZE_SIZE sizeof(uint16_t)
+#define LEAF_NODE_VALUE_SIZE_OFFSET (LEAF_NODE_KEY_OFFSET + LEAF_NODE_KEY_SIZE)
+#define LEAF_NODE_VALUE_OFFSET (LEAF_NODE_VALUE_SIZE_OFFSET + LEAF_NODE_VALUE_SIZE_SIZE)
 #define LEAF_NODE_SPACE_FOR_CELLS (PAGE_SIZE - LEAF_NODE_HEADER_SIZE)
-#define LEAF_NODE_MAX_CELLS 3  // Conservative to allow for splits
+// Space one cell takes up, counting its slot
+#define LEAF_NODE_CELL_SPACE(value_size) (LEAF_NODE_SLOT_SIZE + LEAF_NODE_VALUE_OFFSET + (value_size))
+// Largest value for which splitting a full leaf always leaves both
+// halves small enough to fit in a page
+#define LEAF_NODE_VALUE_SIZE_MAX (LEAF_NODE_SPACE_FOR_CELLS / 4 - LEAF_NODE_SLOT_SIZE - LEAF_NODE_VALUE_OFFSET)
 
 // Internal node layout
 #define INTERNAL_NODE_NUM_KEYS_SIZE sizeof(uint32_t)
@@ -38,11 +49,16 @@
 #define INTERNAL_NODE_HEADER_SIZE (COMMON_NODE_HEADER_SIZE + INTERNAL_NODE_NUM_KEYS_SIZE + INTERNAL_NODE_RIGHT_CHILD_SIZE)
 
 // Internal node body
-#define INTERNAL_NODE_KEY_SIZE sizeof(uint32_t)
+#define INTERNAL_NODE_KEY_SIZE sizeof(uint64_t)
 #define INTERNAL_NODE_CHILD_SIZE sizeof(uint32_t)
 #define INTERNAL_NODE_CELL_SIZE (INTERNAL_NODE_CHILD_SIZE + INTERNAL_NODE_KEY_SIZE)
 #define INTERNAL_NODE_MAX_CELLS ((PAGE_SIZE - INTERNAL_NODE_HEADER_SIZE) / INTERNAL_NODE_CELL_SIZE)
 
+// Fill below which a node is merged with or borrows from a sibling.
+// Leaves are measured in bytes, like their splits
+#define INTERNAL_NODE_MIN_KEYS (INTERNAL_NODE_MAX_CELLS / 2)
+#define LEAF_NODE_MIN_USED (LEAF_NODE_SPACE_FOR_CELLS / 3)
+
 
 
 
@@ -53,25 +69,32 @@ bool is_node_root(void* node);
 void set_node_root(void* node, bool is_root);
 uint32_t* leaf_node_num_cells(void* node);
 uint32_t* leaf_node_next_leaf(void* node);
+uint32_t* leaf_node_prev_leaf(void* node);
+uint16_t* leaf_node_content_start(void* node);
+uint16_t* leaf_node_slot(void* node, uint32_t cell_num);
 void* leaf_node_cell(void* node, uint32_t cell_num);
-uint32_t* leaf_node_key(void* node, uint32_t cell_num);
+uint64_t* leaf_node_key(void* node, uint32_t cell_num);
+uint16_t* leaf_node_value_size(void* node, uint32_t cell_num);
 void* leaf_node_value(void* node, uint32_t cell_num);
+uint32_t leaf_node_free_space(void* node);
+void leaf_node_insert_cell(void* node, uint32_t cell_num, uint64_t key, const void* value, uint32_t value_size);
+void leaf_node_delete_cell(void* node, uint32_t cell_num);
 uint32_t* internal_node_num_keys(void* node);
 uint32_t* internal_node_right_child(void* node);
 uint32_t* internal_node_cell(void* node, uint32_t cell_num);
 uint32_t* internal_node_child(void* node, uint32_t child_num);
-uint32_t* internal_node_key(void* node, uint32_t key_num);
+uint64_t* internal_node_key(void* node, uint32_t key_num);
 uint32_t* node_parent(void* node);
 // B+Tree operations
 void print_tree(Pager* pager, uint32_t page_num, uint32_t indentation_level);
 
 void initialize_leaf_node(void* node);
 void initialize_internal_node(void* node);
-uint32_t leaf_node_find(void* node, uint32_t key); 
-Cursor* internal_node_find(Table* table, uint32_t page_num, uint32_t key);
-uint32_t internal_node_find_child(void* node, uint32_t key);
-void update_internal_node_key(void* node, uint32_t old_key, uint32_t new_key);
+uint32_t leaf_node_find(void* node, uint64_t key);
+Cursor* internal_node_find(Table* table, uint32_t page_num, uint64_t key);
+uint32_t internal_node_find_child(void* node, uint64_t key);
+void update_internal_node_key(void* node, uint64_t old_key, uint64_t new_key);
 void print_tree(Pager* pager, uint32_t page_num, uint32_t indentation_level);
-uint32_t get_node_max_key(Pager* pager, void* node);
+uint64_t get_node_max_key(Pager* pager, void* node);
 
 #endif
@@ -9,21 +9,47 @@
 struct Cursor {
     Table* table;
     uint32_t page_num;
+    void* node;          // The leaf at page_num, which the cursor holds
     uint32_t cell_num;
     bool end_of_table;
 };
 
 Cursor* table_start(Table* table);
-Cursor* table_find(Table* table, uint32_t key);
-Cursor *table_find_greater_or_equal(Table *table, uint32_t key);
-Cursor* table_find_less_than(Table* table, uint32_t key);
+Cursor* table_find(Table* table, uint64_t key);
+Cursor *table_find_greater_or_equal(Table *table, uint64_t key);
+Cursor* table_find_less_than(Table* table, uint64_t key);
 bool cursor_retreat(Cursor *cursor);
 void* cursor_value(Cursor* cursor);
-uint32_t cursor_key(Cursor* cursor);
+uint64_t cursor_key(Cursor* cursor);
 void cursor_advance(Cursor* cursor);
-void leaf_node_insert(Cursor *cursor, uint32_t key, void *value, uint32_t row_size);
+// Skip to the first cell of the next leaf, or set end_of_table
+void cursor_next_leaf(Cursor* cursor);
+void leaf_node_insert(Cursor *cursor, uint64_t key, void *value, uint32_t row_size);
+// Remove the cell under the cursor, rebalancing the tree as needed.
+// The cursor's position is meaningless afterwards; free it
+void leaf_node_delete(Cursor *cursor);
 void create_new_root(Table* table, uint32_t root_page_num, uint32_t right_child_page_num);
 void cursor_free(Cursor* cursor);
+
+// Separator keys from the top of the tree that split the table into at
+// most max_keys + 1 key ranges of similar size: the root's, or those of
+// the level below too when the root has too few. Range i holds the keys
+// in (keys[i - 1], keys[i]]. Returns the number of keys written
+uint32_t table_split_keys(Table* table, uint64_t* keys, uint32_t max_keys);
 void internal_node_insert(Table* table, uint32_t parent_page_num, uint32_t child_page_num);
 
+// Supplies rows to table_bulk_load in ascending key order. Returns false
+// once there are no more rows
+typedef bool (*BulkLoadNext)(void* context, uint64_t* key, void* row);
+
+typedef enum {
+    BULK_LOAD_SUCCESS,
+    BULK_LOAD_TABLE_NOT_EMPTY,
+    BULK_LOAD_UNSORTED      // Nothing was loaded; the pages built are freed
+} BulkLoadResult;
+
+// Build an empty table's tree bottom-up, filling each node to fill_percent
+BulkLoadResult table_bulk_load(Table* table, BulkLoadNext next, void* context,
+                               uint32_t fill_percent, uint32_t* rows_loaded);
+
 #endif
@@ -6,18 +6,57 @@
 #include "pager.h"
 #include <string.h>
 #include <stdlib.h>
+#include <pthread.h>
 
 struct Database {
     Pager* pager;
     Catalog* catalog;
+
+    // Writer lock: one thread at a time changes the database, and the
+    // background writer takes it to checkpoint. Readers don't take it;
+    // they read from snapshots instead
+    pthread_mutex_t lock;
+    pthread_mutex_t background_lock;   // Guards background_running
+    pthread_cond_t background_wake;
+    pthread_t background_writer;
+    bool background_running;
+    uint32_t checkpoint_interval_ms;
+    uint32_t group_commit_ms;   // 0 unless the WAL is in group mode
+    uint64_t unsynced_commit;   // LSN db_unlock waits on, 0 for none
 };
 
 // Initialize a new database
-Database* db_open(const char* filename);
+Database* db_open(const char* filename, const DbOptions* options);
 
 // Close database
 void db_close(Database* db); 
 
+// Take or release the writer lock. The holder is the pager's writer.
+// Releasing it after a group mode commit then waits for the commit to be
+// synced, so other writers can commit meanwhile and share the fsync
+void db_lock(Database* db);
+void db_unlock(Database* db);
+
+// Commit the changes made since the last commit to the WAL, with one sync
+// (shared with other commits in group mode, and finished by db_unlock)
+void db_commit(Database* db);
+
+// Throw away the changes made since the last commit
+void db_rollback(Database* db);
+
+// Readers: see the database as of the last commit until the matching
+// end, however long that takes and whatever commits meanwhile. Cursors
+// opened outside a snapshot each take their own
+void db_begin_snapshot(Database* db);
+void db_end_snapshot(Database* db);
+
+// Flush dirty pages now. Returns pages written
+uint32_t db_checkpoint(Database* db);
+
+// Compact the file down to its live pages. Returns pages reclaimed.
+// Pages move, so no reader may be running or hold a snapshot
+uint32_t db_vacuum(Database* db);
+
 // Create a new table in the database
 Schema* db_create_table(Database* db, const char* table_name, uint32_t num_columns);
 
@@ -6,13 +6,27 @@
 
 // Page size (4KB)
 #define PAGE_SIZE 4096
-#define TABLE_MAX_PAGES 400
-#define MAX_TABLES 10
+#define MAX_TABLES 8  // Bounded by the catalog fitting in page 0
+#define CATALOG_PAGE_NUM 0
+
+// Buffer pool
+#define DEFAULT_POOL_FRAMES 256  // 1 MB of resident pages
+#define MIN_POOL_FRAMES 16
+#define DEFAULT_CHECKPOINT_INTERVAL_MS 5000
+
+// Write-ahead log
+#define DEFAULT_GROUP_COMMIT_SIZE 32   // Commits sharing one fsync
+#define DEFAULT_GROUP_COMMIT_MS 10     // Longest a commit waits for its group
+#define WAL_CHECKPOINT_SIZE (4 * 1024 * 1024) // Log size that forces a checkpoint
+
+// Address space reserved for the file in mmap mode
+#define MMAP_MAX_SIZE (1ULL << 30)
 
 // B+tree node configuration
 #define ORDER 4
 #define MAX_KEYS (ORDER - 1)
 #define MIN_KEYS ((ORDER + 1) / 2 - 1)
+#define DEFAULT_BULK_LOAD_FILL 90   // Percent of each node filled by a bulk load
 
 // Column types
 typedef enum {
@@ -26,6 +40,7 @@ typedef struct {
     ColumnType type;
     uint32_t size;
     bool is_pk;  // Is this column the primary key?
+    uint16_t offset;  // Byte offset of the column within a serialized row
 } Column;
 
 #define MAX_COLUMNS_PER_TABLE 10
@@ -38,17 +53,41 @@ typedef struct {
     uint32_t row_size;
     uint32_t root_page_num;  // Root page for this table's B+tree
     bool in_use;
+    bool is_index;  // A secondary index rather than a table
     int32_t pk_column;  // Index of PRIMARY KEY column (-1 if none)
     uint32_t next_rowid;  // Auto-increment if no PK
+    uint32_t index_table;   // Index only: catalog slot of the indexed table
+    uint32_t index_column;  // Index only: the column it is keyed on
 } Schema;
 
 // Database catalog (stored in page 0)
 typedef struct {
     uint32_t num_tables;
-    uint32_t next_free_page;
+    uint32_t free_list_head;   // First free-list trunk page, 0 if none
+    uint32_t num_free_pages;   // Pages on the free list, trunks included
+    uint64_t checkpoint_lsn;   // WAL records up to here are in the file
     Schema tables[MAX_TABLES];
 } Catalog;
 
+_Static_assert(sizeof(Catalog) <= PAGE_SIZE, "Catalog must fit in page 0");
+
+// When a commit is made durable
+typedef enum {
+    WAL_SYNC_FULL,   // write + fsync at every commit
+    WAL_SYNC_GROUP,  // commits wait to share one write + fsync
+    WAL_SYNC_OFF     // leave it to the OS
+} WalSyncMode;
+
+// Tunables passed to db_open / pager_open (NULL means defaults)
+typedef struct {
+    uint32_t pool_frames;  // Number of pages the buffer pool may hold
+    uint32_t checkpoint_interval_ms;  // Background checkpoint period, 0 = off
+    bool use_mmap;         // Map the file instead of using the buffer pool
+    WalSyncMode wal_sync;
+    uint32_t group_commit_size;
+    uint32_t group_commit_ms;
+} DbOptions;
+
 // Node types
 typedef enum {
     NODE_INTERNAL,
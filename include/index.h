@@ -0,0 +1,42 @@
+#ifndef INDEX_H
+#define INDEX_H
+
+#include "db.h"
+#include "database.h"
+#include "cursor.h"
+#include <stdint.h>
+
+// A secondary index is a B+tree whose keys pack (column value, row key)
+// into 64 bits and whose cells carry no value. Flipping the sign bit
+// makes signed column values sort correctly as unsigned.
+static inline uint64_t index_key(int32_t value, uint32_t row_key) {
+    return ((uint64_t)((uint32_t)value ^ 0x80000000u) << 32) | row_key;
+}
+
+// The indexed row's B+tree key (its PRIMARY KEY or ROWID)
+static inline uint32_t index_key_row(uint64_t key) {
+    return (uint32_t)key;
+}
+
+// Create an index on an INT column and fill it from the table's rows.
+// Returns NULL (after printing why) on error
+Schema* index_create(Database* db, const char* index_name, const char* table_name,
+                     const char* column_name);
+
+// Fill every index on the table from its rows. The indexes must be empty
+void index_build_all(Database* db, Schema* table);
+
+// Add a newly inserted row to every index on its table
+void index_insert_row(Database* db, Schema* table, const void* row, uint32_t row_key);
+
+// Remove a row about to be deleted from every index on its table
+void index_delete_row(Database* db, Schema* table, const void* row, uint32_t row_key);
+
+// Move a changed row's entries in the indexes whose key it changed
+void index_update_row(Database* db, Schema* table, const void* old_row, uint32_t old_key,
+                      const void* new_row, uint32_t new_key);
+
+// The index on table.column, or NULL
+Schema* index_find(Database* db, Schema* table, uint32_t column);
+
+#endif // INDEX_H
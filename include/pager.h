@@ -2,30 +2,195 @@
 #define PAGER_H
 
 #include "db.h"
+#include "wal.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#define INVALID_FRAME UINT32_MAX
+
+// mmap mode has no frames, so its latches are kept by page number and
+// allocated this many at a time as pages are first latched
+#define MAP_LATCH_CHUNK_PAGES 1024
+#define MAP_LATCH_CHUNKS (MMAP_MAX_SIZE / PAGE_SIZE / MAP_LATCH_CHUNK_PAGES)
+
+// Free pages are listed on trunk pages chained from the catalog's
+// free_list_head. A trunk holds the next trunk's page number, a count and
+// that many free page numbers; once empty the trunk itself is reused.
+#define FREE_TRUNK_NEXT_OFFSET 0
+#define FREE_TRUNK_COUNT_OFFSET sizeof(uint32_t)
+#define FREE_TRUNK_PAGES_OFFSET (2 * sizeof(uint32_t))
+#define FREE_TRUNK_MAX_PAGES ((PAGE_SIZE - FREE_TRUNK_PAGES_OFFSET) / sizeof(uint32_t))
+
+// One slot of the buffer pool
+typedef struct {
+    uint32_t page_num;
+    uint32_t pin_count;   // Frame can't be evicted while pinned
+    bool in_use;
+    bool dirty;           // Page differs from its on-disk copy
+    bool referenced;      // CLOCK second-chance bit
+    bool txn_dirty;       // Changed by the open transaction; not evictable
+    uint32_t hash_next;   // Next frame in the same page table bucket
+    uint64_t page_lsn;    // LSN of the last WAL record for this page
+    void* data;
+    pthread_rwlock_t* latch;  // Guards data; lives beside it in the chunk
+} Frame;
+
+// A page as it was before a transaction changed it. Readers whose
+// snapshot predates that transaction read this instead of the page
+typedef struct PageVersion {
+    uint32_t page_num;
+    uint32_t txn_id;      // Transaction that replaced it; UINT32_MAX until it commits
+    void* data;
+    struct PageVersion* next;   // Next version in the same bucket
+} PageVersion;
+
+// A page changed by the open transaction and its contents before that
+typedef struct {
+    uint32_t page_num;
+    PageVersion* before;
+    void* page;           // The page itself; resident until the commit
+} TxnPage;
+
+// Reader threads may use the pager alongside the one writer. The mutex
+// guards the pool's bookkeeping (page table, pins, frame flags, file
+// length); page contents are guarded by each page's reader/writer latch
 struct Pager {
+    pthread_mutex_t lock;
     int file_descriptor;
     uint32_t file_length;
     uint32_t num_pages;
-    void* pages[TABLE_MAX_PAGES];
+
+    // Buffer pool
+    uint32_t num_frames;
+    Frame* frames;
+    void** frame_chunks;         // Page memory, one allocation per growth
+    uint32_t num_frame_chunks;
+    uint32_t* page_table;        // Bucket -> first frame (page_num -> frame)
+    uint32_t page_table_size;    // Power of two
+    uint32_t clock_hand;
+
+    // mmap mode: pages are read straight out of a private file mapping
+    // and the kernel page cache takes the place of the buffer pool
+    char* map;                   // NULL when the buffer pool is in use
+    bool* page_dirty;            // Indexed by page number
+    uint32_t page_dirty_capacity;
+    pthread_rwlock_t** map_latches;   // MAP_LATCH_CHUNKS chunks, NULL until used
+
+    // Write-ahead log. Pages changed by a transaction stay in memory
+    // (no-steal) until pager_commit has logged them; the pool grows if
+    // a transaction touches more pages than it holds
+    Wal* wal;
+    TxnPage* txn_pages;
+    uint32_t num_txn_pages;
+    uint32_t txn_pages_capacity;
+
+    // Snapshots (MVCC). A reader sees the database as of the last commit
+    // before its snapshot; pages changed since are read from versions,
+    // which are kept until no open snapshot is older than their successor
+    uint32_t visible_txn_id;     // Last commit new snapshots see
+    uint32_t* snapshots;         // Each open snapshot's txn id
+    uint32_t num_snapshots;
+    uint32_t snapshots_capacity;
+    PageVersion** versions;      // Hash buckets by page number
+    uint32_t versions_size;      // Power of two
+    uint32_t num_versions;
 };
 
-Pager* pager_open(const char* filename);
+Pager* pager_open(const char* filename, const DbOptions* options);
+
+// Returns the page pinned; every call must be matched by pager_unpin_page
+void* pager_get_page(Pager* pager, uint32_t page_num);
+
+void pager_unpin_page(Pager* pager, uint32_t page_num);
+
+// Must be called before a resident page is modified. The first call for
+// a page in a transaction saves a version of it for readers, then takes
+// its latch exclusively, waiting for readers already on the page to
+// leave, and keeps it until pager_commit
+void pager_mark_dirty(Pager* pager, uint32_t page_num);
+
+// Log the open transaction's page changes to the WAL, commit it and
+// release its exclusive latches. Snapshots taken from now on see it.
+// Returns the commit's LSN, 0 if there was nothing to commit; in group
+// sync mode it isn't durable until wal_wait_commit on it returns
+uint64_t pager_commit(Pager* pager);
 
-void* pager_get_page(Pager* pager, uint32_t page_num); 
+// Put back every page the open transaction changed, as its before-images
+// hold them, and release its latches. Nothing was logged, so the WAL is
+// untouched. Pages it added to the end of the file stay unused until a
+// vacuum
+void pager_rollback(Pager* pager);
+
+// Make the calling thread the writer, or stop it being one. Only the
+// thread holding the database writer lock may change pages; since nothing
+// can change under it, it takes no shared latches
+void pager_set_writer(Pager* pager, bool is_writer);
+
+// Give the calling thread a snapshot of the last commit, which every
+// page it reads until the matching pager_end_snapshot comes from. Calls
+// nest; only the outermost takes the snapshot. No-ops for the writer
+void pager_begin_snapshot(Pager* pager);
+void pager_end_snapshot(Pager* pager);
+
+// The last commit the calling thread's snapshot sees, so other threads can
+// join it. False if the thread holds no snapshot or is the writer
+bool pager_snapshot_txn_id(Pager* pager, uint32_t* txn_id);
+
+// Begin a snapshot of txn_id, which a snapshot still open on another
+// thread must see; end it with pager_end_snapshot. Lets worker threads
+// read exactly what the thread that started them reads
+void pager_join_snapshot(Pager* pager, uint32_t txn_id);
+
+// For readers: the page as of the thread's snapshot (taking one for just
+// this page if it holds none). That is either the page itself, pinned
+// and latched shared, or a saved version; neither ever waits for the
+// writer. For the writer this is just pager_get_page
+void* pager_get_page_shared(Pager* pager, uint32_t page_num);
+
+// Release what pager_get_page_shared returned
+void pager_release_page_shared(Pager* pager, uint32_t page_num, void* page);
+
+// Free versions no open snapshot can read any more. Returns the number freed
+uint32_t pager_collect_versions(Pager* pager);
+
+// Apply a committed WAL record during recovery
+void pager_redo(Pager* pager, uint32_t page_num, uint32_t offset, const void* data, uint32_t size);
 
 void pager_flush(Pager* pager, uint32_t page_num);
 
-void pager_close(Pager* pager); 
+// Write a freshly allocated page straight to the file, bypassing the
+// buffer pool and the WAL. Call pager_sync before committing anything
+// that points at it
+void pager_write_new_page(Pager* pager, uint32_t page_num, const void* data);
+
+void pager_sync(Pager* pager);
+
+// Write every dirty page in page order and sync. Returns pages written
+uint32_t pager_checkpoint(Pager* pager);
+
+void pager_close(Pager* pager);
 
+// Takes a page off the free list if there is one, else extends the file.
+// Free-list changes go through the catalog and trunk pages like any other
+// page change, so they are logged and rolled back with the transaction
 uint32_t pager_allocate_page(Pager* pager);
 
+// Always a page past the end of the file. Use this for pages written
+// with pager_write_new_page, which must not overwrite a page the buffer
+// pool may still hold
+uint32_t pager_allocate_new_page(Pager* pager);
+
+void pager_free_page(Pager* pager, uint32_t page_num);
+
+// Checkpoint, then drop every page from num_pages on and shrink the file.
+// Nothing may still refer to those pages
+void pager_truncate(Pager* pager, uint32_t num_pages);
+
 #endif // PAGER_H
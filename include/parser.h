@@ -3,6 +3,7 @@
 
 #include "db.h"
 #include "database.h"
+#include "aggregate.h"
 #include <string.h>
 #include <stdlib.h>
 #include <strings.h>
@@ -19,6 +20,15 @@ typedef enum {
     STATEMENT_INSERT,
     STATEMENT_SELECT,
     STATEMENT_CREATE_TABLE,
+    STATEMENT_CREATE_INDEX,
+    STATEMENT_DELETE,
+    STATEMENT_UPDATE,
+    STATEMENT_BEGIN,
+    STATEMENT_COMMIT,
+    STATEMENT_ROLLBACK,
+    STATEMENT_PREPARE,
+    STATEMENT_EXECUTE,
+    STATEMENT_DEALLOCATE,
 } StatementType;
 
 // WHERE clause operator
@@ -32,6 +42,22 @@ typedef enum {
     OP_BETWEEN,        // BETWEEN x AND y
 } WhereOperator;
 
+// Where the value bound to a ? placeholder goes
+typedef enum {
+    PARAM_VALUE,         // INSERT value of column `column`
+    PARAM_WHERE_VALUE,
+    PARAM_WHERE_VALUE2,  // BETWEEN upper bound
+    PARAM_SET_VALUE,
+} ParamTarget;
+
+typedef struct {
+    ParamTarget target;
+    uint32_t column;
+} Param;
+
+// Enough for every value of an INSERT, or an UPDATE's SET and WHERE
+#define MAX_STATEMENT_PARAMS 16
+
 // Statement structure
 typedef struct {
     StatementType type;
@@ -41,14 +67,30 @@ typedef struct {
     // For CREATE TABLE
     uint32_t num_columns;
     Column* columns;
+    // For CREATE INDEX (table_name holds the indexed table)
+    char index_name[32];
+    char index_column[32];
     // For SELECT
     char** select_columns;  // NULL means SELECT *
     uint32_t num_select_columns;
+    // For aggregate queries: the function applied to each select column,
+    // whose name is then its argument ("*" for COUNT(*)). NULL if none
+    AggregateFunc* select_aggregates;
+    char group_column[32];  // GROUP BY column, empty if none
+    // For UPDATE: SET set_column = set_value
+    char set_column[32];
+    char set_value[256];
     // For WHERE clause
     WhereOperator where_op;
     char where_column[32];
     int32_t where_value;      // For =, >, <, >=, <=
     int32_t where_value2;     // For BETWEEN
+    // ? placeholders, in the order EXECUTE binds values to them
+    Param params[MAX_STATEMENT_PARAMS];
+    uint32_t num_params;
+    // For PREPARE, EXECUTE and DEALLOCATE
+    char prepared_name[32];
+    char* prepared_text;      // PREPARE: the statement; EXECUTE: its values
 } Statement;
 
 // Prepare result
@@ -86,6 +128,17 @@ static inline void close_input_buffer(InputBuffer* input_buffer) {
     free(input_buffer);
 }
 
+// A ? in place of a value is a placeholder, filled in by EXECUTE
+static inline bool is_param(const char* token) {
+    return strcmp(token, "?") == 0;
+}
+
+static inline void add_param(Statement* statement, ParamTarget target, uint32_t column) {
+    statement->params[statement->num_params].target = target;
+    statement->params[statement->num_params].column = column;
+    statement->num_params++;
+}
+
 // Parse CREATE TABLE statement
 static inline PrepareResult prepare_create_table(InputBuffer* input_buffer, Statement* statement) {
     statement->type = STATEMENT_CREATE_TABLE;
@@ -117,6 +170,38 @@ static inline PrepareResult prepare_create_table(InputBuffer* input_buffer, Stat
     return PREPARE_SUCCESS;
 }
 
+// Parse CREATE INDEX <name> ON <table>(<column>)
+static inline PrepareResult prepare_create_index(InputBuffer* input_buffer, Statement* statement) {
+    statement->type = STATEMENT_CREATE_INDEX;
+
+    // Parentheses are just separators
+    for (char* c = input_buffer->buffer; *c; c++) {
+        if (*c == '(' || *c == ')') {
+            *c = ' ';
+        }
+    }
+
+    strtok(input_buffer->buffer, " ");  // "create"
+    strtok(NULL, " ");                  // "index"
+    char* index_name = strtok(NULL, " ");
+    char* on = strtok(NULL, " ");
+    char* table_name = strtok(NULL, " ");
+    char* column = strtok(NULL, " ");
+    if (!index_name || !on || strcasecmp(on, "on") != 0 || !table_name || !column) {
+        printf("Syntax: CREATE INDEX <name> ON <table>(<column>)\n");
+        return PREPARE_SYNTAX_ERROR;
+    }
+
+    strncpy(statement->index_name, index_name, 31);
+    statement->index_name[31] = '\0';
+    strncpy(statement->table_name, table_name, 31);
+    statement->table_name[31] = '\0';
+    strncpy(statement->index_column, column, 31);
+    statement->index_column[31] = '\0';
+
+    return PREPARE_SUCCESS;
+}
+
 // Parse INSERT statement
 static inline PrepareResult prepare_insert(InputBuffer* input_buffer, Statement* statement, Database* db) {
     statement->type = STATEMENT_INSERT;
@@ -168,6 +253,10 @@ static inline PrepareResult prepare_insert(InputBuffer* input_buffer, Statement*
             return PREPARE_SYNTAX_ERROR;
         }
         
+        if (is_param(token)) {
+            add_param(statement, PARAM_VALUE, i);
+        }
+        
         Column* col = &schema->columns[i];
         if (col->type == COL_TYPE_INT) {
             statement->values[i] = malloc(sizeof(int32_t));
@@ -184,18 +273,200 @@ static inline PrepareResult prepare_insert(InputBuffer* input_buffer, Statement*
     return PREPARE_SUCCESS;
 }
 
+// Parse an optional WHERE clause starting at token, the next strtok'd
+// token of the line
+// Syntax: WHERE column op value
+// or: WHERE column BETWEEN value1 AND value2
+static inline PrepareResult prepare_where_clause(Statement* statement, Schema* schema, char* token) {
+    statement->where_op = OP_NONE;
+    
+    if (!token || strcasecmp(token, "where") != 0) {
+        return PREPARE_SUCCESS;
+    }
+    
+    // Get column name
+    token = strtok(NULL, " ");
+    if (!token) {
+        printf("Error: Expected column name after WHERE\n");
+        return PREPARE_SYNTAX_ERROR;
+    }
+    
+    strncpy(statement->where_column, token, 31);
+    statement->where_column[31] = '\0';
+    
+    // Verify column exists
+    int32_t column = schema_find_column(schema, statement->where_column);
+    if (column == -1) {
+        printf("Error: Column '%s' not found in WHERE clause\n", statement->where_column);
+        return PREPARE_SYNTAX_ERROR;
+    }
+    // Only support INT columns in WHERE for now
+    if (schema->columns[column].type != COL_TYPE_INT) {
+        printf("Error: WHERE clause only supports INT columns\n");
+        return PREPARE_SYNTAX_ERROR;
+    }
+    
+    // Get operator
+    token = strtok(NULL, " ");
+    if (!token) {
+        printf("Error: Expected operator after column name\n");
+        return PREPARE_SYNTAX_ERROR;
+    }
+    
+    if (strcmp(token, "=") == 0) {
+        statement->where_op = OP_EQUAL;
+    } else if (strcmp(token, ">") == 0) {
+        statement->where_op = OP_GREATER;
+    } else if (strcmp(token, "<") == 0) {
+        statement->where_op = OP_LESS;
+    } else if (strcmp(token, ">=") == 0) {
+        statement->where_op = OP_GREATER_EQUAL;
+    } else if (strcmp(token, "<=") == 0) {
+        statement->where_op = OP_LESS_EQUAL;
+    } else if (strcasecmp(token, "between") == 0) {
+        statement->where_op = OP_BETWEEN;
+    } else {
+        printf("Error: Unknown operator '%s'. Supported: =, >, <, >=, <=, BETWEEN\n", token);
+        return PREPARE_SYNTAX_ERROR;
+    }
+    
+    // Get value(s)
+    token = strtok(NULL, " ");
+    if (!token) {
+        printf("Error: Expected value after operator\n");
+        return PREPARE_SYNTAX_ERROR;
+    }
+    
+    statement->where_value = atoi(token);
+    if (is_param(token)) {
+        add_param(statement, PARAM_WHERE_VALUE, 0);
+    }
+    
+    if (statement->where_op == OP_BETWEEN) {
+        // Expect AND
+        token = strtok(NULL, " ");
+        if (!token || strcasecmp(token, "and") != 0) {
+            printf("Error: Expected AND in BETWEEN clause\n");
+            return PREPARE_SYNTAX_ERROR;
+        }
+        
+        // Get second value
+        token = strtok(NULL, " ");
+        if (!token) {
+            printf("Error: Expected second value in BETWEEN clause\n");
+            return PREPARE_SYNTAX_ERROR;
+        }
+        
+        statement->where_value2 = atoi(token);
+        if (is_param(token)) {
+            add_param(statement, PARAM_WHERE_VALUE2, 0);
+        }
+    }
+    
+    return PREPARE_SUCCESS;
+}
+
+// Parse an optional WHERE clause from the rest of the strtok'd line
+static inline PrepareResult prepare_where(Statement* statement, Schema* schema) {
+    return prepare_where_clause(statement, schema, strtok(NULL, " "));
+}
+
+// Split a select column of the form FUNC(arg) in place, leaving just the
+// argument. Returns AGG_NONE, with the token untouched, for anything else
+static inline AggregateFunc parse_aggregate(char* token) {
+    static const struct {
+        const char* name;
+        AggregateFunc func;
+    } functions[] = {
+        {"count", AGG_COUNT}, {"sum", AGG_SUM}, {"min", AGG_MIN},
+        {"max", AGG_MAX},     {"avg", AGG_AVG},
+    };
+
+    char* open = strchr(token, '(');
+    size_t length = strlen(token);
+    if (!open || token[length - 1] != ')' || open + 1 == token + length - 1) {
+        return AGG_NONE;
+    }
+
+    *open = '\0';
+    AggregateFunc func = AGG_NONE;
+    for (size_t i = 0; i < sizeof(functions) / sizeof(functions[0]); i++) {
+        if (strcasecmp(token, functions[i].name) == 0) {
+            func = functions[i].func;
+        }
+    }
+    if (func == AGG_NONE) {
+        *open = '(';
+        return AGG_NONE;
+    }
+
+    token[length - 1] = '\0';
+    memmove(token, open + 1, strlen(open + 1) + 1);
+    return func;
+}
+
+static inline void free_select_columns(Statement* statement) {
+    if (statement->select_columns) {
+        for (uint32_t i = 0; i < statement->num_select_columns; i++) {
+            free(statement->select_columns[i]);
+        }
+        free(statement->select_columns);
+        statement->select_columns = NULL;
+    }
+    free(statement->select_aggregates);
+    statement->select_aggregates = NULL;
+}
+
+// Parse an optional GROUP BY clause starting at token, then check the
+// select list against it: once there are aggregates or groups, every
+// plain column must be the GROUP BY column
+static inline PrepareResult prepare_group_by(Statement* statement, Schema* schema, char* token) {
+    statement->group_column[0] = '\0';
+
+    if (token && strcasecmp(token, "group") == 0) {
+        char* by = strtok(NULL, " ");
+        char* column = strtok(NULL, " ");
+        if (!by || strcasecmp(by, "by") != 0 || !column) {
+            printf("Syntax: SELECT ... FROM <table> [WHERE ...] GROUP BY <column>\n");
+            return PREPARE_SYNTAX_ERROR;
+        }
+        if (schema_find_column(schema, column) == -1) {
+            printf("Error: Column '%s' not found in GROUP BY\n", column);
+            return PREPARE_SYNTAX_ERROR;
+        }
+        strncpy(statement->group_column, column, 31);
+        statement->group_column[31] = '\0';
+    }
+
+    if (!statement->select_aggregates && statement->group_column[0] == '\0') {
+        return PREPARE_SUCCESS;
+    }
+    if (!statement->select_columns) {
+        printf("Error: SELECT * can't be grouped or aggregated\n");
+        return PREPARE_SYNTAX_ERROR;
+    }
+    for (uint32_t i = 0; i < statement->num_select_columns; i++) {
+        if (statement->select_aggregates && statement->select_aggregates[i] != AGG_NONE) {
+            continue;
+        }
+        if (strcasecmp(statement->select_columns[i], statement->group_column) != 0) {
+            printf("Error: Column '%s' must be in GROUP BY or inside an aggregate\n",
+                   statement->select_columns[i]);
+            return PREPARE_SYNTAX_ERROR;
+        }
+    }
+
+    return PREPARE_SUCCESS;
+}
+
 // Parse SELECT statement
 static inline PrepareResult prepare_select(InputBuffer* input_buffer, Statement* statement, Database* db) {
     statement->type = STATEMENT_SELECT;
     statement->select_columns = NULL;
     statement->num_select_columns = 0;
+    statement->select_aggregates = NULL;
     
-    // Make a copy of the buffer since strtok modifies it
-    char buffer_copy[1024];
-    strncpy(buffer_copy, input_buffer->buffer, 1023);
-    buffer_copy[1023] = '\0';
-    
-    char* token = strtok(buffer_copy, " ");  // "select"
+    char* token = strtok(input_buffer->buffer, " ");  // "select"
     token = strtok(NULL, " ");  // "*" or first column name
     
     if (!token) {
@@ -209,35 +480,25 @@ static inline PrepareResult prepare_select(InputBuffer* input_buffer, Statement*
         statement->select_columns = NULL;  // NULL means all columns
         token = strtok(NULL, " ");
     } else {
-        // Parse column list - count how many columns before "from"
-        uint32_t col_count = 0;
-        char* count_token = token;
-        while (count_token && strcasecmp(count_token, "from") != 0) {
-            col_count++;
-            count_token = strtok(NULL, " ");
+        // Parse column list up to "from", growing the array as it goes
+        uint32_t capacity = 0;
+        while (token && strcasecmp(token, "from") != 0) {
+            if (statement->num_select_columns == capacity) {
+                capacity = capacity ? capacity * 2 : 4;
+                statement->select_columns =
+                    (char**)realloc(statement->select_columns, sizeof(char*) * capacity);
+            }
+            char* column = (char*)malloc(32);
+            strncpy(column, token, 31);
+            column[31] = '\0';
+            statement->select_columns[statement->num_select_columns++] = column;
+            token = strtok(NULL, " ");
         }
         
-        if (col_count == 0) {
+        if (statement->num_select_columns == 0) {
             printf("Error: No columns specified\n");
             return PREPARE_SYNTAX_ERROR;
         }
-        
-        // Allocate space for column names
-        statement->select_columns = (char**)malloc(sizeof(char*) * col_count);
-        statement->num_select_columns = col_count;
-        
-        // Parse again to get the columns
-        strncpy(buffer_copy, input_buffer->buffer, 1023);
-        buffer_copy[1023] = '\0';
-        token = strtok(buffer_copy, " ");  // "select"
-        token = strtok(NULL, " ");  // first column
-        
-        for (uint32_t i = 0; i < col_count; i++) {
-            statement->select_columns[i] =(char*) malloc( 32);
-            strncpy(statement->select_columns[i], token, 31);
-            statement->select_columns[i][31] = '\0';
-            token = strtok(NULL, " ");
-        }
     }
     
     // Skip "from" keyword if present
@@ -247,12 +508,7 @@ static inline PrepareResult prepare_select(InputBuffer* input_buffer, Statement*
     
     if (!token) {
         printf("Error: Table name required\n");
-        if (statement->select_columns) {
-            for (uint32_t i = 0; i < statement->num_select_columns; i++) {
-                free(statement->select_columns[i]);
-            }
-            free(statement->select_columns);
-        }
+        free_select_columns(statement);
         return PREPARE_SYNTAX_ERROR;
     }
     
@@ -264,186 +520,282 @@ static inline PrepareResult prepare_select(InputBuffer* input_buffer, Statement*
     Schema* schema = db_get_table(db, statement->table_name);
     if (!schema) {
         printf("Table '%s' not found\n", statement->table_name);
-        if (statement->select_columns) {
-            for (uint32_t i = 0; i < statement->num_select_columns; i++) {
-                free(statement->select_columns[i]);
+        free_select_columns(statement);
+        return PREPARE_TABLE_NOT_FOUND;
+    }
+    
+    // Aggregate calls name their argument in place of a column
+    if (statement->select_columns) {
+        for (uint32_t i = 0; i < statement->num_select_columns; i++) {
+            AggregateFunc func = parse_aggregate(statement->select_columns[i]);
+            if (func == AGG_NONE) {
+                continue;
+            }
+            if (!statement->select_aggregates) {
+                statement->select_aggregates =
+                    (AggregateFunc*)calloc(statement->num_select_columns, sizeof(AggregateFunc));
             }
-            free(statement->select_columns);
+            statement->select_aggregates[i] = func;
         }
-        return PREPARE_TABLE_NOT_FOUND;
     }
     
     // Verify all column names exist in schema
     if (statement->select_columns) {
         for (uint32_t i = 0; i < statement->num_select_columns; i++) {
-            bool found = false;
-            for (uint32_t j = 0; j < schema->num_columns; j++) {
-                if (strcasecmp(statement->select_columns[i], schema->columns[j].name) == 0) {
-                    found = true;
-                    break;
-                }
+            AggregateFunc func =
+                statement->select_aggregates ? statement->select_aggregates[i] : AGG_NONE;
+            if (func == AGG_COUNT && strcmp(statement->select_columns[i], "*") == 0) {
+                continue;
             }
-            if (!found) {
+            int32_t column = schema_find_column(schema, statement->select_columns[i]);
+            if (column == -1) {
                 printf("Error: Column '%s' not found in table '%s'\n", 
                        statement->select_columns[i], statement->table_name);
-                for (uint32_t k = 0; k < statement->num_select_columns; k++) {
-                    free(statement->select_columns[k]);
-                }
-                free(statement->select_columns);
+                free_select_columns(statement);
+                return PREPARE_SYNTAX_ERROR;
+            }
+            if (func != AGG_NONE && func != AGG_COUNT &&
+                schema->columns[column].type != COL_TYPE_INT) {
+                printf("Error: Only COUNT works on TEXT column '%s'\n",
+                       statement->select_columns[i]);
+                free_select_columns(statement);
                 return PREPARE_SYNTAX_ERROR;
             }
         }
     }
     
-    // Parse WHERE clause (optional)
-    // Syntax: WHERE column op value
-    // or: WHERE column BETWEEN value1 AND value2
-    statement->where_op = OP_NONE;
-    token = strtok(NULL, " ");
+    // Parse WHERE and GROUP BY clauses (both optional)
+    char* clause = strtok(NULL, " ");
+    if (prepare_where_clause(statement, schema, clause) != PREPARE_SUCCESS) {
+        free_select_columns(statement);
+        return PREPARE_SYNTAX_ERROR;
+    }
+    if (statement->where_op != OP_NONE) {
+        clause = strtok(NULL, " ");
+    }
+    if (prepare_group_by(statement, schema, clause) != PREPARE_SUCCESS) {
+        free_select_columns(statement);
+        return PREPARE_SYNTAX_ERROR;
+    }
     
-    if (token && strcasecmp(token, "where") == 0) {
-        // Get column name
-        token = strtok(NULL, " ");
-        if (!token) {
-            printf("Error: Expected column name after WHERE\n");
-            if (statement->select_columns) {
-                for (uint32_t i = 0; i < statement->num_select_columns; i++) {
-                    free(statement->select_columns[i]);
-                }
-                free(statement->select_columns);
-            }
-            return PREPARE_SYNTAX_ERROR;
-        }
-        
-        strncpy(statement->where_column, token, 31);
-        statement->where_column[31] = '\0';
-        
-        // Verify column exists
-        bool col_found = false;
-        for (uint32_t i = 0; i < schema->num_columns; i++) {
-            if (strcasecmp(statement->where_column, schema->columns[i].name) == 0) {
-                col_found = true;
-                // Only support INT columns in WHERE for now
-                if (schema->columns[i].type != COL_TYPE_INT) {
-                    printf("Error: WHERE clause only supports INT columns\n");
-                    if (statement->select_columns) {
-                        for (uint32_t j = 0; j < statement->num_select_columns; j++) {
-                            free(statement->select_columns[j]);
-                        }
-                        free(statement->select_columns);
-                    }
-                    return PREPARE_SYNTAX_ERROR;
-                }
-                break;
-            }
-        }
-        if (!col_found) {
-            printf("Error: Column '%s' not found in WHERE clause\n", statement->where_column);
-            if (statement->select_columns) {
-                for (uint32_t i = 0; i < statement->num_select_columns; i++) {
-                    free(statement->select_columns[i]);
-                }
-                free(statement->select_columns);
-            }
-            return PREPARE_SYNTAX_ERROR;
-        }
-        
-        // Get operator
+    return PREPARE_SUCCESS;
+}
+
+// Parse DELETE FROM <table> [WHERE ...]
+static inline PrepareResult prepare_delete(InputBuffer* input_buffer, Statement* statement, Database* db) {
+    statement->type = STATEMENT_DELETE;
+    
+    strtok(input_buffer->buffer, " ");  // "delete"
+    char* token = strtok(NULL, " ");
+    if (token && strcasecmp(token, "from") == 0) {
         token = strtok(NULL, " ");
-        if (!token) {
-            printf("Error: Expected operator after column name\n");
-            if (statement->select_columns) {
-                for (uint32_t i = 0; i < statement->num_select_columns; i++) {
-                    free(statement->select_columns[i]);
-                }
-                free(statement->select_columns);
-            }
-            return PREPARE_SYNTAX_ERROR;
-        }
-        
-        if (strcmp(token, "=") == 0) {
-            statement->where_op = OP_EQUAL;
-        } else if (strcmp(token, ">") == 0) {
-            statement->where_op = OP_GREATER;
-        } else if (strcmp(token, "<") == 0) {
-            statement->where_op = OP_LESS;
-        } else if (strcmp(token, ">=") == 0) {
-            statement->where_op = OP_GREATER_EQUAL;
-        } else if (strcmp(token, "<=") == 0) {
-            statement->where_op = OP_LESS_EQUAL;
-        } else if (strcasecmp(token, "between") == 0) {
-            statement->where_op = OP_BETWEEN;
+    }
+    if (!token) {
+        printf("Syntax: DELETE FROM <table> [WHERE <col> <op> <val>]\n");
+        return PREPARE_SYNTAX_ERROR;
+    }
+    
+    strncpy(statement->table_name, token, 31);
+    statement->table_name[31] = '\0';
+    
+    Schema* schema = db_get_table(db, statement->table_name);
+    if (!schema) {
+        printf("Table '%s' not found\n", statement->table_name);
+        return PREPARE_TABLE_NOT_FOUND;
+    }
+    
+    return prepare_where(statement, schema);
+}
+
+// Parse UPDATE <table> SET <col> = <val> [WHERE ...]
+static inline PrepareResult prepare_update(InputBuffer* input_buffer, Statement* statement, Database* db) {
+    statement->type = STATEMENT_UPDATE;
+    
+    strtok(input_buffer->buffer, " ");  // "update"
+    char* table_name = strtok(NULL, " ");
+    char* set = strtok(NULL, " ");
+    char* column = strtok(NULL, " ");
+    char* equals = strtok(NULL, " ");
+    char* value = strtok(NULL, " ");
+    if (!table_name || !set || strcasecmp(set, "set") != 0 || !column ||
+        !equals || strcmp(equals, "=") != 0 || !value) {
+        printf("Syntax: UPDATE <table> SET <col> = <val> [WHERE <col> <op> <val>]\n");
+        return PREPARE_SYNTAX_ERROR;
+    }
+    
+    strncpy(statement->table_name, table_name, 31);
+    statement->table_name[31] = '\0';
+    
+    Schema* schema = db_get_table(db, statement->table_name);
+    if (!schema) {
+        printf("Table '%s' not found\n", statement->table_name);
+        return PREPARE_TABLE_NOT_FOUND;
+    }
+    
+    if (schema_find_column(schema, column) == -1) {
+        printf("Error: Column '%s' not found in table '%s'\n", column, statement->table_name);
+        return PREPARE_SYNTAX_ERROR;
+    }
+    strncpy(statement->set_column, column, 31);
+    statement->set_column[31] = '\0';
+    strncpy(statement->set_value, value, sizeof(statement->set_value) - 1);
+    statement->set_value[sizeof(statement->set_value) - 1] = '\0';
+    if (is_param(value)) {
+        add_param(statement, PARAM_SET_VALUE, 0);
+    }
+    
+    return prepare_where(statement, schema);
+}
+
+// Parse BEGIN, COMMIT or ROLLBACK, which take no arguments
+static inline PrepareResult prepare_transaction(InputBuffer* input_buffer, Statement* statement,
+                                                StatementType type, const char* keyword) {
+    statement->type = type;
+
+    char* token = strtok(input_buffer->buffer, " ");
+    if (!token || strcasecmp(token, keyword) != 0) {
+        return PREPARE_UNRECOGNIZED_STATEMENT;
+    }
+    if (strtok(NULL, " ")) {
+        printf("Syntax: %s\n", keyword);
+        return PREPARE_SYNTAX_ERROR;
+    }
+
+    return PREPARE_SUCCESS;
+}
+
+// Parse PREPARE <name> AS <statement>. The statement is kept as text in
+// prepared_text and compiled by the caller
+static inline PrepareResult prepare_prepare(InputBuffer* input_buffer, Statement* statement) {
+    statement->type = STATEMENT_PREPARE;
+
+    strtok(input_buffer->buffer, " ");  // "prepare"
+    char* name = strtok(NULL, " ");
+    char* as = strtok(NULL, " ");
+    char* text = strtok(NULL, "");      // The rest of the line
+    while (text && *text == ' ') {
+        text++;
+    }
+    if (!name || !as || strcasecmp(as, "as") != 0 || !text || *text == '\0') {
+        printf("Syntax: PREPARE <name> AS <statement>\n");
+        return PREPARE_SYNTAX_ERROR;
+    }
+
+    strncpy(statement->prepared_name, name, 31);
+    statement->prepared_name[31] = '\0';
+    statement->prepared_text = text;
+    return PREPARE_SUCCESS;
+}
+
+// Parse EXECUTE <name> [<val1> <val2> ...]
+// or DEALLOCATE <name>
+static inline PrepareResult prepare_execute(InputBuffer* input_buffer, Statement* statement,
+                                            StatementType type) {
+    statement->type = type;
+
+    strtok(input_buffer->buffer, " ");  // "execute" or "deallocate"
+    char* name = strtok(NULL, " ");
+    char* rest = strtok(NULL, "");
+    if (!name || (type == STATEMENT_DEALLOCATE && rest)) {
+        if (type == STATEMENT_EXECUTE) {
+            printf("Syntax: EXECUTE <name> [<val1> <val2> ...]\n");
         } else {
-            printf("Error: Unknown operator '%s'. Supported: =, >, <, >=, <=, BETWEEN\n", token);
-            if (statement->select_columns) {
-                for (uint32_t i = 0; i < statement->num_select_columns; i++) {
-                    free(statement->select_columns[i]);
-                }
-                free(statement->select_columns);
-            }
-            return PREPARE_SYNTAX_ERROR;
+            printf("Syntax: DEALLOCATE <name>\n");
         }
-        
-        // Get value(s)
-        token = strtok(NULL, " ");
+        return PREPARE_SYNTAX_ERROR;
+    }
+
+    strncpy(statement->prepared_name, name, 31);
+    statement->prepared_name[31] = '\0';
+    statement->prepared_text = rest;
+    return PREPARE_SUCCESS;
+}
+
+// Fill a prepared statement's ? placeholders, in order, from
+// whitespace-separated values. Values convert as they would in the
+// statement itself
+static inline PrepareResult bind_params(Statement* statement, Schema* schema, char* values) {
+    char* token = values ? strtok(values, " ") : NULL;
+
+    for (uint32_t i = 0; i < statement->num_params; i++) {
         if (!token) {
-            printf("Error: Expected value after operator\n");
-            if (statement->select_columns) {
-                for (uint32_t i = 0; i < statement->num_select_columns; i++) {
-                    free(statement->select_columns[i]);
-                }
-                free(statement->select_columns);
-            }
+            printf("Error: Expected %u values, got %u\n", statement->num_params, i);
             return PREPARE_SYNTAX_ERROR;
         }
-        
-        statement->where_value = atoi(token);
-        
-        if (statement->where_op == OP_BETWEEN) {
-            // Expect AND
-            token = strtok(NULL, " ");
-            if (!token || strcasecmp(token, "and") != 0) {
-                printf("Error: Expected AND in BETWEEN clause\n");
-                if (statement->select_columns) {
-                    for (uint32_t i = 0; i < statement->num_select_columns; i++) {
-                        free(statement->select_columns[i]);
-                    }
-                    free(statement->select_columns);
-                }
-                return PREPARE_SYNTAX_ERROR;
-            }
-            
-            // Get second value
-            token = strtok(NULL, " ");
-            if (!token) {
-                printf("Error: Expected second value in BETWEEN clause\n");
-                if (statement->select_columns) {
-                    for (uint32_t i = 0; i < statement->num_select_columns; i++) {
-                        free(statement->select_columns[i]);
-                    }
-                    free(statement->select_columns);
-                }
-                return PREPARE_SYNTAX_ERROR;
+
+        Param* param = &statement->params[i];
+        switch (param->target) {
+        case PARAM_VALUE: {
+            Column* col = &schema->columns[param->column];
+            if (col->type == COL_TYPE_INT) {
+                *(int32_t*)statement->values[param->column] = atoi(token);
+            } else {
+                strncpy((char*)statement->values[param->column], token, col->size - 1);
+                ((char*)statement->values[param->column])[col->size - 1] = '\0';
             }
-            
+            break;
+        }
+        case PARAM_WHERE_VALUE:
+            statement->where_value = atoi(token);
+            break;
+        case PARAM_WHERE_VALUE2:
             statement->where_value2 = atoi(token);
+            break;
+        case PARAM_SET_VALUE:
+            strncpy(statement->set_value, token, sizeof(statement->set_value) - 1);
+            statement->set_value[sizeof(statement->set_value) - 1] = '\0';
+            break;
         }
+        token = strtok(NULL, " ");
+    }
+
+    if (token) {
+        printf("Error: Expected %u values\n", statement->num_params);
+        return PREPARE_SYNTAX_ERROR;
     }
-    
     return PREPARE_SUCCESS;
 }
 
 // Main prepare statement function
 static inline PrepareResult prepare_statement(InputBuffer* input_buffer, Statement* statement, Database* db) {
+    statement->num_params = 0;
+
     if (strncasecmp(input_buffer->buffer, "create table", 12) == 0) {
         return prepare_create_table(input_buffer, statement);
     }
+    if (strncasecmp(input_buffer->buffer, "create index", 12) == 0) {
+        return prepare_create_index(input_buffer, statement);
+    }
     if (strncasecmp(input_buffer->buffer, "insert", 6) == 0) {
         return prepare_insert(input_buffer, statement, db);
     }
     if (strncasecmp(input_buffer->buffer, "select", 6) == 0) {
         return prepare_select(input_buffer, statement, db);
     }
+    if (strncasecmp(input_buffer->buffer, "delete", 6) == 0) {
+        return prepare_delete(input_buffer, statement, db);
+    }
+    if (strncasecmp(input_buffer->buffer, "update", 6) == 0) {
+        return prepare_update(input_buffer, statement, db);
+    }
+    if (strncasecmp(input_buffer->buffer, "begin", 5) == 0) {
+        return prepare_transaction(input_buffer, statement, STATEMENT_BEGIN, "BEGIN");
+    }
+    if (strncasecmp(input_buffer->buffer, "commit", 6) == 0) {
+        return prepare_transaction(input_buffer, statement, STATEMENT_COMMIT, "COMMIT");
+    }
+    if (strncasecmp(input_buffer->buffer, "rollback", 8) == 0) {
+        return prepare_transaction(input_buffer, statement, STATEMENT_ROLLBACK, "ROLLBACK");
+    }
+    if (strncasecmp(input_buffer->buffer, "prepare", 7) == 0) {
+        return prepare_prepare(input_buffer, statement);
+    }
+    if (strncasecmp(input_buffer->buffer, "execute", 7) == 0) {
+        return prepare_execute(input_buffer, statement, STATEMENT_EXECUTE);
+    }
+    if (strncasecmp(input_buffer->buffer, "deallocate", 10) == 0) {
+        return prepare_execute(input_buffer, statement, STATEMENT_DEALLOCATE);
+    }
 
     return PREPARE_UNRECOGNIZED_STATEMENT;
 }
@@ -460,11 +812,8 @@ static inline void free_statement(Statement* statement, Database* db) {
         free(statement->values);
     }
     
-    if (statement->type == STATEMENT_SELECT && statement->select_columns) {
-        for (uint32_t i = 0; i < statement->num_select_columns; i++) {
-            free(statement->select_columns[i]);
-        }
-        free(statement->select_columns);
+    if (statement->type == STATEMENT_SELECT) {
+        free_select_columns(statement);
     }
 }
 
@@ -0,0 +1,114 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+#include "db.h"
+#include "table.h"
+#include "btree.h"
+#include "cursor.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Most cells a leaf can hold, so a batch always fits a whole leaf
+#define SCAN_BATCH_MAX (LEAF_NODE_SPACE_FOR_CELLS / LEAF_NODE_CELL_SPACE(0))
+#define SCAN_SELECTION_WORDS ((SCAN_BATCH_MAX + 63) / 64)
+
+// A parallel scan cuts the table into this many key ranges per worker, so
+// a worker that drew a dense range doesn't leave the others idle
+#define SCAN_PARTITIONS_PER_WORKER 4
+#define SCAN_MAX_WORKERS 256
+
+// One leaf's worth of rows. Row pointers point into the leaf the scan's
+// cursor holds until the next call to batch_scan_next
+typedef struct {
+    uint32_t count;
+    uint32_t matches;
+    uint64_t keys[SCAN_BATCH_MAX];
+    const void* rows[SCAN_BATCH_MAX];
+    int32_t column[SCAN_BATCH_MAX];              // The filtered column
+    uint64_t selection[SCAN_SELECTION_WORDS];    // Bit i set if row i matches
+} ScanBatch;
+
+// Full scan filtering one INT column to lo <= value <= hi
+typedef struct {
+    Table* table;
+    bool filtered;            // False selects every row
+    uint16_t column_offset;   // Resolved once when the scan is opened
+    int32_t lo;
+    int32_t hi;
+    uint64_t last_key;        // Rows past this key are left out
+    Cursor* cursor;           // Holds the leaf the current batch points into
+    bool started;             // The cursor's leaf has been handed out
+} BatchScan;
+
+BatchScan* batch_scan_open(Table* table, uint32_t column, int32_t lo, int32_t hi);
+
+// Scan only the keys in [first_key, last_key]. A column of -1 selects
+// every row in the range
+BatchScan* batch_scan_open_range(Table* table, int32_t column, int32_t lo,
+                                 int32_t hi, uint64_t first_key,
+                                 uint64_t last_key);
+
+// Load the next non-empty leaf and filter it. Returns false at the end
+bool batch_scan_next(BatchScan* scan, ScanBatch* batch);
+
+void batch_scan_close(BatchScan* scan);
+
+// Set bit i of selection for every values[i] in [lo, hi]. Uses AVX2 or
+// SSE2 when the CPU has them. Returns the number of matches
+uint32_t filter_int32_range(const int32_t* values, uint32_t count, int32_t lo,
+                            int32_t hi, uint64_t* selection);
+
+// Called on a worker thread for each row its partition selects; prints
+// the row (or what's projected of it) to the partition's output
+typedef void (*ScanEmitRow)(void* context, FILE* out, const void* row);
+
+// One key range of a parallel scan and what it produced
+typedef struct {
+    char* output;             // Printed rows, owned by the partition
+    size_t output_size;
+    uint32_t matches;
+    bool finished;            // Set by its worker, under the pool lock
+    bool written;             // Copied to the scan's output
+} ScanPartition;
+
+typedef struct {
+    Table* table;
+    int32_t column;           // Filtered column, or -1 for every row
+    int32_t lo;
+    int32_t hi;
+    ScanEmitRow emit;
+    void* context;
+    uint32_t snapshot_txn_id; // The caller's snapshot, which workers join
+    uint64_t* split_keys;     // Partition i ends at split_keys[i]
+    ScanPartition* partitions;
+    uint32_t num_partitions;
+    uint32_t next_partition;  // Next one a worker picks up
+} ParallelScan;
+
+// Worker threads kept around between parallel scans
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t work;      // Workers wait here for partitions
+    pthread_cond_t finished;  // The scanning thread waits here for them
+    pthread_t* workers;
+    uint32_t num_workers;
+    ParallelScan* scan;       // The scan being run, or NULL
+    bool closing;
+} ScanPool;
+
+ScanPool* scan_pool_open(uint32_t num_workers);
+void scan_pool_close(ScanPool* pool);
+
+// Full scan of table, split at the tree's top separator keys and run by
+// the pool's workers, each filtering its key range a batch at a time like
+// a BatchScan (column -1 selects every row) and emitting the selected
+// rows into its own buffer. Buffers are written to out in key order if
+// ordered is set, otherwise as each partition finishes. The caller must
+// hold a snapshot, which the workers share, and so can't be the writer.
+// Returns the number of rows matched
+uint32_t parallel_scan(ScanPool* pool, Table* table, int32_t column,
+                       int32_t lo, int32_t hi, ScanEmitRow emit,
+                       void* context, bool ordered, FILE* out);
+
+#endif // SCAN_H
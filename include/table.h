@@ -4,6 +4,7 @@
 #include "db.h"
 #include "pager.h"
 #include "btree.h"
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -15,10 +16,29 @@ struct Table {
 
 void serialize_row(Schema* schema, void** values, void* destination);
 
-void** deserialize_row(Schema* schema, void* source);
+// Zero-copy row view: columns are read in place from a serialized row,
+// such as the leaf cell returned by cursor_value, at the offsets
+// precomputed in each Column
+static inline int32_t row_int(const Schema* schema, const void* row, uint32_t column) {
+    int32_t value;
+    memcpy(&value, (const char*)row + schema->columns[column].offset, sizeof(int32_t));
+    return value;
+}
+
+static inline const char* row_text(const Schema* schema, const void* row, uint32_t column) {
+    return (const char*)row + schema->columns[column].offset;
+}
+
+// Index of the named column, or -1
+int32_t schema_find_column(Schema* schema, const char* name);
+
+// Print "name: value" for one column of a row
+void print_column(Schema* schema, const void* row, uint32_t column);
+void fprint_column(FILE* out, Schema* schema, const void* row, uint32_t column);
 
 // Print a row
-void print_row(Schema* schema, void** values); 
+void print_row(Schema* schema, const void* row);
+void fprint_row(FILE* out, Schema* schema, const void* row);
 
 
 #endif // TABLE_H
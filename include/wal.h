@@ -1,19 +1,84 @@
 #ifndef WAL_H
 #define WAL_H
 
+#include "db.h"
 #include <stdint.h>
 #include <stddef.h>
+#include <pthread.h>
 
-void wal_open(const char *filename);
-void wal_close();
+// Record types
+#define WAL_RECORD_PAGE_WRITE 1
+#define WAL_RECORD_COMMIT 2
 
-void wal_log_write(
+// Fixed header in front of every record; `size` bytes of data follow
+typedef struct {
+    uint64_t lsn;
+    uint32_t checksum;   // CRC32 of header (checksum = 0) and data
+    uint32_t type;
+    uint32_t txn_id;
+    uint32_t page_num;
+    uint32_t offset;
+    uint32_t size;
+} WalRecordHeader;
+
+typedef struct {
+    int fd;
+    pthread_mutex_t lock;         // Readers evicting a page may flush the log
+    WalSyncMode sync_mode;
+    uint32_t group_commit_size;   // Commits per fsync in group mode
+    uint32_t group_commit_ms;     // Longest a group mode commit waits
+    pthread_cond_t flushed;       // Broadcast whenever flushed_lsn advances
+
+    uint64_t next_lsn;
+    uint64_t flushed_lsn;         // Everything <= this is on disk
+    uint32_t next_txn_id;
+    uint64_t file_size;           // Bytes written since the last truncation
+
+    // Records are staged here and reach the file in one write()
+    char* buffer;
+    size_t buffer_used;
+    size_t buffer_capacity;
+    uint32_t pending_commits;     // Commits staged but not yet synced
+} Wal;
+
+Wal* wal_open(const char* filename, const DbOptions* options);
+void wal_close(Wal* wal);
+
+// Stage a physical redo record. Returns its LSN
+uint64_t wal_log_write(
+    Wal* wal,
+    uint32_t txn_id,
     uint32_t page_num,
     uint32_t offset,
-    const void *data,
+    const void* data,
     uint32_t size
 );
 
-void wal_replay();
+// Stage a commit record and sync according to the sync mode. In group
+// mode the commit is durable only once wal_wait_commit returns
+uint64_t wal_log_commit(Wal* wal, uint32_t txn_id);
+
+// Group mode: block until the commit at lsn is on disk. The group is
+// written and synced once, by the commit that fills it, by whichever
+// waiter has waited group_commit_ms, or by the background writer, and
+// every commit in it is released together. Returns at once otherwise
+void wal_wait_commit(Wal* wal, uint64_t lsn);
+
+// Write staged records with a single write() and fsync. Returns the LSN
+// the log is now durable up to
+uint64_t wal_flush(Wal* wal);
+
+// Flush only if the log isn't yet durable up to lsn
+void wal_flush_to(Wal* wal, uint64_t lsn);
+
+// Bytes logged since the last truncation, staged ones included
+uint64_t wal_size(Wal* wal);
+
+// Drop the whole log once a checkpoint has made it redundant
+void wal_truncate(Wal* wal);
+
+// Redo every committed transaction logged after checkpoint_lsn.
+// Returns the number of transactions applied
+uint32_t wal_replay(Wal* wal, Pager* pager, uint64_t checkpoint_lsn);
 
 #endif
@@ -0,0 +1,315 @@
+#include "../include/aggregate.h"
+
+#define AGGREGATION_INITIAL_BUCKETS 64
+
+static void accumulator_reset(Accumulator *accumulator) {
+  accumulator->count = 0;
+  accumulator->sum = 0;
+  accumulator->min = INT32_MAX;
+  accumulator->max = INT32_MIN;
+}
+
+// Append a group for key, without linking it into a bucket
+static uint32_t aggregation_new_group(Aggregation *aggregation,
+                                      const char *key) {
+  if (aggregation->num_groups == aggregation->groups_capacity) {
+    uint32_t capacity = aggregation->groups_capacity * 2;
+    aggregation->keys =
+        realloc(aggregation->keys, (size_t)aggregation->key_size * capacity);
+    aggregation->accumulators =
+        realloc(aggregation->accumulators,
+                sizeof(Accumulator) * aggregation->num_specs * capacity);
+    aggregation->hash_next =
+        realloc(aggregation->hash_next, sizeof(uint32_t) * capacity);
+    aggregation->groups_capacity = capacity;
+  }
+
+  uint32_t group = aggregation->num_groups++;
+  if (aggregation->key_size > 0) {
+    memcpy(aggregation->keys + (size_t)group * aggregation->key_size, key,
+           aggregation->key_size);
+  }
+  for (uint32_t i = 0; i < aggregation->num_specs; i++) {
+    accumulator_reset(
+        &aggregation->accumulators[group * aggregation->num_specs + i]);
+  }
+  return group;
+}
+
+Aggregation *aggregation_open(Schema *schema, const AggregateSpec *specs,
+                              uint32_t num_specs, int32_t group_column) {
+  Aggregation *aggregation = malloc(sizeof(Aggregation));
+  aggregation->schema = schema;
+  aggregation->specs = malloc(sizeof(AggregateSpec) * num_specs);
+  memcpy(aggregation->specs, specs, sizeof(AggregateSpec) * num_specs);
+  aggregation->num_specs = num_specs;
+  aggregation->group_column = group_column;
+  aggregation->key_size =
+      group_column == -1 ? 0 : schema->columns[group_column].size;
+  aggregation->row_key = malloc(aggregation->key_size);
+
+  aggregation->num_groups = 0;
+  aggregation->groups_capacity = 16;
+  aggregation->keys = malloc((size_t)aggregation->key_size * 16);
+  aggregation->accumulators = malloc(sizeof(Accumulator) * num_specs * 16);
+  aggregation->hash_next = malloc(sizeof(uint32_t) * 16);
+  aggregation->num_buckets = AGGREGATION_INITIAL_BUCKETS;
+  aggregation->buckets = malloc(sizeof(uint32_t) * AGGREGATION_INITIAL_BUCKETS);
+  memset(aggregation->buckets, 0xFF,
+         sizeof(uint32_t) * AGGREGATION_INITIAL_BUCKETS);
+
+  // One group for the whole input, even if it's empty
+  if (group_column == -1) {
+    aggregation_new_group(aggregation, NULL);
+  }
+  return aggregation;
+}
+
+// FNV-1a
+static uint32_t aggregation_hash(const char *key, uint32_t size) {
+  uint32_t hash = 2166136261u;
+  for (uint32_t i = 0; i < size; i++) {
+    hash = (hash ^ (uint8_t)key[i]) * 16777619u;
+  }
+  return hash;
+}
+
+// Double the buckets once there are as many groups, keeping chains short
+static void aggregation_grow_buckets(Aggregation *aggregation) {
+  uint32_t num_buckets = aggregation->num_buckets * 2;
+  aggregation->buckets =
+      realloc(aggregation->buckets, sizeof(uint32_t) * num_buckets);
+  memset(aggregation->buckets, 0xFF, sizeof(uint32_t) * num_buckets);
+  aggregation->num_buckets = num_buckets;
+
+  for (uint32_t group = 0; group < aggregation->num_groups; group++) {
+    const char *key = aggregation->keys + (size_t)group * aggregation->key_size;
+    uint32_t bucket =
+        aggregation_hash(key, aggregation->key_size) & (num_buckets - 1);
+    aggregation->hash_next[group] = aggregation->buckets[bucket];
+    aggregation->buckets[bucket] = group;
+  }
+}
+
+// The group for a row's GROUP BY value, created on first sight
+static uint32_t aggregation_find_group(Aggregation *aggregation,
+                                       const void *row) {
+  Column *column = &aggregation->schema->columns[aggregation->group_column];
+  char *key = aggregation->row_key;
+  if (column->type == COL_TYPE_TEXT) {
+    // Bytes past the terminator aren't part of the value
+    memset(key, 0, aggregation->key_size);
+    strncpy(key, (const char *)row + column->offset, aggregation->key_size - 1);
+  } else {
+    memcpy(key, (const char *)row + column->offset, aggregation->key_size);
+  }
+
+  uint32_t bucket = aggregation_hash(key, aggregation->key_size) &
+                    (aggregation->num_buckets - 1);
+  for (uint32_t group = aggregation->buckets[bucket]; group != UINT32_MAX;
+       group = aggregation->hash_next[group]) {
+    if (memcmp(aggregation->keys + (size_t)group * aggregation->key_size, key,
+               aggregation->key_size) == 0) {
+      return group;
+    }
+  }
+
+  uint32_t group = aggregation_new_group(aggregation, key);
+  if (aggregation->num_groups > aggregation->num_buckets) {
+    aggregation_grow_buckets(aggregation); // Links the new group too
+  } else {
+    aggregation->hash_next[group] = aggregation->buckets[bucket];
+    aggregation->buckets[bucket] = group;
+  }
+  return group;
+}
+
+void aggregation_add_row(Aggregation *aggregation, const void *row) {
+  uint32_t group = aggregation->group_column == -1
+                       ? 0
+                       : aggregation_find_group(aggregation, row);
+  Accumulator *accumulators =
+      &aggregation->accumulators[group * aggregation->num_specs];
+
+  for (uint32_t i = 0; i < aggregation->num_specs; i++) {
+    AggregateSpec *spec = &aggregation->specs[i];
+    Accumulator *accumulator = &accumulators[i];
+    accumulator->count++;
+    if (spec->func == AGG_NONE || spec->column == -1) {
+      continue;
+    }
+    int32_t value = row_int(aggregation->schema, row, spec->column);
+    accumulator->sum += value;
+    if (value < accumulator->min) {
+      accumulator->min = value;
+    }
+    if (value > accumulator->max) {
+      accumulator->max = value;
+    }
+  }
+}
+
+// PRIMARY KEY values are positive and are the tree's keys, so the least
+// is the first cell of the leftmost leaf and the greatest the last cell of
+// the rightmost
+static bool table_pk_bound(Table *table, bool greatest, int32_t *value) {
+  Cursor *cursor = greatest ? table_find_less_than(table, UINT64_MAX)
+                            : table_start(table);
+  bool found = !cursor->end_of_table;
+  if (found) {
+    *value = (int32_t)cursor_key(cursor);
+  }
+  cursor_free(cursor);
+  return found;
+}
+
+bool aggregation_from_tree(Aggregation *aggregation, Table *table) {
+  if (aggregation->group_column != -1) {
+    return false;
+  }
+  for (uint32_t i = 0; i < aggregation->num_specs; i++) {
+    AggregateSpec *spec = &aggregation->specs[i];
+    bool is_count = spec->func == AGG_COUNT && spec->column == -1;
+    bool is_pk_bound = (spec->func == AGG_MIN || spec->func == AGG_MAX) &&
+                       spec->column != -1 &&
+                       spec->column == aggregation->schema->pk_column;
+    if (!is_count && !is_pk_bound) {
+      return false;
+    }
+  }
+
+  for (uint32_t i = 0; i < aggregation->num_specs; i++) {
+    AggregateSpec *spec = &aggregation->specs[i];
+    Accumulator *accumulator = &aggregation->accumulators[i];
+    if (spec->func == AGG_COUNT) {
+      // Only the leaves' cell counts are read, never a row
+      Cursor *cursor = table_start(table);
+      while (!cursor->end_of_table) {
+        accumulator->count += *leaf_node_num_cells(cursor->node);
+        cursor_next_leaf(cursor);
+      }
+      cursor_free(cursor);
+    } else {
+      int32_t value;
+      if (table_pk_bound(table, spec->func == AGG_MAX, &value)) {
+        accumulator->count = 1;
+        accumulator->min = accumulator->max = value;
+      }
+    }
+  }
+  return true;
+}
+
+static const char *aggregate_func_name(AggregateFunc func) {
+  switch (func) {
+  case AGG_COUNT:
+    return "COUNT";
+  case AGG_SUM:
+    return "SUM";
+  case AGG_MIN:
+    return "MIN";
+  case AGG_MAX:
+    return "MAX";
+  case AGG_AVG:
+    return "AVG";
+  default:
+    return "";
+  }
+}
+
+static void aggregation_print_value(Aggregation *aggregation,
+                                    const AggregateSpec *spec,
+                                    const Accumulator *accumulator,
+                                    const char *key, FILE *out) {
+  Schema *schema = aggregation->schema;
+  if (spec->func == AGG_NONE) {
+    Column *column = &schema->columns[spec->column];
+    fprintf(out, "%s: ", column->name);
+    if (column->type == COL_TYPE_INT) {
+      int32_t value;
+      memcpy(&value, key, sizeof(int32_t));
+      fprintf(out, "%d", value);
+    } else {
+      fprintf(out, "%s", key);
+    }
+    return;
+  }
+
+  fprintf(out, "%s(%s): ", aggregate_func_name(spec->func),
+          spec->column == -1 ? "*" : schema->columns[spec->column].name);
+  if (spec->func == AGG_COUNT) {
+    fprintf(out, "%lu", (unsigned long)accumulator->count);
+  } else if (accumulator->count == 0) {
+    fprintf(out, "NULL");
+  } else if (spec->func == AGG_SUM) {
+    fprintf(out, "%ld", (long)accumulator->sum);
+  } else if (spec->func == AGG_MIN) {
+    fprintf(out, "%d", accumulator->min);
+  } else if (spec->func == AGG_MAX) {
+    fprintf(out, "%d", accumulator->max);
+  } else {
+    fprintf(out, "%.2f", (double)accumulator->sum / accumulator->count);
+  }
+}
+
+// Orders group numbers by their keys, for printing
+typedef struct {
+  const Aggregation *aggregation;
+  uint32_t group;
+} GroupRef;
+
+static int compare_groups(const void *a, const void *b) {
+  const GroupRef *left = a;
+  const GroupRef *right = b;
+  const Aggregation *aggregation = left->aggregation;
+  const char *left_key =
+      aggregation->keys + (size_t)left->group * aggregation->key_size;
+  const char *right_key =
+      aggregation->keys + (size_t)right->group * aggregation->key_size;
+
+  if (aggregation->schema->columns[aggregation->group_column].type ==
+      COL_TYPE_TEXT) {
+    return strncmp(left_key, right_key, aggregation->key_size);
+  }
+  int32_t left_value, right_value;
+  memcpy(&left_value, left_key, sizeof(int32_t));
+  memcpy(&right_value, right_key, sizeof(int32_t));
+  return (left_value > right_value) - (left_value < right_value);
+}
+
+void aggregation_print(Aggregation *aggregation, FILE *out) {
+  GroupRef *order = malloc(sizeof(GroupRef) * (aggregation->num_groups + 1));
+  for (uint32_t i = 0; i < aggregation->num_groups; i++) {
+    order[i].aggregation = aggregation;
+    order[i].group = i;
+  }
+  if (aggregation->group_column != -1) {
+    qsort(order, aggregation->num_groups, sizeof(GroupRef), compare_groups);
+  }
+
+  for (uint32_t i = 0; i < aggregation->num_groups; i++) {
+    uint32_t group = order[i].group;
+    const char *key = aggregation->keys + (size_t)group * aggregation->key_size;
+    for (uint32_t j = 0; j < aggregation->num_specs; j++) {
+      aggregation_print_value(
+          aggregation, &aggregation->specs[j],
+          &aggregation->accumulators[group * aggregation->num_specs + j], key,
+          out);
+      if (j < aggregation->num_specs - 1) {
+        fprintf(out, ", ");
+      }
+    }
+    fprintf(out, "\n");
+  }
+  free(order);
+}
+
+void aggregation_free(Aggregation *aggregation) {
+  free(aggregation->specs);
+  free(aggregation->row_key);
+  free(aggregation->keys);
+  free(aggregation->accumulators);
+  free(aggregation->hash_next);
+  free(aggregation->buckets);
+  free(aggregation);
+}
@@ -36,16 +36,89 @@ uint32_t *leaf_node_next_leaf(void *node) {
   return (uint32_t *)(node + LEAF_NODE_NEXT_LEAF_OFFSET);
 }
 
+uint32_t *leaf_node_prev_leaf(void *node) {
+  return (uint32_t *)(node + LEAF_NODE_PREV_LEAF_OFFSET);
+}
+
+uint16_t *leaf_node_content_start(void *node) {
+  return (uint16_t *)(node + LEAF_NODE_CONTENT_START_OFFSET);
+}
+
+uint16_t *leaf_node_slot(void *node, uint32_t cell_num) {
+  return (uint16_t *)(node + LEAF_NODE_HEADER_SIZE +
+                      cell_num * LEAF_NODE_SLOT_SIZE);
+}
+
 void *leaf_node_cell(void *node, uint32_t cell_num) {
-  return node + LEAF_NODE_HEADER_SIZE + cell_num * LEAF_NODE_CELL_SIZE;
+  return node + *leaf_node_slot(node, cell_num);
 }
 
-uint32_t *leaf_node_key(void *node, uint32_t cell_num) {
-  return (uint32_t *)leaf_node_cell(node, cell_num);
+uint64_t *leaf_node_key(void *node, uint32_t cell_num) {
+  return (uint64_t *)(leaf_node_cell(node, cell_num) + LEAF_NODE_KEY_OFFSET);
+}
+
+uint16_t *leaf_node_value_size(void *node, uint32_t cell_num) {
+  return (uint16_t *)(leaf_node_cell(node, cell_num) +
+                      LEAF_NODE_VALUE_SIZE_OFFSET);
 }
 
 void *leaf_node_value(void *node, uint32_t cell_num) {
-  return leaf_node_cell(node, cell_num) + LEAF_NODE_KEY_SIZE;
+  return leaf_node_cell(node, cell_num) + LEAF_NODE_VALUE_OFFSET;
+}
+
+// Contiguous bytes between the end of the slot directory and the cells
+uint32_t leaf_node_free_space(void *node) {
+  uint32_t slots_end =
+      LEAF_NODE_HEADER_SIZE + *leaf_node_num_cells(node) * LEAF_NODE_SLOT_SIZE;
+  return *leaf_node_content_start(node) - slots_end;
+}
+
+// Insert a cell at position cell_num. Caller checks it fits.
+void leaf_node_insert_cell(void *node, uint32_t cell_num, uint64_t key,
+                           const void *value, uint32_t value_size) {
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  uint16_t cell_offset =
+      *leaf_node_content_start(node) - LEAF_NODE_VALUE_OFFSET - value_size;
+
+  void *cell = node + cell_offset;
+  *(uint64_t *)(cell + LEAF_NODE_KEY_OFFSET) = key;
+  *(uint16_t *)(cell + LEAF_NODE_VALUE_SIZE_OFFSET) = value_size;
+  memcpy(cell + LEAF_NODE_VALUE_OFFSET, value, value_size);
+  *leaf_node_content_start(node) = cell_offset;
+
+  if (cell_num < num_cells) {
+    memmove(leaf_node_slot(node, cell_num + 1), leaf_node_slot(node, cell_num),
+            (num_cells - cell_num) * LEAF_NODE_SLOT_SIZE);
+  }
+  *leaf_node_slot(node, cell_num) = cell_offset;
+  *leaf_node_num_cells(node) = num_cells + 1;
+}
+
+// Remove a cell and close the gap it leaves in the content area, so
+// leaf_node_free_space stays exact
+void leaf_node_delete_cell(void *node, uint32_t cell_num) {
+  uint32_t num_cells = *leaf_node_num_cells(node);
+  uint16_t cell_offset = *leaf_node_slot(node, cell_num);
+  uint16_t cell_size =
+      LEAF_NODE_VALUE_OFFSET + *leaf_node_value_size(node, cell_num);
+  uint16_t content_start = *leaf_node_content_start(node);
+
+  // Cells below this one in the page slide up over it
+  memmove(node + content_start + cell_size, node + content_start,
+          cell_offset - content_start);
+  *leaf_node_content_start(node) = content_start + cell_size;
+
+  memmove(leaf_node_slot(node, cell_num), leaf_node_slot(node, cell_num + 1),
+          (num_cells - cell_num - 1) * LEAF_NODE_SLOT_SIZE);
+  num_cells--;
+  *leaf_node_num_cells(node) = num_cells;
+
+  for (uint32_t i = 0; i < num_cells; i++) {
+    uint16_t *slot = leaf_node_slot(node, i);
+    if (*slot < cell_offset) {
+      *slot += cell_size;
+    }
+  }
 }
 
 void initialize_leaf_node(void *node) {
@@ -53,6 +126,8 @@ void initialize_leaf_node(void *node) {
   set_node_root(node, false);
   *leaf_node_num_cells(node) = 0;
   *leaf_node_next_leaf(node) = 0; // 0 represents no sibling
+  *leaf_node_prev_leaf(node) = 0;
+  *leaf_node_content_start(node) = PAGE_SIZE;
 }
 
 // Internal node operations
@@ -81,8 +156,8 @@ uint32_t *internal_node_child(void *node, uint32_t child_num) {
   }
 }
 
-uint32_t *internal_node_key(void *node, uint32_t key_num) {
-  return (uint32_t *)((void *)internal_node_cell(node, key_num) +
+uint64_t *internal_node_key(void *node, uint32_t key_num) {
+  return (uint64_t *)((void *)internal_node_cell(node, key_num) +
                       INTERNAL_NODE_CHILD_SIZE);
 }
 
@@ -93,14 +168,14 @@ void initialize_internal_node(void *node) {
 }
 
 // Find the position where a key should be inserted in a leaf node
-uint32_t leaf_node_find(void *node, uint32_t key) {
+uint32_t leaf_node_find(void *node, uint64_t key) {
   uint32_t num_cells = *leaf_node_num_cells(node);
   uint32_t min_index = 0;
   uint32_t one_past_max_index = num_cells;
 
   while (one_past_max_index != min_index) {
     uint32_t index = (min_index + one_past_max_index) / 2;
-    uint32_t key_at_index = *leaf_node_key(node, index);
+    uint64_t key_at_index = *leaf_node_key(node, index);
     if (key == key_at_index) {
       return index;
     }
@@ -115,7 +190,7 @@ uint32_t leaf_node_find(void *node, uint32_t key) {
 }
 
 // Find child in internal node
-uint32_t internal_node_find_child(void *node, uint32_t key) {
+uint32_t internal_node_find_child(void *node, uint64_t key) {
   uint32_t num_keys = *internal_node_num_keys(node);
 
   uint32_t min_index = 0;
@@ -123,7 +198,7 @@ uint32_t internal_node_find_child(void *node, uint32_t key) {
 
   while (min_index != max_index) {
     uint32_t index = (min_index + max_index) / 2;
-    uint32_t key_to_right = *internal_node_key(node, index);
+    uint64_t key_to_right = *internal_node_key(node, index);
     if (key_to_right >= key) {
       max_index = index;
     } else {
@@ -135,13 +210,16 @@ uint32_t internal_node_find_child(void *node, uint32_t key) {
 }
 
 // Get the maximum key in a node (recursive)
-uint32_t get_node_max_key(Pager *pager, void *node) {
+uint64_t get_node_max_key(Pager *pager, void *node) {
   if (get_node_type(node) == NODE_LEAF) {
     uint32_t num_cells = *leaf_node_num_cells(node);
     return *leaf_node_key(node, num_cells - 1);
   }
-  void *right_child = pager_get_page(pager, *internal_node_right_child(node));
-  return get_node_max_key(pager, right_child);
+  uint32_t right_child_page_num = *internal_node_right_child(node);
+  void *right_child = pager_get_page(pager, right_child_page_num);
+  uint64_t max_key = get_node_max_key(pager, right_child);
+  pager_unpin_page(pager, right_child_page_num);
+  return max_key;
 }
 
 void print_tree(Pager *pager, uint32_t page_num, uint32_t indentation_level) {
@@ -159,7 +237,7 @@ void print_tree(Pager *pager, uint32_t page_num, uint32_t indentation_level) {
       for (uint32_t j = 0; j < indentation_level + 1; j++) {
         printf("  ");
       }
-      printf("- %d\n", *leaf_node_key(node, i));
+      printf("- %llu\n", (unsigned long long)*leaf_node_key(node, i));
     }
     break;
   case NODE_INTERNAL:
@@ -175,10 +253,12 @@ void print_tree(Pager *pager, uint32_t page_num, uint32_t indentation_level) {
       for (uint32_t j = 0; j < indentation_level + 1; j++) {
         printf("  ");
       }
-      printf("- key %d\n", *internal_node_key(node, i));
+      printf("- key %llu\n", (unsigned long long)*internal_node_key(node, i));
     }
     child = *internal_node_right_child(node);
     print_tree(pager, child, indentation_level + 1);
     break;
   }
+
+  pager_unpin_page(pager, page_num);
 }
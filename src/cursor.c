@@ -3,78 +3,131 @@
 // Forward declarations
 void cursor_free(Cursor *cursor);
 
-Cursor *table_start(Table *table) {
-  Cursor *cursor = malloc(sizeof(Cursor));
-  cursor->table = table;
-  cursor->page_num = table->schema->root_page_num;
-  cursor->cell_num = 0;
+// Cursors keep their current leaf until cursor_free: pinned, and if
+// they belong to a reader, latched shared or read from a saved version.
+//
+// A reader sees every page as of its snapshot (pager_begin_snapshot), so
+// the tree never changes under it and it never waits for the writer. It
+// takes each page before letting go of the one that led to it, from the
+// catalog down to a leaf and along the leaf chain, so a cursor opened
+// outside a snapshot keeps the one its first page took. For the writer
+// all of this reduces to pinning.
+
+// Move the cursor to another leaf. Returns the leaf
+static void *cursor_step_to(Cursor *cursor, uint32_t page_num) {
+  Pager *pager = cursor->table->pager;
+  void *node = pager_get_page_shared(pager, page_num);
+  pager_release_page_shared(pager, cursor->page_num, cursor->node);
+  cursor->page_num = page_num;
+  cursor->node = node;
+  return node;
+}
+
+// The table's root in the catalog the reader sees. The schema points into
+// the live catalog page, so its offset there finds it in a saved version
+static uint32_t table_root_page_num(Table *table, void *catalog) {
+  char *live = pager_get_page(table->pager, CATALOG_PAGE_NUM);
+  pager_unpin_page(table->pager, CATALOG_PAGE_NUM);
+  Schema *schema = (Schema *)((char *)catalog + ((char *)table->schema - live));
+  return schema->root_page_num;
+}
+
+// Descend from the root to the leaf that should contain key and point
+// the cursor at it
+static void cursor_find_leaf(Cursor *cursor, uint64_t key) {
+  Table *table = cursor->table;
+  Pager *pager = table->pager;
 
-  void *root_node = pager_get_page(table->pager, table->schema->root_page_num);
+  // The catalog names the root, which moves when the tree shrinks
+  uint32_t page_num = CATALOG_PAGE_NUM;
+  void *page = pager_get_page_shared(pager, page_num);
+  uint32_t child_page_num = table_root_page_num(table, page);
 
-  while (get_node_type(root_node) == NODE_INTERNAL) {
-    cursor->page_num = *internal_node_child(root_node, 0);
-    root_node = pager_get_page(table->pager, cursor->page_num);
+  while (true) {
+    void *node = pager_get_page_shared(pager, child_page_num);
+    pager_release_page_shared(pager, page_num, page);
+    page_num = child_page_num;
+    page = node;
+    if (get_node_type(node) == NODE_LEAF) {
+      cursor->page_num = page_num;
+      cursor->node = node;
+      return;
+    }
+    child_page_num =
+        *internal_node_child(node, internal_node_find_child(node, key));
   }
+}
 
-  uint32_t num_cells = *leaf_node_num_cells(root_node);
-  cursor->end_of_table = (num_cells == 0);
+// Position a cursor that holds no leaf on the first key >= key
+static void cursor_seek(Cursor *cursor, uint64_t key) {
+  cursor_find_leaf(cursor, key);
+  cursor->cell_num = leaf_node_find(cursor->node, key);
+  cursor->end_of_table = false;
 
-  return cursor;
+  // Separators are upper bounds, so after deletes every key in this leaf
+  // can be smaller than the target; the next one is then in the next leaf
+  if (cursor->cell_num >= *leaf_node_num_cells(cursor->node)) {
+    cursor_next_leaf(cursor);
+  }
 }
 
-Cursor *table_find(Table *table, uint32_t key) {
-  void *root_node = pager_get_page(table->pager, table->schema->root_page_num);
+// Position a cursor that holds no leaf on the last key < key. Returns
+// false if there is none
+static bool cursor_seek_before(Cursor *cursor, uint64_t key) {
+  cursor_seek(cursor, key);
+  cursor->end_of_table = false;
+  if (cursor->cell_num > 0) {
+    cursor->cell_num -= 1;
+    return true;
+  }
+  return cursor_retreat(cursor);
+}
 
+Cursor *table_start(Table *table) {
   Cursor *cursor = malloc(sizeof(Cursor));
   cursor->table = table;
+  cursor_find_leaf(cursor, 0); // 0 sorts before every key
+  cursor->cell_num = 0;
+  cursor->end_of_table = (*leaf_node_num_cells(cursor->node) == 0);
 
-  if (get_node_type(root_node) == NODE_LEAF) {
-    cursor->page_num = table->schema->root_page_num;
-    cursor->cell_num = leaf_node_find(root_node, key);
-    cursor->end_of_table = false;
-    return cursor;
-  }
+  return cursor;
+}
 
-  uint32_t page_num = table->schema->root_page_num;
-  while (true) {
-    void *node = pager_get_page(table->pager, page_num);
-    if (get_node_type(node) == NODE_LEAF) {
-      cursor->page_num = page_num;
-      cursor->cell_num = leaf_node_find(node, key);
-      cursor->end_of_table = false;
-      return cursor;
-    }
+Cursor *table_find(Table *table, uint64_t key) {
+  Cursor *cursor = malloc(sizeof(Cursor));
+  cursor->table = table;
+  cursor_find_leaf(cursor, key);
+  cursor->cell_num = leaf_node_find(cursor->node, key);
+  cursor->end_of_table = false;
 
-    uint32_t child_index = internal_node_find_child(node, key);
-    page_num = *internal_node_child(node, child_index);
-  }
+  return cursor;
 }
 
+// The cursor's pin keeps its leaf in place, so rows are read straight
+// from the page
 void *cursor_value(Cursor *cursor) {
-  uint32_t page_num = cursor->page_num;
-  void *page = pager_get_page(cursor->table->pager, page_num);
-  return leaf_node_value(page, cursor->cell_num);
+  return leaf_node_value(cursor->node, cursor->cell_num);
 }
 
-uint32_t cursor_key(Cursor *cursor) {
-  uint32_t page_num = cursor->page_num;
-  void *page = pager_get_page(cursor->table->pager, page_num);
-  return *leaf_node_key(page, cursor->cell_num);
+uint64_t cursor_key(Cursor *cursor) {
+  return *leaf_node_key(cursor->node, cursor->cell_num);
 }
 
-void cursor_advance(Cursor *cursor) {
-  uint32_t page_num = cursor->page_num;
-  void *node = pager_get_page(cursor->table->pager, page_num);
+void cursor_next_leaf(Cursor *cursor) {
+  uint32_t next_page_num = *leaf_node_next_leaf(cursor->node);
+  if (next_page_num == 0) {
+    cursor->cell_num = *leaf_node_num_cells(cursor->node);
+    cursor->end_of_table = true;
+    return;
+  }
+  cursor_step_to(cursor, next_page_num);
+  cursor->cell_num = 0;
+}
 
+void cursor_advance(Cursor *cursor) {
   cursor->cell_num += 1;
-  if (cursor->cell_num >= *leaf_node_num_cells(node)) {
-    uint32_t next_page_num = *leaf_node_next_leaf(node);
-    if (next_page_num == 0) {
-      cursor->end_of_table = true;
-    } else {
-      cursor->page_num = next_page_num;
-      cursor->cell_num = 0;
-    }
+  if (cursor->cell_num >= *leaf_node_num_cells(cursor->node)) {
+    cursor_next_leaf(cursor);
   }
 }
 
@@ -86,157 +139,116 @@ bool cursor_retreat(Cursor *cursor) {
     return true;
   }
 
-  // Need to move to previous leaf page
-  // Since we don't have prev pointers, we need to find it
-  // by traversing from the start to find the page before current
-  uint32_t target_page = cursor->page_num;
+  // Step to the last cell of the previous leaf
+  uint32_t prev_page = *leaf_node_prev_leaf(cursor->node);
+  if (prev_page == 0) {
+    return false; // First leaf
+  }
 
-  // Start from beginning
-  Cursor *temp = table_start(cursor->table);
-  uint32_t prev_page = 0;
+  void *prev_node = cursor_step_to(cursor, prev_page);
+  cursor->cell_num = *leaf_node_num_cells(prev_node) - 1;
+  return true;
+}
 
-  // Find the page before target_page
-  while (!temp->end_of_table) {
-    if (temp->page_num == target_page) {
-      // Found our current page
-      if (prev_page == 0) {
-        // We're at the first page, can't go back
-        cursor_free(temp);
-        return false;
-      }
+void cursor_free(Cursor *cursor) {
+  pager_release_page_shared(cursor->table->pager, cursor->page_num,
+                            cursor->node);
+  free(cursor);
+}
 
-      // Move cursor to last cell of previous page
-      cursor->page_num = prev_page;
-      void *prev_node = pager_get_page(cursor->table->pager, prev_page);
-      cursor->cell_num = *leaf_node_num_cells(prev_node) - 1;
-      cursor_free(temp);
-      return true;
-    }
+uint32_t table_split_keys(Table *table, uint64_t *keys, uint32_t max_keys) {
+  Pager *pager = table->pager;
+  void *catalog = pager_get_page_shared(pager, CATALOG_PAGE_NUM);
+  uint32_t root_page_num = table_root_page_num(table, catalog);
+  void *root = pager_get_page_shared(pager, root_page_num);
+  pager_release_page_shared(pager, CATALOG_PAGE_NUM, catalog);
 
-    prev_page = temp->page_num;
+  if (get_node_type(root) == NODE_LEAF) {
+    pager_release_page_shared(pager, root_page_num, root);
+    return 0;
+  }
 
-    // Advance temp to next page
-    void *node = pager_get_page(cursor->table->pager, temp->page_num);
-    uint32_t next_page = *leaf_node_next_leaf(node);
-    if (next_page == 0)
-      break;
-    temp->page_num = next_page;
-    temp->cell_num = 0;
+  // Every child is at the same depth, so the first says whether there's
+  // another internal level to take separators from
+  uint32_t num_keys = *internal_node_num_keys(root);
+  uint32_t child_page_num = *internal_node_child(root, 0);
+  void *child = pager_get_page_shared(pager, child_page_num);
+  bool descend = num_keys < max_keys && get_node_type(child) == NODE_INTERNAL;
+  pager_release_page_shared(pager, child_page_num, child);
+
+  uint64_t *candidates = malloc(sizeof(uint64_t) * (num_keys + 1) *
+                                (descend ? INTERNAL_NODE_MAX_CELLS + 1 : 1));
+  uint32_t num_candidates = 0;
+  for (uint32_t i = 0; i <= num_keys; i++) {
+    if (descend) {
+      child_page_num = *internal_node_child(root, i);
+      child = pager_get_page_shared(pager, child_page_num);
+      uint32_t child_keys = *internal_node_num_keys(child);
+      for (uint32_t j = 0; j < child_keys; j++) {
+        candidates[num_candidates++] = *internal_node_key(child, j);
+      }
+      pager_release_page_shared(pager, child_page_num, child);
+    }
+    if (i < num_keys) {
+      candidates[num_candidates++] = *internal_node_key(root, i);
+    }
   }
+  pager_release_page_shared(pager, root_page_num, root);
 
-  cursor_free(temp);
-  return false;
+  // More than asked for: keep evenly spaced ones
+  uint32_t num_split_keys = num_candidates;
+  if (num_candidates <= max_keys) {
+    memcpy(keys, candidates, sizeof(uint64_t) * num_candidates);
+  } else {
+    for (uint32_t i = 0; i < max_keys; i++) {
+      keys[i] = candidates[(uint64_t)(i + 1) * (num_candidates + 1) /
+                               (max_keys + 1) -
+                           1];
+    }
+    num_split_keys = max_keys;
+  }
+  free(candidates);
+  return num_split_keys;
 }
 
-void cursor_free(Cursor *cursor) { free(cursor); }
-
 // Find cursor position for key >= target
 // Used for range scans: WHERE col >= value
-Cursor *table_find_greater_or_equal(Table *table, uint32_t key) {
-  void *root_node = pager_get_page(table->pager, table->schema->root_page_num);
-
+Cursor *table_find_greater_or_equal(Table *table, uint64_t key) {
   Cursor *cursor = malloc(sizeof(Cursor));
   cursor->table = table;
-
-  if (get_node_type(root_node) == NODE_LEAF) {
-    cursor->page_num = table->schema->root_page_num;
-    cursor->cell_num = leaf_node_find(root_node, key);
-
-    // If exact match not found, cursor points to where it would go
-    // This is perfect for >= queries
-    uint32_t num_cells = *leaf_node_num_cells(root_node);
-    cursor->end_of_table = (cursor->cell_num >= num_cells);
-    return cursor;
-  }
-
-  uint32_t page_num = table->schema->root_page_num;
-  while (true) {
-    void *node = pager_get_page(table->pager, page_num);
-    if (get_node_type(node) == NODE_LEAF) {
-      cursor->page_num = page_num;
-      cursor->cell_num = leaf_node_find(node, key);
-      uint32_t num_cells = *leaf_node_num_cells(node);
-      cursor->end_of_table = (cursor->cell_num >= num_cells);
-      return cursor;
-    }
-
-    uint32_t child_index = internal_node_find_child(node, key);
-    page_num = *internal_node_child(node, child_index);
-  }
+  cursor_seek(cursor, key);
+  return cursor;
 }
 
 // Find cursor position for largest key < target
 // Used for reverse range scans: WHERE col < value
-Cursor *table_find_less_than(Table *table, uint32_t key) {
-  // Find position of key (or where it would be)
-  Cursor *cursor = table_find_greater_or_equal(table, key);
-
-  if (cursor->end_of_table) {
-    // Key is beyond all entries, so position at last entry
-    cursor_free(cursor);
-
-    // Start from beginning and scan to end
-    cursor = table_start(table);
-    if (cursor->end_of_table) {
-      // Empty table
-      return cursor;
-    }
-
-    // Advance to last entry
-    while (true) {
-      void *node = pager_get_page(table->pager, cursor->page_num);
-      uint32_t num_cells = *leaf_node_num_cells(node);
-      uint32_t next_page = *leaf_node_next_leaf(node);
-
-      if (next_page == 0) {
-        // Last page - position at last cell
-        cursor->cell_num = num_cells - 1;
-        cursor->end_of_table = false;
-        return cursor;
-      }
-
-      cursor->page_num = next_page;
-      cursor->cell_num = 0;
-    }
-  }
-
-  // Check if we're at exact match or insertion point
-  uint32_t current_key = cursor_key(cursor);
-
-  if (current_key >= key) {
-    // We're at or after the key, need to go back one
-    if (!cursor_retreat(cursor)) {
-      // Can't retreat - no entries < key
-      cursor->end_of_table = true;
-    }
+Cursor *table_find_less_than(Table *table, uint64_t key) {
+  Cursor *cursor = malloc(sizeof(Cursor));
+  cursor->table = table;
+  if (!cursor_seek_before(cursor, key)) {
+    // No entries < key
+    cursor->end_of_table = true;
   }
-
   return cursor;
 }
 
-void leaf_node_split_and_insert(Cursor *cursor, uint32_t key, void *value,
+void leaf_node_split_and_insert(Cursor *cursor, uint64_t key, void *value,
                                 uint32_t row_size);
 
-void leaf_node_insert(Cursor *cursor, uint32_t key, void *value,
+void leaf_node_insert(Cursor *cursor, uint64_t key, void *value,
                       uint32_t row_size) {
-  void *node = pager_get_page(cursor->table->pager, cursor->page_num);
+  Pager *pager = cursor->table->pager;
+  void *node = pager_get_page(pager, cursor->page_num);
 
-  uint32_t num_cells = *leaf_node_num_cells(node);
-  if (num_cells >= LEAF_NODE_MAX_CELLS) {
+  if (leaf_node_free_space(node) < LEAF_NODE_CELL_SPACE(row_size)) {
+    pager_unpin_page(pager, cursor->page_num);
     leaf_node_split_and_insert(cursor, key, value, row_size);
     return;
   }
 
-  if (cursor->cell_num < num_cells) {
-    for (uint32_t i = num_cells; i > cursor->cell_num; i--) {
-      memcpy(leaf_node_cell(node, i), leaf_node_cell(node, i - 1),
-             LEAF_NODE_CELL_SIZE);
-    }
-  }
-
-  *(leaf_node_num_cells(node)) += 1;
-  *(leaf_node_key(node, cursor->cell_num)) = key;
-  memcpy(leaf_node_value(node, cursor->cell_num), value, row_size);
+  pager_mark_dirty(pager, cursor->page_num);
+  leaf_node_insert_cell(node, cursor->cell_num, key, value, row_size);
+  pager_unpin_page(pager, cursor->page_num);
 }
 
 void create_new_root(Table *table, uint32_t root_page_num,
@@ -246,79 +258,148 @@ void create_new_root(Table *table, uint32_t root_page_num,
   uint32_t left_child_page_num = pager_allocate_page(table->pager);
   void *left_child = pager_get_page(table->pager, left_child_page_num);
 
+  pager_mark_dirty(table->pager, root_page_num);
+  pager_mark_dirty(table->pager, right_child_page_num);
+  pager_mark_dirty(table->pager, left_child_page_num);
+
   memcpy(left_child, root, PAGE_SIZE);
   set_node_root(left_child, false);
 
+  // A leaf root's new sibling points back at the copy, not the old root
+  if (get_node_type(left_child) == NODE_LEAF) {
+    *leaf_node_prev_leaf(right_child) = left_child_page_num;
+  }
+
+  // An internal root's children now hang off the copy
+  if (get_node_type(left_child) == NODE_INTERNAL) {
+    uint32_t num_keys = *internal_node_num_keys(left_child);
+    for (uint32_t i = 0; i <= num_keys; i++) {
+      uint32_t child_page_num = *internal_node_child(left_child, i);
+      void *child = pager_get_page(table->pager, child_page_num);
+      pager_mark_dirty(table->pager, child_page_num);
+      *node_parent(child) = left_child_page_num;
+      pager_unpin_page(table->pager, child_page_num);
+    }
+  }
+
   initialize_internal_node(root);
   set_node_root(root, true);
   *internal_node_num_keys(root) = 1;
   *internal_node_child(root, 0) = left_child_page_num;
-  uint32_t left_child_max_key = get_node_max_key(table->pager, left_child);
+  uint64_t left_child_max_key = get_node_max_key(table->pager, left_child);
   *internal_node_key(root, 0) = left_child_max_key;
   *internal_node_right_child(root) = right_child_page_num;
   *node_parent(left_child) = root_page_num;
   *node_parent(right_child) = root_page_num;
+
+  pager_unpin_page(table->pager, left_child_page_num);
+  pager_unpin_page(table->pager, right_child_page_num);
+  pager_unpin_page(table->pager, root_page_num);
 }
 
 void internal_node_insert(Table *table, uint32_t parent_page_num,
                           uint32_t child_page_num);
 
-void update_internal_node_key(void *node, uint32_t old_key, uint32_t new_key) {
+void internal_node_split_and_insert(Table *table, uint32_t old_page_num,
+                                    uint32_t child_page_num);
+
+void update_internal_node_key(void *node, uint64_t old_key, uint64_t new_key) {
   uint32_t old_child_index = internal_node_find_child(node, old_key);
-  *internal_node_key(node, old_child_index) = new_key;
+  // The right child has no key of its own
+  if (old_child_index < *internal_node_num_keys(node)) {
+    *internal_node_key(node, old_child_index) = new_key;
+  }
 }
 
-void leaf_node_split_and_insert(Cursor *cursor, uint32_t key, void *value,
+void leaf_node_split_and_insert(Cursor *cursor, uint64_t key, void *value,
                                 uint32_t row_size) {
-  void *old_node = pager_get_page(cursor->table->pager, cursor->page_num);
-  uint32_t old_max = get_node_max_key(cursor->table->pager, old_node);
-  uint32_t new_page_num = pager_allocate_page(cursor->table->pager);
-  void *new_node = pager_get_page(cursor->table->pager, new_page_num);
+  Pager *pager = cursor->table->pager;
+  void *old_node = pager_get_page(pager, cursor->page_num);
+  uint64_t old_max = get_node_max_key(pager, old_node);
+  uint32_t new_page_num = pager_allocate_page(pager);
+  void *new_node = pager_get_page(pager, new_page_num);
+
+  pager_mark_dirty(pager, cursor->page_num);
+  pager_mark_dirty(pager, new_page_num);
+
+  // Work from a copy, since the old page is rebuilt in place
+  void *old_copy = malloc(PAGE_SIZE);
+  memcpy(old_copy, old_node, PAGE_SIZE);
+  uint32_t old_num_cells = *leaf_node_num_cells(old_copy);
+  uint32_t total_cells = old_num_cells + 1;
+
+  // Split by bytes rather than by cell count: the left half takes cells
+  // until it holds at least half of the total space
+  uint32_t total_space = LEAF_NODE_CELL_SPACE(row_size);
+  for (uint32_t i = 0; i < old_num_cells; i++) {
+    total_space += LEAF_NODE_CELL_SPACE(*leaf_node_value_size(old_copy, i));
+  }
+
+  uint32_t split_index = 0;
+  uint32_t left_space = 0;
+  while (split_index < total_cells - 1 && left_space < total_space / 2) {
+    uint32_t value_size =
+        (split_index == cursor->cell_num)
+            ? row_size
+            : *leaf_node_value_size(
+                  old_copy, split_index - (split_index > cursor->cell_num));
+    left_space += LEAF_NODE_CELL_SPACE(value_size);
+    split_index++;
+  }
+
+  // Appending past the end of the last leaf (ascending keys, ROWIDs):
+  // leave the old leaf full instead of half empty
+  if (cursor->cell_num == old_num_cells && *leaf_node_next_leaf(old_copy) == 0) {
+    split_index = old_num_cells;
+  }
+
   initialize_leaf_node(new_node);
   *node_parent(new_node) = *node_parent(old_node);
   *leaf_node_next_leaf(new_node) = *leaf_node_next_leaf(old_node);
   *leaf_node_next_leaf(old_node) = new_page_num;
+  *leaf_node_prev_leaf(new_node) = cursor->page_num;
+
+  uint32_t next_page_num = *leaf_node_next_leaf(new_node);
+  if (next_page_num != 0) {
+    void *next_node = pager_get_page(pager, next_page_num);
+    pager_mark_dirty(pager, next_page_num);
+    *leaf_node_prev_leaf(next_node) = new_page_num;
+    pager_unpin_page(pager, next_page_num);
+  }
+  *leaf_node_num_cells(old_node) = 0;
+  *leaf_node_content_start(old_node) = PAGE_SIZE;
 
-  uint32_t split_index = (LEAF_NODE_MAX_CELLS + 1) / 2;
-
-  for (uint32_t i = LEAF_NODE_MAX_CELLS; i >= 0; i--) {
-    void *destination_node;
-    uint32_t index_within_node;
-
-    if (i >= split_index) {
-      destination_node = new_node;
-      index_within_node = i - split_index;
-    } else {
-      destination_node = old_node;
-      index_within_node = i;
-    }
-
-    void *destination = leaf_node_cell(destination_node, index_within_node);
+  for (uint32_t i = 0; i < total_cells; i++) {
+    void *destination_node = (i < split_index) ? old_node : new_node;
+    uint32_t index_within_node = *leaf_node_num_cells(destination_node);
 
     if (i == cursor->cell_num) {
-      *(uint32_t *)(destination) = key;
-      memcpy(destination + LEAF_NODE_KEY_SIZE, value, row_size);
-    } else if (i > cursor->cell_num) {
-      memcpy(destination, leaf_node_cell(old_node, i - 1), LEAF_NODE_CELL_SIZE);
+      leaf_node_insert_cell(destination_node, index_within_node, key, value,
+                            row_size);
     } else {
-      memcpy(destination, leaf_node_cell(old_node, i), LEAF_NODE_CELL_SIZE);
+      uint32_t source = (i > cursor->cell_num) ? i - 1 : i;
+      leaf_node_insert_cell(destination_node, index_within_node,
+                            *leaf_node_key(old_copy, source),
+                            leaf_node_value(old_copy, source),
+                            *leaf_node_value_size(old_copy, source));
     }
-
-    if (i == 0)
-      break;
   }
+  free(old_copy);
 
-  *(leaf_node_num_cells(old_node)) = split_index;
-  *(leaf_node_num_cells(new_node)) = (LEAF_NODE_MAX_CELLS + 1) - split_index;
+  bool was_root = is_node_root(old_node);
+  uint32_t parent_page_num = *node_parent(old_node);
+  uint64_t new_max = get_node_max_key(pager, old_node);
+  pager_unpin_page(pager, new_page_num);
+  pager_unpin_page(pager, cursor->page_num);
 
-  if (is_node_root(old_node)) {
+  if (was_root) {
     return create_new_root(cursor->table, cursor->page_num, new_page_num);
   } else {
-    uint32_t parent_page_num = *node_parent(old_node);
-    uint32_t new_max = get_node_max_key(cursor->table->pager, old_node);
-    void *parent = pager_get_page(cursor->table->pager, parent_page_num);
-
+    void *parent = pager_get_page(pager, parent_page_num);
+    pager_mark_dirty(pager, parent_page_num);
     update_internal_node_key(parent, old_max, new_max);
+    pager_unpin_page(pager, parent_page_num);
+
     internal_node_insert(cursor->table, parent_page_num, new_page_num);
   }
 }
@@ -327,24 +408,28 @@ void internal_node_insert(Table *table, uint32_t parent_page_num,
                           uint32_t child_page_num) {
   void *parent = pager_get_page(table->pager, parent_page_num);
   void *child = pager_get_page(table->pager, child_page_num);
-  uint32_t child_max_key = get_node_max_key(table->pager, child);
+  uint64_t child_max_key = get_node_max_key(table->pager, child);
   uint32_t index = internal_node_find_child(parent, child_max_key);
+  pager_unpin_page(table->pager, child_page_num);
 
   uint32_t original_num_keys = *internal_node_num_keys(parent);
-  *internal_node_num_keys(parent) = original_num_keys + 1;
-
   if (original_num_keys >= INTERNAL_NODE_MAX_CELLS) {
-    printf("Need to implement splitting internal node\n");
-    exit(EXIT_FAILURE);
+    pager_unpin_page(table->pager, parent_page_num);
+    internal_node_split_and_insert(table, parent_page_num, child_page_num);
+    return;
   }
 
+  pager_mark_dirty(table->pager, parent_page_num);
+  *internal_node_num_keys(parent) = original_num_keys + 1;
+
   uint32_t right_child_page_num = *internal_node_right_child(parent);
   void *right_child = pager_get_page(table->pager, right_child_page_num);
+  uint64_t right_child_max_key = get_node_max_key(table->pager, right_child);
+  pager_unpin_page(table->pager, right_child_page_num);
 
-  if (child_max_key > get_node_max_key(table->pager, right_child)) {
+  if (child_max_key > right_child_max_key) {
     *internal_node_child(parent, original_num_keys) = right_child_page_num;
-    *internal_node_key(parent, original_num_keys) =
-        get_node_max_key(table->pager, right_child);
+    *internal_node_key(parent, original_num_keys) = right_child_max_key;
     *internal_node_right_child(parent) = child_page_num;
   } else {
     for (uint32_t i = original_num_keys; i > index; i--) {
@@ -355,4 +440,583 @@ void internal_node_insert(Table *table, uint32_t parent_page_num,
     *internal_node_child(parent, index) = child_page_num;
     *internal_node_key(parent, index) = child_max_key;
   }
+
+  pager_unpin_page(table->pager, parent_page_num);
+}
+
+// Split a full internal node around its middle child and add child_page_num
+// to whichever half it belongs in. The separator pushed up to the parent is
+// the max key of the left half; splits cascade up to the root.
+void internal_node_split_and_insert(Table *table, uint32_t old_page_num,
+                                    uint32_t child_page_num) {
+  Pager *pager = table->pager;
+  void *old_node = pager_get_page(pager, old_page_num);
+  uint64_t old_max = get_node_max_key(pager, old_node);
+  void *child = pager_get_page(pager, child_page_num);
+  uint64_t child_max = get_node_max_key(pager, child);
+  pager_unpin_page(pager, child_page_num);
+
+  // Gather every child of the full node plus the new one, in key order.
+  // keys[i] is the max key under pages[i].
+  uint32_t num_keys = *internal_node_num_keys(old_node);
+  uint32_t total = num_keys + 2;
+  uint32_t *pages = malloc(sizeof(uint32_t) * total);
+  uint64_t *keys = malloc(sizeof(uint64_t) * total);
+  uint32_t count = 0;
+  bool placed = false;
+
+  for (uint32_t i = 0; i <= num_keys; i++) {
+    uint64_t key = (i < num_keys) ? *internal_node_key(old_node, i) : old_max;
+    if (!placed && child_max < key) {
+      pages[count] = child_page_num;
+      keys[count++] = child_max;
+      placed = true;
+    }
+    pages[count] = *internal_node_child(old_node, i);
+    keys[count++] = key;
+  }
+  if (!placed) {
+    pages[count] = child_page_num;
+    keys[count++] = child_max;
+  }
+
+  uint32_t left_count = total / 2;
+  uint32_t new_page_num = pager_allocate_page(pager);
+  void *new_node = pager_get_page(pager, new_page_num);
+  pager_mark_dirty(pager, old_page_num);
+  pager_mark_dirty(pager, new_page_num);
+  initialize_internal_node(new_node);
+
+  // Left half stays in the old node
+  *internal_node_num_keys(old_node) = left_count - 1;
+  for (uint32_t i = 0; i < left_count - 1; i++) {
+    *internal_node_child(old_node, i) = pages[i];
+    *internal_node_key(old_node, i) = keys[i];
+  }
+  *internal_node_right_child(old_node) = pages[left_count - 1];
+
+  // Right half moves to the new node
+  *internal_node_num_keys(new_node) = total - left_count - 1;
+  for (uint32_t i = left_count; i < total - 1; i++) {
+    *internal_node_child(new_node, i - left_count) = pages[i];
+    *internal_node_key(new_node, i - left_count) = keys[i];
+  }
+  *internal_node_right_child(new_node) = pages[total - 1];
+
+  // Moved children (and the inserted one) need their parent pointers fixed
+  for (uint32_t i = 0; i < total; i++) {
+    if (i < left_count && pages[i] != child_page_num) {
+      continue;
+    }
+    void *moved = pager_get_page(pager, pages[i]);
+    pager_mark_dirty(pager, pages[i]);
+    *node_parent(moved) = (i < left_count) ? old_page_num : new_page_num;
+    pager_unpin_page(pager, pages[i]);
+  }
+
+  uint64_t left_max = keys[left_count - 1];
+  bool was_root = is_node_root(old_node);
+  uint32_t parent_page_num = *node_parent(old_node);
+  free(pages);
+  free(keys);
+
+  if (was_root) {
+    pager_unpin_page(pager, new_page_num);
+    pager_unpin_page(pager, old_page_num);
+    create_new_root(table, old_page_num, new_page_num);
+    return;
+  }
+
+  *node_parent(new_node) = parent_page_num;
+  pager_unpin_page(pager, new_page_num);
+  pager_unpin_page(pager, old_page_num);
+
+  void *parent = pager_get_page(pager, parent_page_num);
+  pager_mark_dirty(pager, parent_page_num);
+  update_internal_node_key(parent, old_max, left_max);
+  pager_unpin_page(pager, parent_page_num);
+
+  internal_node_insert(table, parent_page_num, new_page_num);
+}
+
+// Deletes remove the cell and then repair underfull nodes from the leaf
+// up: two siblings merge when they fit in one page, otherwise the fuller
+// one gives cells to the other. Separator keys only need to be upper
+// bounds for their subtree, so they change only when cells move between
+// siblings. A root left with a single child hands the root role to it.
+
+// Position of child_page_num among the parent's children
+static uint32_t internal_node_child_index(void *parent,
+                                          uint32_t child_page_num) {
+  uint32_t num_keys = *internal_node_num_keys(parent);
+  for (uint32_t i = 0; i <= num_keys; i++) {
+    if (*internal_node_child(parent, i) == child_page_num) {
+      return i;
+    }
+  }
+  printf("Page %u is not a child of its parent\n", child_page_num);
+  exit(EXIT_FAILURE);
+}
+
+static bool node_is_underfull(void *node) {
+  if (get_node_type(node) == NODE_LEAF) {
+    uint32_t used = LEAF_NODE_SPACE_FOR_CELLS - leaf_node_free_space(node);
+    return used < LEAF_NODE_MIN_USED;
+  }
+  return *internal_node_num_keys(node) < INTERNAL_NODE_MIN_KEYS;
+}
+
+// Child index + 1 has been merged into child index: drop it, and let the
+// merged child take over its separator (or the right child slot)
+static void internal_node_remove_merged(void *parent, uint32_t index) {
+  uint32_t num_keys = *internal_node_num_keys(parent);
+  *internal_node_child(parent, index + 1) = *internal_node_child(parent, index);
+  memmove(internal_node_cell(parent, index), internal_node_cell(parent, index + 1),
+          (num_keys - index - 1) * INTERNAL_NODE_CELL_SIZE);
+  *internal_node_num_keys(parent) = num_keys - 1;
+}
+
+// Merge or even out the leaves at index and index + 1 of the parent.
+// Returns true if they were merged and the parent lost a child.
+static bool leaf_node_rebalance(Table *table, uint32_t parent_page_num,
+                                uint32_t index) {
+  Pager *pager = table->pager;
+  void *parent = pager_get_page(pager, parent_page_num);
+  uint32_t left_page_num = *internal_node_child(parent, index);
+  uint32_t right_page_num = *internal_node_child(parent, index + 1);
+  void *left = pager_get_page(pager, left_page_num);
+  void *right = pager_get_page(pager, right_page_num);
+
+  pager_mark_dirty(pager, parent_page_num);
+  pager_mark_dirty(pager, left_page_num);
+  pager_mark_dirty(pager, right_page_num);
+
+  // Work from copies, since both pages are rebuilt in place
+  void *left_copy = malloc(PAGE_SIZE);
+  void *right_copy = malloc(PAGE_SIZE);
+  memcpy(left_copy, left, PAGE_SIZE);
+  memcpy(right_copy, right, PAGE_SIZE);
+  uint32_t left_cells = *leaf_node_num_cells(left_copy);
+  uint32_t total_cells = left_cells + *leaf_node_num_cells(right_copy);
+  uint32_t used = 2 * LEAF_NODE_SPACE_FOR_CELLS - leaf_node_free_space(left) -
+                  leaf_node_free_space(right);
+
+  // Everything goes left on a merge, otherwise split by bytes as a
+  // leaf split does
+  bool merge = used <= LEAF_NODE_SPACE_FOR_CELLS;
+  uint32_t split_index = total_cells;
+  if (!merge) {
+    uint32_t left_space = 0;
+    split_index = 0;
+    while (split_index < total_cells - 1 && left_space < used / 2) {
+      void *source = (split_index < left_cells) ? left_copy : right_copy;
+      uint32_t cell_num = split_index - (split_index < left_cells ? 0 : left_cells);
+      left_space += LEAF_NODE_CELL_SPACE(*leaf_node_value_size(source, cell_num));
+      split_index++;
+    }
+  }
+
+  *leaf_node_num_cells(left) = 0;
+  *leaf_node_content_start(left) = PAGE_SIZE;
+  *leaf_node_num_cells(right) = 0;
+  *leaf_node_content_start(right) = PAGE_SIZE;
+
+  for (uint32_t i = 0; i < total_cells; i++) {
+    void *source = (i < left_cells) ? left_copy : right_copy;
+    uint32_t cell_num = i - (i < left_cells ? 0 : left_cells);
+    void *destination = (i < split_index) ? left : right;
+    leaf_node_insert_cell(destination, *leaf_node_num_cells(destination),
+                          *leaf_node_key(source, cell_num),
+                          leaf_node_value(source, cell_num),
+                          *leaf_node_value_size(source, cell_num));
+  }
+  free(left_copy);
+  free(right_copy);
+
+  if (merge) {
+    uint32_t next_page_num = *leaf_node_next_leaf(right);
+    *leaf_node_next_leaf(left) = next_page_num;
+    if (next_page_num != 0) {
+      void *next_node = pager_get_page(pager, next_page_num);
+      pager_mark_dirty(pager, next_page_num);
+      *leaf_node_prev_leaf(next_node) = left_page_num;
+      pager_unpin_page(pager, next_page_num);
+    }
+    internal_node_remove_merged(parent, index);
+  } else {
+    uint32_t left_num_cells = *leaf_node_num_cells(left);
+    *internal_node_key(parent, index) = *leaf_node_key(left, left_num_cells - 1);
+  }
+
+  pager_unpin_page(pager, right_page_num);
+  pager_unpin_page(pager, left_page_num);
+  pager_unpin_page(pager, parent_page_num);
+  if (merge) {
+    pager_free_page(pager, right_page_num);
+  }
+  return merge;
+}
+
+static void node_set_parent(Pager *pager, uint32_t page_num,
+                            uint32_t parent_page_num) {
+  void *node = pager_get_page(pager, page_num);
+  pager_mark_dirty(pager, page_num);
+  *node_parent(node) = parent_page_num;
+  pager_unpin_page(pager, page_num);
+}
+
+// Merge the internal nodes at index and index + 1 of the parent, or move
+// one child across to the emptier of the two. Returns true on a merge.
+static bool internal_node_rebalance(Table *table, uint32_t parent_page_num,
+                                    uint32_t index) {
+  Pager *pager = table->pager;
+  void *parent = pager_get_page(pager, parent_page_num);
+  uint32_t left_page_num = *internal_node_child(parent, index);
+  uint32_t right_page_num = *internal_node_child(parent, index + 1);
+  void *left = pager_get_page(pager, left_page_num);
+  void *right = pager_get_page(pager, right_page_num);
+
+  pager_mark_dirty(pager, parent_page_num);
+  pager_mark_dirty(pager, left_page_num);
+  pager_mark_dirty(pager, right_page_num);
+
+  // The parent's separator bounds the left node's right child
+  uint64_t separator = *internal_node_key(parent, index);
+  uint32_t left_keys = *internal_node_num_keys(left);
+  uint32_t right_keys = *internal_node_num_keys(right);
+  bool merge = left_keys + right_keys + 1 <= INTERNAL_NODE_MAX_CELLS;
+
+  if (merge) {
+    *internal_node_cell(left, left_keys) = *internal_node_right_child(left);
+    *internal_node_key(left, left_keys) = separator;
+    memcpy(internal_node_cell(left, left_keys + 1), internal_node_cell(right, 0),
+           right_keys * INTERNAL_NODE_CELL_SIZE);
+    *internal_node_right_child(left) = *internal_node_right_child(right);
+    *internal_node_num_keys(left) = left_keys + right_keys + 1;
+    internal_node_remove_merged(parent, index);
+
+    for (uint32_t i = 0; i <= right_keys; i++) {
+      node_set_parent(pager, *internal_node_child(right, i), left_page_num);
+    }
+  } else if (left_keys < right_keys) {
+    // Right's first child moves to the end of left
+    uint32_t moved_page_num = *internal_node_child(right, 0);
+    *internal_node_cell(left, left_keys) = *internal_node_right_child(left);
+    *internal_node_key(left, left_keys) = separator;
+    *internal_node_right_child(left) = moved_page_num;
+    *internal_node_num_keys(left) = left_keys + 1;
+
+    *internal_node_key(parent, index) = *internal_node_key(right, 0);
+    memmove(internal_node_cell(right, 0), internal_node_cell(right, 1),
+            (right_keys - 1) * INTERNAL_NODE_CELL_SIZE);
+    *internal_node_num_keys(right) = right_keys - 1;
+
+    node_set_parent(pager, moved_page_num, left_page_num);
+  } else {
+    // Left's right child moves to the front of right
+    uint32_t moved_page_num = *internal_node_right_child(left);
+    memmove(internal_node_cell(right, 1), internal_node_cell(right, 0),
+            right_keys * INTERNAL_NODE_CELL_SIZE);
+    *internal_node_cell(right, 0) = moved_page_num;
+    *internal_node_key(right, 0) = separator;
+    *internal_node_num_keys(right) = right_keys + 1;
+
+    *internal_node_right_child(left) = *internal_node_cell(left, left_keys - 1);
+    *internal_node_key(parent, index) = *internal_node_key(left, left_keys - 1);
+    *internal_node_num_keys(left) = left_keys - 1;
+
+    node_set_parent(pager, moved_page_num, right_page_num);
+  }
+
+  pager_unpin_page(pager, right_page_num);
+  pager_unpin_page(pager, left_page_num);
+  pager_unpin_page(pager, parent_page_num);
+  if (merge) {
+    pager_free_page(pager, right_page_num);
+  }
+  return merge;
+}
+
+// Repair page_num after it lost a cell or a child, then each ancestor
+// that lost a child to a merge
+static void btree_rebalance(Table *table, uint32_t page_num) {
+  Pager *pager = table->pager;
+
+  while (true) {
+    void *node = pager_get_page(pager, page_num);
+    bool is_leaf = get_node_type(node) == NODE_LEAF;
+
+    if (is_node_root(node)) {
+      if (is_leaf || *internal_node_num_keys(node) > 0) {
+        pager_unpin_page(pager, page_num);
+        return;
+      }
+      // Only one child left: it becomes the root
+      uint32_t child_page_num = *internal_node_right_child(node);
+      pager_unpin_page(pager, page_num);
+
+      void *child = pager_get_page(pager, child_page_num);
+      pager_mark_dirty(pager, child_page_num);
+      set_node_root(child, true);
+      *node_parent(child) = 0;
+      pager_unpin_page(pager, child_page_num);
+
+      pager_mark_dirty(pager, CATALOG_PAGE_NUM);
+      table->schema->root_page_num = child_page_num;
+      pager_free_page(pager, page_num);
+      page_num = child_page_num;
+      continue;
+    }
+
+    bool underfull = node_is_underfull(node);
+    uint32_t parent_page_num = *node_parent(node);
+    pager_unpin_page(pager, page_num);
+    if (!underfull) {
+      return;
+    }
+
+    void *parent = pager_get_page(pager, parent_page_num);
+    uint32_t num_keys = *internal_node_num_keys(parent);
+    uint32_t index = internal_node_child_index(parent, page_num);
+    pager_unpin_page(pager, parent_page_num);
+
+    if (num_keys == 0) {
+      // No sibling to work with until the parent has been repaired;
+      // that may move this node under a new parent
+      btree_rebalance(table, parent_page_num);
+      continue;
+    }
+
+    uint32_t left_index = (index < num_keys) ? index : index - 1;
+    bool merged = is_leaf
+                      ? leaf_node_rebalance(table, parent_page_num, left_index)
+                      : internal_node_rebalance(table, parent_page_num, left_index);
+    if (!merged) {
+      return;
+    }
+    page_num = parent_page_num;
+  }
+}
+
+void leaf_node_delete(Cursor *cursor) {
+  Pager *pager = cursor->table->pager;
+  void *node = pager_get_page(pager, cursor->page_num);
+  pager_mark_dirty(pager, cursor->page_num);
+  leaf_node_delete_cell(node, cursor->cell_num);
+  pager_unpin_page(pager, cursor->page_num);
+
+  btree_rebalance(cursor->table, cursor->page_num);
+}
+
+// Bulk loading fills leaves left to right and builds each internal level
+// as it goes. Every level has one open node in memory; when it is full it
+// is written out and its page number and max key are pushed into the
+// level above. No node is ever split or revisited.
+#define BULK_LOAD_MAX_LEVELS 16
+
+typedef struct {
+  char node[PAGE_SIZE];
+  uint32_t page_num;
+  uint32_t count; // Cells in a leaf, children in an internal node
+  uint64_t max_key;
+  bool open;
+} BulkLevel;
+
+typedef struct {
+  Table *table;
+  uint32_t first_page_num;  // The table's old root becomes the first leaf
+  uint32_t leaf_budget;     // Bytes of cells per leaf
+  uint32_t internal_budget; // Children per internal node
+  BulkLevel levels[BULK_LOAD_MAX_LEVELS];
+} BulkLoader;
+
+static void bulk_load_write(BulkLoader *loader, BulkLevel *level) {
+  Pager *pager = loader->table->pager;
+  if (level->page_num == loader->first_page_num) {
+    // Already on disk, so it goes through the WAL like any other change
+    void *page = pager_get_page(pager, level->page_num);
+    pager_mark_dirty(pager, level->page_num);
+    memcpy(page, level->node, PAGE_SIZE);
+    pager_unpin_page(pager, level->page_num);
+  } else {
+    pager_write_new_page(pager, level->page_num, level->node);
+  }
+}
+
+static void bulk_load_open_leaf(BulkLoader *loader, uint32_t page_num) {
+  BulkLevel *leaf = &loader->levels[0];
+  memset(leaf->node, 0, PAGE_SIZE);
+  initialize_leaf_node(leaf->node);
+  leaf->page_num = page_num;
+  leaf->count = 0;
+  leaf->open = true;
+}
+
+static void bulk_load_close(BulkLoader *loader, uint32_t depth);
+
+// Add a finished node to the level above, starting a new parent if the
+// current one is full. Returns the parent's page number.
+static uint32_t bulk_load_push(BulkLoader *loader, uint32_t depth,
+                               uint32_t child_page_num, uint64_t child_max) {
+  if (depth == BULK_LOAD_MAX_LEVELS) {
+    printf("Bulk load tree too deep\n");
+    exit(EXIT_FAILURE);
+  }
+
+  BulkLevel *level = &loader->levels[depth];
+  if (level->open && level->count == loader->internal_budget) {
+    bulk_load_close(loader, depth);
+  }
+  if (!level->open) {
+    memset(level->node, 0, PAGE_SIZE);
+    initialize_internal_node(level->node);
+    level->page_num = pager_allocate_new_page(loader->table->pager);
+    level->count = 0;
+    level->open = true;
+  }
+
+  void *node = level->node;
+  if (level->count > 0) {
+    // The previous right child gets its key and becomes a regular cell
+    uint32_t num_keys = *internal_node_num_keys(node);
+    *internal_node_cell(node, num_keys) = *internal_node_right_child(node);
+    *internal_node_key(node, num_keys) = level->max_key;
+    *internal_node_num_keys(node) = num_keys + 1;
+  }
+  *internal_node_right_child(node) = child_page_num;
+  level->max_key = child_max;
+  level->count++;
+
+  return level->page_num;
+}
+
+// Write out the open node at `depth` and hand it to its parent
+static void bulk_load_close(BulkLoader *loader, uint32_t depth) {
+  BulkLevel *level = &loader->levels[depth];
+  *node_parent(level->node) =
+      bulk_load_push(loader, depth + 1, level->page_num, level->max_key);
+  bulk_load_write(loader, level);
+  level->open = false;
+}
+
+static void bulk_load_add(BulkLoader *loader, uint64_t key, void *row,
+                          uint32_t row_size) {
+  BulkLevel *leaf = &loader->levels[0];
+  uint32_t used = LEAF_NODE_SPACE_FOR_CELLS - leaf_node_free_space(leaf->node);
+
+  if (leaf->count > 0 &&
+      (used + LEAF_NODE_CELL_SPACE(row_size) > loader->leaf_budget ||
+       leaf_node_free_space(leaf->node) < LEAF_NODE_CELL_SPACE(row_size))) {
+    uint32_t prev_page_num = leaf->page_num;
+    uint32_t next_page_num = pager_allocate_new_page(loader->table->pager);
+    *leaf_node_next_leaf(leaf->node) = next_page_num;
+    bulk_load_close(loader, 0);
+    bulk_load_open_leaf(loader, next_page_num);
+    *leaf_node_prev_leaf(leaf->node) = prev_page_num;
+  }
+
+  leaf_node_insert_cell(leaf->node, leaf->count, key, row, row_size);
+  leaf->count++;
+  leaf->max_key = key;
+}
+
+// Undo a load that can't finish: give back every page it took and put
+// the first leaf back as it was. Nothing outside the load points at them
+static void bulk_load_discard(BulkLoader *loader, uint32_t first_new_page_num,
+                              const void *first_page) {
+  Pager *pager = loader->table->pager;
+  void *page = pager_get_page(pager, loader->first_page_num);
+  if (memcmp(page, first_page, PAGE_SIZE) != 0) {
+    pager_mark_dirty(pager, loader->first_page_num);
+    memcpy(page, first_page, PAGE_SIZE);
+  }
+  pager_unpin_page(pager, loader->first_page_num);
+
+  uint32_t end_page_num = pager->num_pages;
+  for (uint32_t page_num = first_new_page_num; page_num < end_page_num;
+       page_num++) {
+    pager_free_page(pager, page_num);
+  }
+}
+
+BulkLoadResult table_bulk_load(Table *table, BulkLoadNext next, void *context,
+                               uint32_t fill_percent, uint32_t *rows_loaded) {
+  Pager *pager = table->pager;
+  uint32_t root_page_num = table->schema->root_page_num;
+  uint32_t row_size = table->schema->row_size;
+  *rows_loaded = 0;
+
+  void *root = pager_get_page(pager, root_page_num);
+  bool empty =
+      get_node_type(root) == NODE_LEAF && *leaf_node_num_cells(root) == 0;
+  char *old_root = malloc(PAGE_SIZE);
+  memcpy(old_root, root, PAGE_SIZE);
+  pager_unpin_page(pager, root_page_num);
+  if (!empty) {
+    free(old_root);
+    return BULK_LOAD_TABLE_NOT_EMPTY;
+  }
+  // Every page the load takes comes from past the end of the file
+  uint32_t first_new_page_num = pager->num_pages;
+
+  if (fill_percent == 0 || fill_percent > 100) {
+    fill_percent = DEFAULT_BULK_LOAD_FILL;
+  }
+
+  BulkLoader *loader = calloc(1, sizeof(BulkLoader));
+  loader->table = table;
+  loader->first_page_num = root_page_num;
+  loader->leaf_budget = LEAF_NODE_SPACE_FOR_CELLS * fill_percent / 100;
+  loader->internal_budget = (INTERNAL_NODE_MAX_CELLS + 1) * fill_percent / 100;
+  if (loader->internal_budget < 2) {
+    loader->internal_budget = 2;
+  }
+  bulk_load_open_leaf(loader, root_page_num);
+
+  BulkLoadResult result = BULK_LOAD_SUCCESS;
+  void *row = malloc(row_size);
+  uint64_t key;
+
+  while (next(context, &key, row)) {
+    if (*rows_loaded > 0 && key <= loader->levels[0].max_key) {
+      result = BULK_LOAD_UNSORTED;
+      break;
+    }
+    bulk_load_add(loader, key, row, row_size);
+    (*rows_loaded)++;
+  }
+  free(row);
+
+  if (result == BULK_LOAD_UNSORTED) {
+    bulk_load_discard(loader, first_new_page_num, old_root);
+    *rows_loaded = 0;
+  }
+  free(old_root);
+  if (*rows_loaded == 0) {
+    free(loader);
+    return result;
+  }
+
+  // Close every level that has a parent; the one left over is the root
+  uint32_t depth = 0;
+  while (depth + 1 < BULK_LOAD_MAX_LEVELS && loader->levels[depth + 1].open) {
+    bulk_load_close(loader, depth);
+    depth++;
+  }
+
+  BulkLevel *top = &loader->levels[depth];
+  set_node_root(top->node, true);
+  *node_parent(top->node) = 0;
+  bulk_load_write(loader, top);
+
+  // New pages must be durable before the WAL commits the catalog
+  // pointing at them
+  pager_sync(pager);
+  if (top->page_num != root_page_num) {
+    pager_mark_dirty(pager, CATALOG_PAGE_NUM);
+    table->schema->root_page_num = top->page_num;
+  }
+
+  free(loader);
+  return result;
 }
@@ -1,39 +1,286 @@
 #include "../include/database.h"
+#include "../include/btree.h"
+#include <time.h>
+
+static uint64_t now_ms() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// Background writer: syncs group commits still waiting for their fsync,
+// frees page versions no snapshot needs any more, and checkpoints dirty
+// pages every interval so a crash loses at most one interval of work
+static void *background_writer_main(void *arg) {
+  Database *db = arg;
+  uint64_t last_checkpoint = now_ms();
+
+  pthread_mutex_lock(&db->background_lock);
+  while (db->background_running) {
+    uint32_t wait_ms = db->checkpoint_interval_ms;
+    if (db->group_commit_ms > 0 &&
+        (wait_ms == 0 || db->group_commit_ms < wait_ms)) {
+      wait_ms = db->group_commit_ms;
+    }
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += wait_ms / 1000;
+    deadline.tv_nsec += (long)(wait_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+
+    pthread_cond_timedwait(&db->background_wake, &db->background_lock,
+                           &deadline);
+    if (!db->background_running) {
+      break;
+    }
+
+    // These don't need the writer lock, which an open transaction may hold
+    // for a long time
+    wal_flush(db->pager->wal); // No-op unless commits are waiting
+    pager_collect_versions(db->pager);
+
+    // A checkpoint that finds the writer busy waits for the next wake
+    if (db->checkpoint_interval_ms > 0 &&
+        now_ms() - last_checkpoint >= db->checkpoint_interval_ms &&
+        pthread_mutex_trylock(&db->lock) == 0) {
+      pager_checkpoint(db->pager);
+      pthread_mutex_unlock(&db->lock);
+      last_checkpoint = now_ms();
+    }
+  }
+  pthread_mutex_unlock(&db->background_lock);
+
+  return NULL;
+}
 
 // Initialize a new database
-Database *db_open(const char *filename) {
-  Pager *pager = pager_open(filename);
+Database *db_open(const char *filename, const DbOptions *options) {
+  Pager *pager = pager_open(filename, options);
   Database *db = malloc(sizeof(Database));
   db->pager = pager;
 
   if (pager->num_pages == 0) {
     // New database - initialize catalog in page 0
-    void *catalog_page = pager_get_page(pager, 0);
+    void *catalog_page = pager_get_page(pager, CATALOG_PAGE_NUM);
+    pager_mark_dirty(pager, CATALOG_PAGE_NUM);
     db->catalog = (Catalog *)catalog_page;
     db->catalog->num_tables = 0;
-    db->catalog->next_free_page = 1; // Page 0 is for catalog
+    db->catalog->free_list_head = 0;
+    db->catalog->num_free_pages = 0;
 
     for (uint32_t i = 0; i < MAX_TABLES; i++) {
       db->catalog->tables[i].in_use = false;
     }
   } else {
     // Existing database - load catalog from page 0
-    void *catalog_page = pager_get_page(pager, 0);
+    void *catalog_page = pager_get_page(pager, CATALOG_PAGE_NUM);
     db->catalog = (Catalog *)catalog_page;
   }
 
+  // The catalog page stays pinned until db_close
+  wal_wait_commit(pager->wal, pager_commit(pager));
+
+  db->unsynced_commit = 0;
+  pthread_mutex_init(&db->lock, NULL);
+  pthread_mutex_init(&db->background_lock, NULL);
+  pthread_cond_init(&db->background_wake, NULL);
+  db->checkpoint_interval_ms =
+      options ? options->checkpoint_interval_ms : DEFAULT_CHECKPOINT_INTERVAL_MS;
+  db->group_commit_ms = (pager->wal->sync_mode == WAL_SYNC_GROUP)
+                            ? (options ? options->group_commit_ms
+                                       : DEFAULT_GROUP_COMMIT_MS)
+                            : 0;
+  db->background_running =
+      db->checkpoint_interval_ms > 0 || db->group_commit_ms > 0;
+  if (db->background_running &&
+      pthread_create(&db->background_writer, NULL, background_writer_main,
+                     db) != 0) {
+    printf("Unable to start background writer thread\n");
+    db->background_running = false;
+  }
+
   return db;
 }
 
 // Close database
 void db_close(Database *db) {
+  pthread_mutex_lock(&db->background_lock);
+  bool stop_background = db->background_running;
+  db->background_running = false;
+  pthread_cond_signal(&db->background_wake);
+  pthread_mutex_unlock(&db->background_lock);
+  if (stop_background) {
+    pthread_join(db->background_writer, NULL);
+  }
+
+  pager_unpin_page(db->pager, CATALOG_PAGE_NUM);
   pager_close(db->pager);
+  pthread_cond_destroy(&db->background_wake);
+  pthread_mutex_destroy(&db->background_lock);
+  pthread_mutex_destroy(&db->lock);
   free(db);
 }
 
+void db_lock(Database *db) {
+  pthread_mutex_lock(&db->lock);
+  pager_set_writer(db->pager, true);
+}
+
+void db_unlock(Database *db) {
+  uint64_t commit_lsn = db->unsynced_commit;
+  db->unsynced_commit = 0;
+  pager_set_writer(db->pager, false);
+  pthread_mutex_unlock(&db->lock);
+  if (commit_lsn > 0) {
+    wal_wait_commit(db->pager->wal, commit_lsn);
+  }
+}
+
+void db_commit(Database *db) { db->unsynced_commit = pager_commit(db->pager); }
+
+void db_rollback(Database *db) { pager_rollback(db->pager); }
+
+void db_begin_snapshot(Database *db) { pager_begin_snapshot(db->pager); }
+
+void db_end_snapshot(Database *db) { pager_end_snapshot(db->pager); }
+
+uint32_t db_checkpoint(Database *db) { return pager_checkpoint(db->pager); }
+
+// Mark every page of the tree rooted at page_num as live
+static void vacuum_mark_tree(Pager *pager, uint32_t page_num, bool *live) {
+  live[page_num] = true;
+  void *node = pager_get_page(pager, page_num);
+  if (get_node_type(node) == NODE_INTERNAL) {
+    uint32_t num_keys = *internal_node_num_keys(node);
+    for (uint32_t i = 0; i <= num_keys; i++) {
+      vacuum_mark_tree(pager, *internal_node_child(node, i), live);
+    }
+  }
+  pager_unpin_page(pager, page_num);
+}
+
+static void vacuum_set_parent(Pager *pager, uint32_t page_num,
+                              uint32_t parent_page_num) {
+  void *node = pager_get_page(pager, page_num);
+  pager_mark_dirty(pager, page_num);
+  *node_parent(node) = parent_page_num;
+  pager_unpin_page(pager, page_num);
+}
+
+// Copy a node to another page and repoint everything that refers to it:
+// its parent (or the catalog, for a root), its children's parent pointers
+// and, for a leaf, its neighbours in the leaf chain
+static void vacuum_move_page(Database *db, uint32_t from, uint32_t to) {
+  Pager *pager = db->pager;
+  void *source = pager_get_page(pager, from);
+  void *node = pager_get_page(pager, to);
+  pager_mark_dirty(pager, to);
+  memcpy(node, source, PAGE_SIZE);
+  pager_unpin_page(pager, from);
+
+  if (is_node_root(node)) {
+    pager_mark_dirty(pager, CATALOG_PAGE_NUM);
+    for (uint32_t i = 0; i < MAX_TABLES; i++) {
+      Schema *schema = &db->catalog->tables[i];
+      if (schema->in_use && schema->root_page_num == from) {
+        schema->root_page_num = to;
+      }
+    }
+  } else {
+    uint32_t parent_page_num = *node_parent(node);
+    void *parent = pager_get_page(pager, parent_page_num);
+    pager_mark_dirty(pager, parent_page_num);
+    uint32_t num_keys = *internal_node_num_keys(parent);
+    for (uint32_t i = 0; i <= num_keys; i++) {
+      if (*internal_node_child(parent, i) == from) {
+        *internal_node_child(parent, i) = to;
+      }
+    }
+    pager_unpin_page(pager, parent_page_num);
+  }
+
+  if (get_node_type(node) == NODE_INTERNAL) {
+    uint32_t num_keys = *internal_node_num_keys(node);
+    for (uint32_t i = 0; i <= num_keys; i++) {
+      vacuum_set_parent(pager, *internal_node_child(node, i), to);
+    }
+  } else {
+    uint32_t prev_page_num = *leaf_node_prev_leaf(node);
+    uint32_t next_page_num = *leaf_node_next_leaf(node);
+    if (prev_page_num != 0) {
+      void *prev = pager_get_page(pager, prev_page_num);
+      pager_mark_dirty(pager, prev_page_num);
+      *leaf_node_next_leaf(prev) = to;
+      pager_unpin_page(pager, prev_page_num);
+    }
+    if (next_page_num != 0) {
+      void *next = pager_get_page(pager, next_page_num);
+      pager_mark_dirty(pager, next_page_num);
+      *leaf_node_prev_leaf(next) = to;
+      pager_unpin_page(pager, next_page_num);
+    }
+  }
+
+  pager_unpin_page(pager, to);
+}
+
+// Live pages are the catalog and every page reachable from a table or
+// index root; anything else (the free list, pages orphaned by a crash) is
+// reclaimed. Live pages past the new end are moved into the gaps below
+// it, then the file is cut.
+uint32_t db_vacuum(Database *db) {
+  Pager *pager = db->pager;
+  uint32_t num_pages = pager->num_pages;
+  bool *live = calloc(num_pages, sizeof(bool));
+  live[CATALOG_PAGE_NUM] = true;
+  for (uint32_t i = 0; i < MAX_TABLES; i++) {
+    if (db->catalog->tables[i].in_use) {
+      vacuum_mark_tree(pager, db->catalog->tables[i].root_page_num, live);
+    }
+  }
+
+  uint32_t num_live = 0;
+  for (uint32_t i = 0; i < num_pages; i++) {
+    num_live += live[i];
+  }
+
+  uint32_t gap = 0;
+  for (uint32_t page_num = num_live; page_num < num_pages; page_num++) {
+    if (!live[page_num]) {
+      continue;
+    }
+    while (live[gap]) {
+      gap++;
+    }
+    vacuum_move_page(db, page_num, gap);
+    live[gap] = true;
+  }
+  free(live);
+
+  // Every free page is now past the end
+  pager_mark_dirty(pager, CATALOG_PAGE_NUM);
+  db->catalog->free_list_head = 0;
+  db->catalog->num_free_pages = 0;
+  db->unsynced_commit = pager_commit(pager);
+
+  pager_truncate(pager, num_live);
+  return num_pages - num_live;
+}
+
 // Create a new table in the database
 Schema *db_create_table(Database *db, const char *table_name,
                         uint32_t num_columns) {
+  // Everything is checked before the root page is allocated, which a
+  // rejected table would otherwise leak
+  if (num_columns > MAX_COLUMNS_PER_TABLE) {
+    printf("Too many columns (max %d)\n", MAX_COLUMNS_PER_TABLE);
+    return NULL;
+  }
+
   // Check if table already exists
   for (uint32_t i = 0; i < MAX_TABLES; i++) {
     if (db->catalog->tables[i].in_use &&
@@ -58,12 +305,14 @@ Schema *db_create_table(Database *db, const char *table_name,
   }
 
   // Initialize schema
+  pager_mark_dirty(db->pager, CATALOG_PAGE_NUM);
   Schema *schema = &db->catalog->tables[slot];
   strncpy(schema->name, table_name, 31);
   schema->name[31] = '\0';
   schema->num_columns = num_columns;
   schema->in_use = true;
   schema->row_size = 0;
+  schema->is_index = false;
   schema->pk_column = -1; // No PK yet
   schema->next_rowid = 1; // Start auto-increment at 1
 
@@ -71,35 +320,42 @@ Schema *db_create_table(Database *db, const char *table_name,
   // This ensures no conflicts with B+tree node splits
   schema->root_page_num = pager_allocate_page(db->pager);
 
-  if (num_columns > MAX_COLUMNS_PER_TABLE) {
-    printf("Too many columns (max %d)\n", MAX_COLUMNS_PER_TABLE);
-    schema->in_use = false;
-    return NULL;
-  }
-
   db->catalog->num_tables++;
 
   return schema;
 }
 
-// Get a table by name
+// Get a table by name. Indexes share the namespace but aren't tables
 Schema *db_get_table(Database *db, const char *table_name) {
+  Schema *schema = NULL;
+  // Look in the catalog as the caller's snapshot sees it, but hand back
+  // the live schema, which is where cursors expect it
+  Catalog *catalog = pager_get_page_shared(db->pager, CATALOG_PAGE_NUM);
   for (uint32_t i = 0; i < MAX_TABLES; i++) {
-    if (db->catalog->tables[i].in_use &&
-        strcmp(db->catalog->tables[i].name, table_name) == 0) {
-      return &db->catalog->tables[i];
+    if (catalog->tables[i].in_use && !catalog->tables[i].is_index &&
+        strcmp(catalog->tables[i].name, table_name) == 0) {
+      schema = &db->catalog->tables[i];
+      break;
     }
   }
-  return NULL;
+  pager_release_page_shared(db->pager, CATALOG_PAGE_NUM, catalog);
+  return schema;
 }
 
 // List all tables
 void db_list_tables(Database *db) {
   printf("Tables in database:\n");
   for (uint32_t i = 0; i < MAX_TABLES; i++) {
-    if (db->catalog->tables[i].in_use) {
-      printf("  - %s (%d columns)\n", db->catalog->tables[i].name,
-             db->catalog->tables[i].num_columns);
+    Schema *schema = &db->catalog->tables[i];
+    if (!schema->in_use) {
+      continue;
+    }
+    if (schema->is_index) {
+      Schema *table = &db->catalog->tables[schema->index_table];
+      printf("  - %s (index on %s.%s)\n", schema->name, table->name,
+             table->columns[schema->index_column].name);
+    } else {
+      printf("  - %s (%d columns)\n", schema->name, schema->num_columns);
     }
   }
 }
@@ -138,16 +394,23 @@ void schema_add_column(Schema *schema, uint32_t index, const char *name,
   col->size = (type == COL_TYPE_TEXT) ? size : sizeof(int32_t);
   col->is_pk = is_pk;
 
-  // Recalculate row size
+  // Recalculate column offsets and row size
   schema->row_size = 0;
   for (uint32_t i = 0; i < schema->num_columns; i++) {
     Column *c = &schema->columns[i];
+    c->offset = schema->row_size;
     if (c->type == COL_TYPE_INT) {
       schema->row_size += sizeof(int32_t);
     } else if (c->type == COL_TYPE_TEXT) {
       schema->row_size += c->size;
     }
   }
+
+  if (schema->row_size > LEAF_NODE_VALUE_SIZE_MAX) {
+    printf("Error: Row size %u exceeds maximum of %u bytes\n",
+           schema->row_size, (uint32_t)LEAF_NODE_VALUE_SIZE_MAX);
+    schema->in_use = false;
+  }
 }
 
 // Open a table for use
@@ -0,0 +1,195 @@
+#include "../include/index.h"
+
+static uint32_t catalog_slot(Database *db, Schema *schema) {
+  return (uint32_t)(schema - db->catalog->tables);
+}
+
+Schema *index_find(Database *db, Schema *table, uint32_t column) {
+  uint32_t slot = catalog_slot(db, table);
+  Schema *found = NULL;
+  // An index created after the caller's snapshot doesn't exist for it
+  Catalog *catalog = pager_get_page_shared(db->pager, CATALOG_PAGE_NUM);
+  for (uint32_t i = 0; i < MAX_TABLES; i++) {
+    Schema *index = &catalog->tables[i];
+    if (index->in_use && index->is_index && index->index_table == slot &&
+        index->index_column == column) {
+      found = &db->catalog->tables[i];
+      break;
+    }
+  }
+  pager_release_page_shared(db->pager, CATALOG_PAGE_NUM, catalog);
+  return found;
+}
+
+static void index_tree_insert(Database *db, Schema *index, uint64_t key) {
+  Table tree = {.pager = db->pager, .schema = index};
+  char no_value = 0; // Index cells are all key
+  Cursor *cursor = table_find(&tree, key);
+  leaf_node_insert(cursor, key, &no_value, 0);
+  cursor_free(cursor);
+}
+
+static void index_tree_delete(Database *db, Schema *index, uint64_t key) {
+  Table tree = {.pager = db->pager, .schema = index};
+  Cursor *cursor = table_find(&tree, key);
+  void *node = pager_get_page(db->pager, cursor->page_num);
+  bool found = cursor->cell_num < *leaf_node_num_cells(node) &&
+               *leaf_node_key(node, cursor->cell_num) == key;
+  pager_unpin_page(db->pager, cursor->page_num);
+  if (found) {
+    leaf_node_delete(cursor);
+  }
+  cursor_free(cursor);
+}
+
+// The next index on the table at or after catalog slot *i, or NULL
+static Schema *index_next(Database *db, Schema *table, uint32_t *i) {
+  uint32_t slot = catalog_slot(db, table);
+  for (; *i < MAX_TABLES; (*i)++) {
+    Schema *index = &db->catalog->tables[*i];
+    if (index->in_use && index->is_index && index->index_table == slot) {
+      (*i)++;
+      return index;
+    }
+  }
+  return NULL;
+}
+
+void index_insert_row(Database *db, Schema *table, const void *row,
+                      uint32_t row_key) {
+  uint32_t i = 0;
+  Schema *index;
+  while ((index = index_next(db, table, &i))) {
+    index_tree_insert(
+        db, index, index_key(row_int(table, row, index->index_column), row_key));
+  }
+}
+
+void index_delete_row(Database *db, Schema *table, const void *row,
+                      uint32_t row_key) {
+  uint32_t i = 0;
+  Schema *index;
+  while ((index = index_next(db, table, &i))) {
+    index_tree_delete(
+        db, index, index_key(row_int(table, row, index->index_column), row_key));
+  }
+}
+
+void index_update_row(Database *db, Schema *table, const void *old_row,
+                      uint32_t old_key, const void *new_row, uint32_t new_key) {
+  uint32_t i = 0;
+  Schema *index;
+  while ((index = index_next(db, table, &i))) {
+    uint64_t old_index_key =
+        index_key(row_int(table, old_row, index->index_column), old_key);
+    uint64_t new_index_key =
+        index_key(row_int(table, new_row, index->index_column), new_key);
+    if (old_index_key != new_index_key) {
+      index_tree_delete(db, index, old_index_key);
+      index_tree_insert(db, index, new_index_key);
+    }
+  }
+}
+
+// Sorted index keys handed to table_bulk_load
+typedef struct {
+  uint64_t *keys;
+  uint32_t count;
+  uint32_t next;
+} IndexBuild;
+
+static bool index_build_next(void *context, uint64_t *key, void *row) {
+  (void)row;
+  IndexBuild *build = context;
+  if (build->next == build->count) {
+    return false;
+  }
+  *key = build->keys[build->next++];
+  return true;
+}
+
+static int compare_index_keys(const void *a, const void *b) {
+  uint64_t key_a = *(const uint64_t *)a;
+  uint64_t key_b = *(const uint64_t *)b;
+  return (key_a > key_b) - (key_a < key_b);
+}
+
+// Collect (value, row key) for every row, sort, and load bottom-up
+static void index_build(Database *db, Schema *table, Schema *index) {
+  Table base = {.pager = db->pager, .schema = table};
+  IndexBuild build = {.keys = NULL, .count = 0, .next = 0};
+  uint32_t capacity = 0;
+
+  Cursor *cursor = table_start(&base);
+  while (!cursor->end_of_table) {
+    if (build.count == capacity) {
+      capacity = capacity ? capacity * 2 : 1024;
+      build.keys = realloc(build.keys, sizeof(uint64_t) * capacity);
+    }
+    int32_t value = row_int(table, cursor_value(cursor), index->index_column);
+    build.keys[build.count++] = index_key(value, (uint32_t)cursor_key(cursor));
+    cursor_advance(cursor);
+  }
+  cursor_free(cursor);
+
+  qsort(build.keys, build.count, sizeof(uint64_t), compare_index_keys);
+
+  Table tree = {.pager = db->pager, .schema = index};
+  uint32_t rows_loaded;
+  table_bulk_load(&tree, index_build_next, &build, DEFAULT_BULK_LOAD_FILL,
+                  &rows_loaded);
+  free(build.keys);
+}
+
+void index_build_all(Database *db, Schema *table) {
+  uint32_t i = 0;
+  Schema *index;
+  while ((index = index_next(db, table, &i))) {
+    index_build(db, table, index);
+  }
+}
+
+Schema *index_create(Database *db, const char *index_name,
+                     const char *table_name, const char *column_name) {
+  Schema *table = db_get_table(db, table_name);
+  if (!table) {
+    printf("Table '%s' not found\n", table_name);
+    return NULL;
+  }
+
+  int32_t column = schema_find_column(table, column_name);
+  if (column == -1) {
+    printf("Column '%s' not found in '%s'\n", column_name, table_name);
+    return NULL;
+  }
+  if (table->columns[column].type != COL_TYPE_INT) {
+    printf("Error: Only INT columns can be indexed\n");
+    return NULL;
+  }
+  if (column == table->pk_column) {
+    printf("Error: '%s' is the PRIMARY KEY, which is already indexed\n",
+           column_name);
+    return NULL;
+  }
+  if (index_find(db, table, column)) {
+    printf("Error: '%s.%s' already has an index\n", table_name, column_name);
+    return NULL;
+  }
+
+  Schema *index = db_create_table(db, index_name, 0);
+  if (!index) {
+    return NULL;
+  }
+  index->is_index = true;
+  index->index_table = catalog_slot(db, table);
+  index->index_column = column;
+
+  void *root = pager_get_page(db->pager, index->root_page_num);
+  pager_mark_dirty(db->pager, index->root_page_num);
+  initialize_leaf_node(root);
+  set_node_root(root, true);
+  pager_unpin_page(db->pager, index->root_page_num);
+
+  index_build(db, table, index);
+  return index;
+}
@@ -1,9 +1,12 @@
 #define _GNU_SOURCE
+#include "../include/aggregate.h"
 #include "../include/btree.h"
 #include "../include/cursor.h"
 #include "../include/database.h"
+#include "../include/index.h"
 #include "../include/pager.h"
 #include "../include/parser.h"
+#include "../include/scan.h"
 #include "../include/table.h"
 #include <stdbool.h>
 #include <stdio.h>
@@ -13,6 +16,67 @@
 // Global database
 Database *current_db = NULL;
 
+// Set from BEGIN until COMMIT or ROLLBACK. The REPL holds the writer lock
+// all that time, so the statements in between commit together
+static bool in_transaction = false;
+
+// Set when a statement fails inside a transaction. Its changes are
+// already rolled back, and every statement is refused until COMMIT or
+// ROLLBACK ends it, so none of the rest of the batch commits on its own
+static bool transaction_aborted = false;
+
+// Worker threads for full scans, started by .parallel; NULL runs every
+// scan on the REPL thread. Unordered output skips waiting on slow ranges
+static ScanPool *scan_pool = NULL;
+static bool scan_ordered = true;
+
+// Bumped whenever tables or indexes may have changed, which makes every
+// prepared statement compile again before its next run
+static uint32_t catalog_generation = 0;
+
+// Take the writer lock for one statement, unless a transaction holds it
+static void statement_lock() {
+  if (!in_transaction) {
+    db_lock(current_db);
+  }
+}
+
+static void statement_unlock() {
+  if (!in_transaction) {
+    db_unlock(current_db);
+  }
+}
+
+// Refuse a statement while an aborted transaction is still open
+static bool transaction_refuses_statement() {
+  if (transaction_aborted) {
+    printf("Error: Transaction aborted, statements are ignored until "
+           "ROLLBACK.\n");
+  }
+  return transaction_aborted;
+}
+
+// End a statement that changed the database. On its own it commits, or
+// rolls back if it failed. In a transaction a failure rolls back the
+// whole transaction, so a failed batch leaves none of its rows behind
+static void statement_finish_write(bool succeeded) {
+  if (!in_transaction) {
+    if (succeeded) {
+      db_commit(current_db);
+    } else {
+      db_rollback(current_db);
+      catalog_generation++;
+    }
+    db_unlock(current_db);
+  } else if (!succeeded) {
+    // The writer lock stays held until COMMIT or ROLLBACK
+    db_rollback(current_db);
+    catalog_generation++;
+    transaction_aborted = true;
+    printf("Transaction rolled back.\n");
+  }
+}
+
 // Meta command types
 typedef enum {
   META_COMMAND_SUCCESS,
@@ -28,12 +92,222 @@ typedef enum {
 
 void print_prompt() { printf("db > "); }
 
+// Rows read by .load, handed to table_bulk_load in key order
+typedef struct {
+  uint32_t key;
+  uint32_t row; // Index into LoadInput.rows
+} LoadEntry;
+
+typedef struct {
+  char *rows; // row_size bytes each, in file order
+  uint32_t row_size;
+  LoadEntry *entries;
+  uint32_t count;
+  uint32_t next;
+} LoadInput;
+
+static int compare_load_entries(const void *a, const void *b) {
+  uint32_t key_a = ((const LoadEntry *)a)->key;
+  uint32_t key_b = ((const LoadEntry *)b)->key;
+  return (key_a > key_b) - (key_a < key_b);
+}
+
+static bool load_input_next(void *context, uint64_t *key, void *row) {
+  LoadInput *input = context;
+  if (input->next == input->count) {
+    return false;
+  }
+  LoadEntry *entry = &input->entries[input->next++];
+  *key = entry->key;
+  memcpy(row, input->rows + (size_t)entry->row * input->row_size,
+         input->row_size);
+  return true;
+}
+
+// Parse whitespace-separated values, as in INSERT, into a serialized row
+static bool parse_load_row(Schema *schema, char *line, char *row,
+                           int32_t *pk_value) {
+  char *save = NULL;
+  char *token = strtok_r(line, " \t\r\n", &save);
+
+  for (uint32_t i = 0; i < schema->num_columns; i++) {
+    if (!token) {
+      return false;
+    }
+    Column *col = &schema->columns[i];
+    if (col->type == COL_TYPE_INT) {
+      int32_t value = atoi(token);
+      memcpy(row + col->offset, &value, sizeof(int32_t));
+      if ((int32_t)i == schema->pk_column) {
+        *pk_value = value;
+      }
+    } else if (col->type == COL_TYPE_TEXT) {
+      strncpy(row + col->offset, token, col->size - 1);
+      row[col->offset + col->size - 1] = '\0';
+    }
+    token = strtok_r(NULL, " \t\r\n", &save);
+  }
+  return true;
+}
+
+// .load <table> <file> [fill_percent]: read every row, sort by key if the
+// file isn't already sorted, and build the table's tree bottom-up
+static void execute_load(const char *table_name, const char *filename,
+                         uint32_t fill_percent) {
+  Table *table = table_open(current_db, table_name);
+  if (!table) {
+    printf("Table '%s' not found\n", table_name);
+    return;
+  }
+  FILE *file = fopen(filename, "r");
+  if (!file) {
+    printf("Unable to open '%s'\n", filename);
+    table_close(table);
+    return;
+  }
+
+  Schema *schema = table->schema;
+  LoadInput input = {.rows = NULL, .row_size = schema->row_size};
+  uint32_t capacity = 0;
+  bool sorted = true;
+  bool valid = true;
+  char *line = NULL;
+  size_t line_capacity = 0;
+  uint32_t line_num = 0;
+
+  while (getline(&line, &line_capacity, file) != -1) {
+    line_num++;
+    if (strspn(line, " \t\r\n") == strlen(line)) {
+      continue; // Blank line
+    }
+    if (input.count == capacity) {
+      capacity = capacity ? capacity * 2 : 1024;
+      input.rows = realloc(input.rows, (size_t)capacity * schema->row_size);
+      input.entries = realloc(input.entries, sizeof(LoadEntry) * capacity);
+    }
+
+    char *row = input.rows + (size_t)input.count * schema->row_size;
+    memset(row, 0, schema->row_size);
+    int32_t pk_value = 0;
+    if (!parse_load_row(schema, line, row, &pk_value)) {
+      printf("Error: line %u: expected %u values\n", line_num,
+             schema->num_columns);
+      valid = false;
+      break;
+    }
+
+    uint32_t key;
+    if (schema->pk_column != -1) {
+      if (pk_value <= 0) {
+        printf("Error: line %u: PRIMARY KEY must be positive integer\n",
+               line_num);
+        valid = false;
+        break;
+      }
+      key = (uint32_t)pk_value;
+    } else {
+      key = schema->next_rowid + input.count;
+    }
+
+    if (input.count > 0 && key <= input.entries[input.count - 1].key) {
+      sorted = false;
+    }
+    input.entries[input.count].key = key;
+    input.entries[input.count].row = input.count;
+    input.count++;
+  }
+  free(line);
+  fclose(file);
+
+  if (valid && !sorted) {
+    qsort(input.entries, input.count, sizeof(LoadEntry), compare_load_entries);
+    for (uint32_t i = 1; i < input.count; i++) {
+      if (input.entries[i].key == input.entries[i - 1].key) {
+        printf("Error: Duplicate PRIMARY KEY value %u\n", input.entries[i].key);
+        valid = false;
+        break;
+      }
+    }
+  }
+
+  if (valid) {
+    uint32_t rows_loaded;
+    BulkLoadResult result = table_bulk_load(table, load_input_next, &input,
+                                            fill_percent, &rows_loaded);
+    if (result == BULK_LOAD_TABLE_NOT_EMPTY) {
+      printf("Error: .load needs an empty table\n");
+    } else if (result == BULK_LOAD_UNSORTED) {
+      printf("Error: .load rows out of key order, nothing loaded\n");
+    } else {
+      if (schema->pk_column == -1 && rows_loaded > 0) {
+        pager_mark_dirty(table->pager, CATALOG_PAGE_NUM);
+        schema->next_rowid += rows_loaded;
+      }
+      index_build_all(current_db, schema);
+      printf("Loaded %u rows into '%s'\n", rows_loaded, schema->name);
+    }
+  }
+
+  free(input.rows);
+  free(input.entries);
+  table_close(table);
+}
+
+// .parallel <threads> [ordered|unordered] | off, or no argument to show
+// the setting
+static void execute_parallel_command(const char *command) {
+  char threads[16] = "";
+  char order[16] = "ordered";
+  int fields = sscanf(command, ".parallel %15s %15s", threads, order);
+
+  if (fields < 1) {
+    if (scan_pool) {
+      printf("Parallel scans: %u threads, %s\n", scan_pool->num_workers,
+             scan_ordered ? "ordered" : "unordered");
+    } else {
+      printf("Parallel scans: off\n");
+    }
+    return;
+  }
+
+  uint32_t num_workers = strcmp(threads, "off") == 0 ? 0 : atoi(threads);
+  bool ordered = strcmp(order, "ordered") == 0;
+  if ((num_workers == 0 && strcmp(threads, "off") != 0 &&
+       strcmp(threads, "0") != 0) ||
+      num_workers > SCAN_MAX_WORKERS ||
+      (!ordered && strcmp(order, "unordered") != 0)) {
+    printf("Usage: .parallel <threads> [ordered|unordered] | off\n");
+    return;
+  }
+
+  // Only the REPL thread scans, so no scan is using the old pool
+  if (scan_pool) {
+    scan_pool_close(scan_pool);
+    scan_pool = NULL;
+  }
+  if (num_workers > 0) {
+    scan_pool = scan_pool_open(num_workers);
+    scan_ordered = ordered;
+    printf("Parallel scans: %u threads, %s\n", num_workers,
+           ordered ? "ordered" : "unordered");
+  } else {
+    printf("Parallel scans: off\n");
+  }
+}
+
 MetaCommandResult do_meta_command(InputBuffer *input_buffer) {
   if (strcmp(input_buffer->buffer, ".exit") == 0) {
     close_input_buffer(input_buffer);
     if (current_db) {
+      if (in_transaction) {
+        db_rollback(current_db); // Never committed, so never happened
+        db_unlock(current_db);
+      }
       db_close(current_db);
     }
+    if (scan_pool) {
+      scan_pool_close(scan_pool);
+    }
     exit(EXIT_SUCCESS);
   } else if (strcmp(input_buffer->buffer, ".help") == 0) {
     printf("Commands:\n");
@@ -43,15 +317,27 @@ MetaCommandResult do_meta_command(InputBuffer *input_buffer) {
     printf("  SELECT * FROM <table> - Display all records\n");
     printf("  SELECT <col1> <col2> FROM <table> - Display specific columns\n");
     printf("  SELECT * FROM <table> WHERE <col> <op> <val> - Filter results\n");
+    printf("  SELECT <col> COUNT(*) SUM(<col>) ... FROM <table> [WHERE ...] [GROUP BY <col>]\n");
+    printf("    Aggregates: COUNT, SUM, MIN, MAX, AVG\n");
+    printf("  CREATE INDEX <n> ON <table>(<col>) - Index an INT column\n");
+    printf("  DELETE FROM <table> [WHERE ...] - Delete rows\n");
+    printf("  UPDATE <table> SET <col> = <val> [WHERE ...] - Change rows\n");
     printf("    Operators: =, >, <, >=, <=, BETWEEN x AND y\n");
+    printf("  BEGIN / COMMIT / ROLLBACK - Group statements into one transaction\n");
     printf("  .tables - List all tables\n");
     printf("  .btree <table> - Show B+tree structure\n");
+    printf("  .load <table> <file> [fill%%] - Bulk load rows into an empty table\n");
+    printf("  .checkpoint - Write dirty pages to disk now\n");
+    printf("  .vacuum - Give free pages back by shrinking the file\n");
+    printf("  .parallel <threads> [unordered] | off - Split full scans across threads\n");
     printf("  .exit - Exit\n");
     printf("  .help - Show this help\n");
     return META_COMMAND_SUCCESS;
   } else if (strcmp(input_buffer->buffer, ".tables") == 0) {
     if (current_db) {
+      statement_lock();
       db_list_tables(current_db);
+      statement_unlock();
     } else {
       printf("No database open\n");
     }
@@ -61,6 +347,7 @@ MetaCommandResult do_meta_command(InputBuffer *input_buffer) {
     char *table_name = strchr(input_buffer->buffer, ' ');
     if (table_name) {
       table_name++; // Skip the space
+      statement_lock();
       Table *table = table_open(current_db, table_name);
       if (table) {
         printf("Tree for table '%s':\n", table->schema->name);
@@ -69,10 +356,48 @@ MetaCommandResult do_meta_command(InputBuffer *input_buffer) {
       } else {
         printf("Table '%s' not found\n", table_name);
       }
+      statement_unlock();
     } else {
       printf("Usage: .btree <table_name>\n");
     }
     return META_COMMAND_SUCCESS;
+  } else if (strncmp(input_buffer->buffer, ".load", 5) == 0) {
+    char table_name[32];
+    char filename[256];
+    uint32_t fill_percent = DEFAULT_BULK_LOAD_FILL;
+    if (sscanf(input_buffer->buffer, ".load %31s %255s %u", table_name,
+               filename, &fill_percent) < 2) {
+      printf("Usage: .load <table_name> <file> [fill_percent]\n");
+      return META_COMMAND_SUCCESS;
+    }
+    if (transaction_refuses_statement()) {
+      return META_COMMAND_SUCCESS;
+    }
+    statement_lock();
+    execute_load(table_name, filename, fill_percent);
+    statement_finish_write(true);
+    return META_COMMAND_SUCCESS;
+  } else if (strcmp(input_buffer->buffer, ".vacuum") == 0) {
+    if (in_transaction) {
+      printf("Error: Can't vacuum inside a transaction\n");
+      return META_COMMAND_SUCCESS;
+    }
+    db_lock(current_db);
+    uint32_t pages_before = current_db->pager->num_pages;
+    uint32_t pages_reclaimed = db_vacuum(current_db);
+    db_unlock(current_db);
+    printf("Vacuum complete: %u of %u pages reclaimed\n", pages_reclaimed,
+           pages_before);
+    return META_COMMAND_SUCCESS;
+  } else if (strncmp(input_buffer->buffer, ".parallel", 9) == 0) {
+    execute_parallel_command(input_buffer->buffer);
+    return META_COMMAND_SUCCESS;
+  } else if (strcmp(input_buffer->buffer, ".checkpoint") == 0) {
+    statement_lock();
+    uint32_t pages_written = db_checkpoint(current_db);
+    statement_unlock();
+    printf("Checkpoint complete: %u dirty pages written\n", pages_written);
+    return META_COMMAND_SUCCESS;
   } else {
     return META_COMMAND_UNRECOGNIZED_COMMAND;
   }
@@ -138,13 +463,19 @@ ExecuteResult execute_create_table(Statement *statement) {
         schema->in_use = false;
         return EXECUTE_TABLE_FULL;
       }
+
+      if (!schema->in_use) {
+        return EXECUTE_TABLE_FULL; // Row too wide for a leaf page
+      }
     }
   }
 
   // Initialize root node for this table
   void *root_node = pager_get_page(current_db->pager, schema->root_page_num);
+  pager_mark_dirty(current_db->pager, schema->root_page_num);
   initialize_leaf_node(root_node);
   set_node_root(root_node, true);
+  pager_unpin_page(current_db->pager, schema->root_page_num);
 
   printf("Table '%s' created successfully\n", schema->name);
   if (schema->pk_column != -1) {
@@ -165,9 +496,6 @@ ExecuteResult execute_insert(Statement *statement) {
     return EXECUTE_TABLE_NOT_FOUND;
   }
 
-  void *node = pager_get_page(table->pager, table->schema->root_page_num);
-  uint32_t num_cells = *leaf_node_num_cells(node);
-
   void *row_data = malloc(table->schema->row_size);
   serialize_row(table->schema, statement->values, row_data);
 
@@ -186,28 +514,34 @@ ExecuteResult execute_insert(Statement *statement) {
     btree_key = (uint32_t)pk_value;
   } else {
     // No PRIMARY KEY - use auto-increment ROWID
+    pager_mark_dirty(table->pager, CATALOG_PAGE_NUM);
     btree_key = table->schema->next_rowid++;
     printf("Note: No PK, assigned ROWID=%u\n", btree_key);
   }
 
   Cursor *cursor = table_find(table, btree_key);
 
+  void *leaf = pager_get_page(table->pager, cursor->page_num);
+  uint32_t num_cells = *leaf_node_num_cells(leaf);
+  pager_unpin_page(table->pager, cursor->page_num);
+
   if (cursor->cell_num < num_cells) {
-    uint32_t key_at_index = cursor_key(cursor);
+    uint64_t key_at_index = cursor_key(cursor);
     if (key_at_index == btree_key) {
-      free(row_data);
-      cursor_free(cursor);
-      table_close(table);
       if (table->schema->pk_column != -1) {
         printf("Error: Duplicate PRIMARY KEY value %u\n", btree_key);
       } else {
         printf("Error: Duplicate ROWID\n");
       }
+      free(row_data);
+      cursor_free(cursor);
+      table_close(table);
       return EXECUTE_TABLE_FULL;
     }
   }
 
   leaf_node_insert(cursor, btree_key, row_data, table->schema->row_size);
+  index_insert_row(current_db, table->schema, row_data, btree_key);
 
   free(row_data);
   cursor_free(cursor);
@@ -216,42 +550,329 @@ ExecuteResult execute_insert(Statement *statement) {
   return EXECUTE_SUCCESS;
 }
 
-ExecuteResult execute_select(Statement *statement) {
-  // Open the table
-  Table *table = table_open(current_db, statement->table_name);
-  if (!table) {
-    printf("Table '%s' not found\n", statement->table_name);
-    return EXECUTE_TABLE_NOT_FOUND;
+static void print_selected_row(FILE *out, Statement *statement,
+                               Schema *schema, const int32_t *select_indexes,
+                               const void *row_data) {
+  if (statement->select_columns == NULL) {
+    // SELECT * - print all columns
+    fprint_row(out, schema, row_data);
+    return;
   }
 
-  // Check if we can optimize with B+tree range scan
-  // Only works if WHERE clause is on the PRIMARY KEY column
-  bool can_optimize = false;
-  bool is_pk_filter = false;
-  bool reverse_scan = false; // For < and <= operators
-
-  if (statement->where_op != OP_NONE && table->schema->pk_column != -1) {
-    // Check if WHERE column is the PK
-    Column *pk_col = &table->schema->columns[table->schema->pk_column];
-    if (strcasecmp(statement->where_column, pk_col->name) == 0) {
-      is_pk_filter = true;
-      // Can optimize for all operators on PK now!
-      if (statement->where_op == OP_EQUAL ||
-          statement->where_op == OP_GREATER ||
-          statement->where_op == OP_GREATER_EQUAL ||
-          statement->where_op == OP_LESS ||
-          statement->where_op == OP_LESS_EQUAL ||
-          statement->where_op == OP_BETWEEN) {
-        can_optimize = true;
-        // < and <= need reverse scanning
-        if (statement->where_op == OP_LESS ||
-            statement->where_op == OP_LESS_EQUAL) {
-          reverse_scan = true;
-        }
+  // SELECT specific columns
+  for (uint32_t i = 0; i < statement->num_select_columns; i++) {
+    if (select_indexes[i] == -1) {
+      continue;
+    }
+    fprint_column(out, schema, row_data, select_indexes[i]);
+    if (i < statement->num_select_columns - 1) {
+      fprintf(out, ", ");
+    }
+  }
+  fprintf(out, "\n");
+}
+
+// What printing a selected row needs; a SELECT's rows go either here or
+// to an Aggregation, through a ScanEmitRow
+typedef struct {
+  Statement *statement;
+  Schema *schema;
+  const int32_t *select_indexes;
+} SelectOutput;
+
+static void emit_selected_row(void *context, FILE *out, const void *row) {
+  SelectOutput *output = context;
+  print_selected_row(out, output->statement, output->schema,
+                     output->select_indexes, row);
+}
+
+static void emit_aggregate_row(void *context, FILE *out, const void *row) {
+  (void)out;
+  aggregation_add_row(context, row);
+}
+
+// Turn a WHERE operator into the inclusive range [lo, hi] it accepts.
+// An empty range comes out as lo > hi.
+static void where_range(Statement *statement, int32_t *lo, int32_t *hi) {
+  int64_t value = statement->where_value;
+  int64_t low = INT32_MIN;
+  int64_t high = INT32_MAX;
+
+  switch (statement->where_op) {
+  case OP_EQUAL:
+    low = high = value;
+    break;
+  case OP_GREATER:
+    low = value + 1;
+    break;
+  case OP_GREATER_EQUAL:
+    low = value;
+    break;
+  case OP_LESS:
+    high = value - 1;
+    break;
+  case OP_LESS_EQUAL:
+    high = value;
+    break;
+  case OP_BETWEEN:
+    low = value;
+    high = statement->where_value2;
+    break;
+  default:
+    break;
+  }
+
+  if (low > high || low > INT32_MAX || high < INT32_MIN) {
+    *lo = 1;
+    *hi = 0;
+    return;
+  }
+  *lo = (int32_t)low;
+  *hi = (int32_t)high;
+}
+
+// Walk the index over [lo, hi], then fetch each row by its key. The
+// keys are gathered first so a reader never holds latches in two trees
+static uint32_t execute_index_scan(Statement *statement, Table *table,
+                                   Schema *index, ScanEmitRow emit,
+                                   void *context) {
+  int32_t lo, hi;
+  where_range(statement, &lo, &hi);
+  if (lo > hi) {
+    return 0;
+  }
+
+  Table tree = {.pager = table->pager, .schema = index};
+  uint64_t end_key = index_key(hi, UINT32_MAX);
+  Cursor *cursor = table_find_greater_or_equal(&tree, index_key(lo, 0));
+  uint32_t *row_keys = NULL;
+  uint32_t capacity = 0;
+  uint32_t rows_matched = 0;
+
+  while (!cursor->end_of_table) {
+    uint64_t key = cursor_key(cursor);
+    if (key > end_key) {
+      break;
+    }
+    if (rows_matched == capacity) {
+      capacity = capacity ? capacity * 2 : 64;
+      row_keys = realloc(row_keys, sizeof(uint32_t) * capacity);
+    }
+    row_keys[rows_matched++] = index_key_row(key);
+    cursor_advance(cursor);
+  }
+  cursor_free(cursor);
+
+  for (uint32_t i = 0; i < rows_matched; i++) {
+    Cursor *row_cursor = table_find(table, row_keys[i]);
+    emit(context, stdout, cursor_value(row_cursor));
+    cursor_free(row_cursor);
+  }
+
+  free(row_keys);
+  return rows_matched;
+}
+
+// Full scan filtered on an INT column: evaluate the predicate a leaf at
+// a time over a column vector and print the selected rows
+static uint32_t execute_batch_scan(Statement *statement, Table *table,
+                                   int32_t where_index, ScanEmitRow emit,
+                                   void *context) {
+  int32_t lo, hi;
+  where_range(statement, &lo, &hi);
+
+  BatchScan *scan = batch_scan_open(table, where_index, lo, hi);
+  ScanBatch *batch = malloc(sizeof(ScanBatch));
+  uint32_t rows_matched = 0;
+
+  while (batch_scan_next(scan, batch)) {
+    rows_matched += batch->matches;
+    for (uint32_t word = 0; word * 64 < batch->count; word++) {
+      uint64_t bits = batch->selection[word];
+      while (bits) {
+        uint32_t i = word * 64 + __builtin_ctzll(bits);
+        bits &= bits - 1;
+        emit(context, stdout, batch->rows[i]);
       }
     }
   }
 
+  free(batch);
+  batch_scan_close(scan);
+  return rows_matched;
+}
+
+// Full scan split by key range across the scan pool. where_index is -1
+// when every row is selected
+static uint32_t execute_parallel_scan(Statement *statement, Table *table,
+                                      int32_t where_index,
+                                      SelectOutput *output) {
+  int32_t lo, hi;
+  where_range(statement, &lo, &hi);
+  return parallel_scan(scan_pool, table, where_index, lo, hi,
+                       emit_selected_row, output, scan_ordered, stdout);
+}
+
+// How a SELECT reads its table
+typedef enum {
+  SELECT_PATH_FULL_SCAN,  // Every row, in key order
+  SELECT_PATH_PK_RANGE,   // Seek to the PRIMARY KEY range
+  SELECT_PATH_INDEX,      // Look the WHERE column up in its index
+  SELECT_PATH_BATCH_SCAN, // Vectorized filter on the WHERE column
+} SelectPath;
+
+// A SELECT compiled against the catalog: its table, the indexes of the
+// columns it names, and its access path. A prepared SELECT keeps its plan
+// between runs, so a run only pays for reading the rows
+typedef struct {
+  Table table;
+  SelectPath path;
+  Schema *index; // For SELECT_PATH_INDEX
+  bool reverse_scan; // PRIMARY KEY range for < and <=, walked backward
+  int32_t where_index; // -1 without WHERE
+  int32_t group_index; // -1 without GROUP BY
+  int32_t *select_indexes; // NULL for SELECT *
+} SelectPlan;
+
+// Fails only if the table doesn't exist
+static bool plan_select(Statement *statement, SelectPlan *plan) {
+  Schema *schema = db_get_table(current_db, statement->table_name);
+  if (!schema) {
+    return false;
+  }
+  plan->table.pager = current_db->pager;
+  plan->table.schema = schema;
+
+  plan->where_index = -1;
+  if (statement->where_op != OP_NONE) {
+    plan->where_index = schema_find_column(schema, statement->where_column);
+  }
+  plan->group_index = -1;
+  if (statement->group_column[0] != '\0') {
+    plan->group_index = schema_find_column(schema, statement->group_column);
+  }
+  plan->select_indexes = NULL;
+  if (statement->select_columns != NULL) {
+    plan->select_indexes =
+        malloc(sizeof(int32_t) * statement->num_select_columns);
+    for (uint32_t i = 0; i < statement->num_select_columns; i++) {
+      plan->select_indexes[i] =
+          schema_find_column(schema, statement->select_columns[i]);
+    }
+  }
+
+  // Every operator on the PRIMARY KEY is a key range; < and <= are
+  // walked backward from their upper end. Other INT filters use an index
+  // on the column if there is one
+  plan->path = SELECT_PATH_FULL_SCAN;
+  plan->index = NULL;
+  plan->reverse_scan = false;
+  if (plan->where_index != -1 && plan->where_index == schema->pk_column) {
+    plan->path = SELECT_PATH_PK_RANGE;
+    plan->reverse_scan = statement->where_op == OP_LESS ||
+                         statement->where_op == OP_LESS_EQUAL;
+  } else if (plan->where_index != -1 &&
+             schema->columns[plan->where_index].type == COL_TYPE_INT) {
+    plan->index = index_find(current_db, schema, plan->where_index);
+    plan->path = plan->index ? SELECT_PATH_INDEX : SELECT_PATH_BATCH_SCAN;
+  }
+  return true;
+}
+
+static void free_select_plan(SelectPlan *plan) {
+  free(plan->select_indexes);
+  plan->select_indexes = NULL;
+}
+
+// The aggregation a grouped or aggregate SELECT feeds its rows to
+static Aggregation *select_aggregation(Statement *statement,
+                                       SelectPlan *plan) {
+  AggregateSpec *specs =
+      malloc(sizeof(AggregateSpec) * statement->num_select_columns);
+  for (uint32_t i = 0; i < statement->num_select_columns; i++) {
+    specs[i].func = statement->select_aggregates
+                        ? statement->select_aggregates[i]
+                        : AGG_NONE;
+    specs[i].column = plan->select_indexes[i]; // -1 for COUNT(*)
+  }
+
+  Aggregation *aggregation =
+      aggregation_open(plan->table.schema, specs,
+                       statement->num_select_columns, plan->group_index);
+  free(specs);
+  return aggregation;
+}
+
+// Run a planned SELECT with the statement's current WHERE values
+static ExecuteResult execute_select_plan(Statement *statement,
+                                         SelectPlan *plan) {
+  Table *table = &plan->table;
+  Schema *schema = table->schema;
+  int32_t where_index = plan->where_index;
+  int32_t *select_indexes = plan->select_indexes;
+  bool can_optimize = plan->path == SELECT_PATH_PK_RANGE;
+  bool is_pk_filter = can_optimize;
+  bool reverse_scan = plan->reverse_scan;
+
+  // Selected rows are printed, or folded into aggregates. Aggregates that
+  // only need the tree's shape are answered without a scan
+  SelectOutput output = {.statement = statement,
+                         .schema = schema,
+                         .select_indexes = select_indexes};
+  ScanEmitRow emit = emit_selected_row;
+  void *context = &output;
+  Aggregation *aggregation = NULL;
+  if (statement->select_aggregates || statement->group_column[0] != '\0') {
+    aggregation = select_aggregation(statement, plan);
+    emit = emit_aggregate_row;
+    context = aggregation;
+    if (statement->where_op == OP_NONE &&
+        aggregation_from_tree(aggregation, table)) {
+      aggregation_print(aggregation, stdout);
+      aggregation_free(aggregation);
+      return EXECUTE_SUCCESS;
+    }
+  }
+
+  // Non-key INT filter: use an index on the column if there is one,
+  // otherwise a batch scan with vectorized compares
+  if (plan->path == SELECT_PATH_INDEX || plan->path == SELECT_PATH_BATCH_SCAN) {
+    Schema *index = plan->index;
+    bool parallel = !index && !aggregation && scan_pool && !in_transaction;
+    uint32_t rows_matched;
+    if (index) {
+      rows_matched = execute_index_scan(statement, table, index, emit, context);
+    } else if (parallel) {
+      rows_matched =
+          execute_parallel_scan(statement, table, where_index, &output);
+    } else {
+      rows_matched =
+          execute_batch_scan(statement, table, where_index, emit, context);
+    }
+    if (aggregation) {
+      aggregation_print(aggregation, stdout);
+      aggregation_free(aggregation);
+    }
+    printf("(%u rows matched)\n", rows_matched);
+    if (index) {
+      printf("[Optimized: index scan on %s]\n", index->name);
+    } else if (parallel) {
+      printf("[Parallel full table scan: %u threads]\n",
+             scan_pool->num_workers);
+    } else {
+      printf("[Full table scan]\n");
+    }
+    return EXECUTE_SUCCESS;
+  }
+
+  // A transaction's own changes are only visible to its thread, so
+  // workers can only help outside one
+  if (statement->where_op == OP_NONE && !aggregation && scan_pool &&
+      !in_transaction) {
+    execute_parallel_scan(statement, table, -1, &output);
+    return EXECUTE_SUCCESS;
+  }
+
   Cursor *cursor;
   uint32_t end_key = UINT32_MAX; // For BETWEEN upper bound
   uint32_t start_key = 0;        // For < and <= lower bound
@@ -260,8 +881,9 @@ ExecuteResult execute_select(Statement *statement) {
     // OPTIMIZED PATH: Use B+tree to start at the right position
     switch (statement->where_op) {
     case OP_EQUAL:
-      // For =, find exact key
-      cursor = table_find(table, statement->where_value);
+      // For =, seek to the key. A missing key past the end of its leaf
+      // lands on the next leaf's first key, not a stale cell
+      cursor = table_find_greater_or_equal(table, statement->where_value);
       end_key = statement->where_value; // Stop after this key
       break;
 
@@ -306,7 +928,7 @@ ExecuteResult execute_select(Statement *statement) {
   uint32_t rows_matched = 0;
 
   while (!cursor->end_of_table) {
-    uint32_t current_key = cursor_key(cursor);
+    uint64_t current_key = cursor_key(cursor);
 
     // For forward scans, check if we've passed the end range
     if (can_optimize && !reverse_scan && current_key > end_key) {
@@ -318,77 +940,64 @@ ExecuteResult execute_select(Statement *statement) {
       break; // Early termination for reverse scans
     }
 
-    void *row_data = cursor_value(cursor);
-    void **values = deserialize_row(table->schema, row_data);
+    // Read straight out of the leaf page; the cursor keeps it pinned
+    const void *row_data = cursor_value(cursor);
 
     // Apply WHERE clause filter
     bool row_matches = true;
-    if (statement->where_op != OP_NONE) {
-      // Find the WHERE column value
-      int32_t col_value = 0;
-      bool col_found = false;
-
-      for (uint32_t i = 0; i < table->schema->num_columns; i++) {
-        Column *col = &table->schema->columns[i];
-        if (strcasecmp(statement->where_column, col->name) == 0) {
-          col_value = *(int32_t *)values[i];
-          col_found = true;
+    if (where_index != -1) {
+      int32_t col_value = row_int(schema, row_data, where_index);
+
+      if (is_pk_filter) {
+        // For PK filters, we've already optimized the scan
+        // Just need to handle the operator correctly
+        switch (statement->where_op) {
+        case OP_EQUAL:
+          row_matches = (current_key == (uint32_t)statement->where_value);
+          break;
+        case OP_GREATER:
+          row_matches = (current_key > (uint32_t)statement->where_value);
+          break;
+        case OP_LESS:
+          row_matches = (current_key < (uint32_t)statement->where_value);
+          break;
+        case OP_GREATER_EQUAL:
+          row_matches = (current_key >= (uint32_t)statement->where_value);
           break;
+        case OP_LESS_EQUAL:
+          row_matches = (current_key <= (uint32_t)statement->where_value);
+          break;
+        case OP_BETWEEN:
+          row_matches = (current_key >= (uint32_t)statement->where_value &&
+                         current_key <= (uint32_t)statement->where_value2);
+          break;
+        default:
+          row_matches = true;
         }
-      }
-
-      if (col_found) {
-        if (is_pk_filter) {
-          // For PK filters, we've already optimized the scan
-          // Just need to handle the operator correctly
-          switch (statement->where_op) {
-          case OP_EQUAL:
-            row_matches = (current_key == (uint32_t)statement->where_value);
-            break;
-          case OP_GREATER:
-            row_matches = (current_key > (uint32_t)statement->where_value);
-            break;
-          case OP_LESS:
-            row_matches = (current_key < (uint32_t)statement->where_value);
-            break;
-          case OP_GREATER_EQUAL:
-            row_matches = (current_key >= (uint32_t)statement->where_value);
-            break;
-          case OP_LESS_EQUAL:
-            row_matches = (current_key <= (uint32_t)statement->where_value);
-            break;
-          case OP_BETWEEN:
-            row_matches = (current_key >= (uint32_t)statement->where_value &&
-                           current_key <= (uint32_t)statement->where_value2);
-            break;
-          default:
-            row_matches = true;
-          }
-        } else {
-          // Non-PK filter: full table scan with filtering
-          switch (statement->where_op) {
-          case OP_EQUAL:
-            row_matches = (col_value == statement->where_value);
-            break;
-          case OP_GREATER:
-            row_matches = (col_value > statement->where_value);
-            break;
-          case OP_LESS:
-            row_matches = (col_value < statement->where_value);
-            break;
-          case OP_GREATER_EQUAL:
-            row_matches = (col_value >= statement->where_value);
-            break;
-          case OP_LESS_EQUAL:
-            row_matches = (col_value <= statement->where_value);
-            break;
-          case OP_BETWEEN:
-            row_matches = (col_value >= statement->where_value &&
-                           col_value <= statement->where_value2);
-            break;
-          default:
-            row_matches = true;
-          }
+      } else {
+        // Non-PK filter: full table scan with filtering
+        switch (statement->where_op) {
+        case OP_EQUAL:
+          row_matches = (col_value == statement->where_value);
+          break;
+        case OP_GREATER:
+          row_matches = (col_value > statement->where_value);
+          break;
+        case OP_LESS:
+          row_matches = (col_value < statement->where_value);
+          break;
+        case OP_GREATER_EQUAL:
+          row_matches = (col_value >= statement->where_value);
+          break;
+        case OP_LESS_EQUAL:
+          row_matches = (col_value <= statement->where_value);
+          break;
+        case OP_BETWEEN:
+          row_matches = (col_value >= statement->where_value &&
+                         col_value <= statement->where_value2);
+          break;
+        default:
+          row_matches = true;
         }
       }
     }
@@ -396,41 +1005,9 @@ ExecuteResult execute_select(Statement *statement) {
     // Print row if it matches WHERE condition
     if (row_matches) {
       rows_matched++;
-
-
-      if (statement->select_columns == NULL) {
-        // SELECT * - print all columns
-        print_row(table->schema, values);
-      } else {
-        // SELECT specific columns
-        for (uint32_t i = 0; i < statement->num_select_columns; i++) {
-          // Find the column in schema
-          for (uint32_t j = 0; j < table->schema->num_columns; j++) {
-            Column *col = &table->schema->columns[j];
-            if (strcasecmp(statement->select_columns[i], col->name) == 0) {
-              // Print this column
-              printf("%s: ", col->name);
-              if (col->type == COL_TYPE_INT) {
-                printf("%d", *(int32_t *)values[j]);
-              } else if (col->type == COL_TYPE_TEXT) {
-                printf("%s", (char *)values[j]);
-              }
-              if (i < statement->num_select_columns - 1) {
-                printf(", ");
-              }
-              break;
-            }
-          }
-        }
-        printf("\n");
-      }
+      emit(context, stdout, row_data);
     }
 
-    for (uint32_t i = 0; i < table->schema->num_columns; i++) {
-      free(values[i]);
-    }
-    free(values);
-
     // Move cursor in appropriate direction
     if (reverse_scan) {
       if (!cursor_retreat(cursor)) {
@@ -441,6 +1018,10 @@ ExecuteResult execute_select(Statement *statement) {
     }
   }
 
+  if (aggregation) {
+    aggregation_print(aggregation, stdout);
+    aggregation_free(aggregation);
+  }
   if (statement->where_op != OP_NONE) {
     printf("(%u rows matched)\n", rows_matched);
     if (can_optimize) {
@@ -455,23 +1036,441 @@ ExecuteResult execute_select(Statement *statement) {
   }
 
   cursor_free(cursor);
+  return EXECUTE_SUCCESS;
+}
+
+ExecuteResult execute_select(Statement *statement) {
+  SelectPlan plan;
+  if (!plan_select(statement, &plan)) {
+    printf("Table '%s' not found\n", statement->table_name);
+    return EXECUTE_TABLE_NOT_FOUND;
+  }
+  ExecuteResult result = execute_select_plan(statement, &plan);
+  free_select_plan(&plan);
+  return result;
+}
+
+// Keys of the rows a DELETE or UPDATE applies to, gathered before any of
+// them change. Seeks on the PRIMARY KEY or an index when the WHERE allows.
+static uint64_t *collect_where_keys(Statement *statement, Table *table,
+                                    uint32_t *count) {
+  Schema *schema = table->schema;
+  int32_t where_index = -1;
+  int32_t lo = INT32_MIN;
+  int32_t hi = INT32_MAX;
+  if (statement->where_op != OP_NONE) {
+    where_index = schema_find_column(schema, statement->where_column);
+    where_range(statement, &lo, &hi);
+  }
+
+  uint64_t *keys = NULL;
+  uint32_t capacity = 0;
+  *count = 0;
+  if (lo > hi) {
+    return NULL;
+  }
+
+  Schema *index = NULL;
+  if (where_index != -1 && where_index != schema->pk_column) {
+    index = index_find(current_db, schema, where_index);
+  }
+
+  Table tree = {.pager = table->pager, .schema = index};
+  Cursor *cursor;
+  uint64_t end_key;
+  if (where_index != -1 && where_index == schema->pk_column) {
+    // PRIMARY KEY values are positive, so the range starts at 1 at most
+    cursor = table_find_greater_or_equal(table, lo < 1 ? 1 : lo);
+    end_key = hi < 1 ? 0 : (uint64_t)hi;
+  } else if (index) {
+    cursor = table_find_greater_or_equal(&tree, index_key(lo, 0));
+    end_key = index_key(hi, UINT32_MAX);
+  } else {
+    cursor = table_start(table);
+    end_key = UINT64_MAX;
+  }
+
+  while (!cursor->end_of_table) {
+    uint64_t key = cursor_key(cursor);
+    if (key > end_key) {
+      break;
+    }
+
+    bool matches = true;
+    if (where_index != -1 && !index) {
+      int32_t value = row_int(schema, cursor_value(cursor), where_index);
+      matches = value >= lo && value <= hi;
+    }
+    if (matches) {
+      if (*count == capacity) {
+        capacity = capacity ? capacity * 2 : 64;
+        keys = realloc(keys, sizeof(uint64_t) * capacity);
+      }
+      keys[(*count)++] = index ? index_key_row(key) : key;
+    }
+    cursor_advance(cursor);
+  }
+
+  cursor_free(cursor);
+  return keys;
+}
+
+ExecuteResult execute_delete(Statement *statement) {
+  Table *table = table_open(current_db, statement->table_name);
+  if (!table) {
+    printf("Table '%s' not found\n", statement->table_name);
+    return EXECUTE_TABLE_NOT_FOUND;
+  }
+
+  Schema *schema = table->schema;
+  uint32_t count;
+  uint64_t *keys = collect_where_keys(statement, table, &count);
+  void *row = malloc(schema->row_size);
+
+  for (uint32_t i = 0; i < count; i++) {
+    Cursor *cursor = table_find(table, keys[i]);
+    memcpy(row, cursor_value(cursor), schema->row_size);
+    leaf_node_delete(cursor);
+    cursor_free(cursor);
+    index_delete_row(current_db, schema, row, keys[i]);
+  }
+
+  printf("(%u rows deleted)\n", count);
+  free(row);
+  free(keys);
   table_close(table);
   return EXECUTE_SUCCESS;
 }
 
+ExecuteResult execute_update(Statement *statement) {
+  Table *table = table_open(current_db, statement->table_name);
+  if (!table) {
+    printf("Table '%s' not found\n", statement->table_name);
+    return EXECUTE_TABLE_NOT_FOUND;
+  }
+
+  Schema *schema = table->schema;
+  int32_t set_index = schema_find_column(schema, statement->set_column);
+  Column *col = &schema->columns[set_index];
+  bool sets_key = (set_index == schema->pk_column);
+
+  // The new column value, serialized
+  char value[col->size];
+  memset(value, 0, col->size);
+  int32_t int_value = 0;
+  if (col->type == COL_TYPE_INT) {
+    int_value = atoi(statement->set_value);
+    memcpy(value, &int_value, sizeof(int32_t));
+  } else {
+    strncpy(value, statement->set_value, col->size - 1);
+  }
+
+  uint32_t count;
+  uint64_t *keys = collect_where_keys(statement, table, &count);
+
+  // A new PRIMARY KEY must be valid and stay unique
+  if (sets_key && count > 0) {
+    ExecuteResult error = EXECUTE_SUCCESS;
+    if (int_value <= 0) {
+      printf("Error: PRIMARY KEY must be positive integer\n");
+      error = EXECUTE_TABLE_FULL;
+    } else if (count > 1) {
+      printf("Error: UPDATE would give %u rows the same PRIMARY KEY\n", count);
+      error = EXECUTE_TABLE_FULL;
+    } else if (keys[0] != (uint32_t)int_value) {
+      Cursor *cursor = table_find(table, (uint32_t)int_value);
+      void *leaf = pager_get_page(table->pager, cursor->page_num);
+      if (cursor->cell_num < *leaf_node_num_cells(leaf) &&
+          *leaf_node_key(leaf, cursor->cell_num) == (uint32_t)int_value) {
+        printf("Error: Duplicate PRIMARY KEY value %d\n", int_value);
+        error = EXECUTE_TABLE_FULL;
+      }
+      pager_unpin_page(table->pager, cursor->page_num);
+      cursor_free(cursor);
+    }
+    if (error != EXECUTE_SUCCESS) {
+      free(keys);
+      table_close(table);
+      return error;
+    }
+  }
+
+  void *old_row = malloc(schema->row_size);
+  void *new_row = malloc(schema->row_size);
+
+  for (uint32_t i = 0; i < count; i++) {
+    uint32_t old_key = keys[i];
+    uint32_t new_key = sets_key ? (uint32_t)int_value : old_key;
+
+    Cursor *cursor = table_find(table, old_key);
+    memcpy(old_row, cursor_value(cursor), schema->row_size);
+    memcpy(new_row, old_row, schema->row_size);
+    memcpy((char *)new_row + col->offset, value, col->size);
+
+    if (new_key == old_key) {
+      // Same key: rewrite the row where it is
+      pager_mark_dirty(table->pager, cursor->page_num);
+      memcpy(cursor_value(cursor), new_row, schema->row_size);
+      cursor_free(cursor);
+    } else {
+      // The row moves to its new key
+      leaf_node_delete(cursor);
+      cursor_free(cursor);
+      cursor = table_find(table, new_key);
+      leaf_node_insert(cursor, new_key, new_row, schema->row_size);
+      cursor_free(cursor);
+    }
+
+    index_update_row(current_db, schema, old_row, old_key, new_row, new_key);
+  }
+
+  printf("(%u rows updated)\n", count);
+  free(old_row);
+  free(new_row);
+  free(keys);
+  table_close(table);
+  return EXECUTE_SUCCESS;
+}
+
+ExecuteResult execute_create_index(Statement *statement) {
+  Schema *index = index_create(current_db, statement->index_name,
+                               statement->table_name, statement->index_column);
+  if (!index) {
+    return EXECUTE_TABLE_FULL;
+  }
+  printf("Index '%s' created on %s(%s)\n", index->name, statement->table_name,
+         statement->index_column);
+  catalog_generation++;
+  return EXECUTE_SUCCESS;
+}
+
+// BEGIN takes the writer lock and keeps it until COMMIT or ROLLBACK
+static void execute_transaction(Statement *statement) {
+  if (statement->type == STATEMENT_BEGIN) {
+    if (in_transaction) {
+      printf("Error: A transaction is already open.\n");
+      return;
+    }
+    db_lock(current_db);
+    in_transaction = true;
+  } else {
+    if (!in_transaction) {
+      printf("Error: No transaction is open.\n");
+      return;
+    }
+    // Committing an aborted transaction ends it the way ROLLBACK would;
+    // its changes are gone already
+    bool aborted = transaction_aborted;
+    if (statement->type == STATEMENT_COMMIT && !aborted) {
+      db_commit(current_db);
+    } else if (!aborted) {
+      db_rollback(current_db);
+      catalog_generation++;
+    }
+    db_unlock(current_db);
+    in_transaction = false;
+    transaction_aborted = false;
+    if (aborted && statement->type == STATEMENT_COMMIT) {
+      printf("Transaction rolled back.\n");
+      return;
+    }
+  }
+  printf("Executed.\n");
+}
+
 ExecuteResult execute_statement(Statement *statement) {
   switch (statement->type) {
   case STATEMENT_CREATE_TABLE:
     return execute_create_table(statement);
+  case STATEMENT_CREATE_INDEX:
+    return execute_create_index(statement);
   case STATEMENT_INSERT:
     return execute_insert(statement);
   case STATEMENT_SELECT:
     return execute_select(statement);
+  case STATEMENT_DELETE:
+    return execute_delete(statement);
+  case STATEMENT_UPDATE:
+    return execute_update(statement);
   default:
     return EXECUTE_SUCCESS;
   }
 }
 
+// Run a statement on its own or as part of the open transaction, and
+// report the result. plan is a prepared SELECT's, NULL to plan it here
+static void run_statement(Statement *statement, SelectPlan *plan) {
+  // A SELECT runs as a reader on a snapshot of the last commit, unless
+  // it's part of a transaction, which sees its own changes. Anything
+  // else holds the writer lock for the whole statement so the
+  // checkpointer never sees a half-applied change
+  bool writes = statement->type != STATEMENT_SELECT;
+  if (writes) {
+    statement_lock();
+  } else if (!in_transaction) {
+    db_begin_snapshot(current_db);
+  }
+
+  ExecuteResult result = plan ? execute_select_plan(statement, plan)
+                              : execute_statement(statement);
+  switch (result) {
+  case EXECUTE_SUCCESS:
+    break;
+  case EXECUTE_TABLE_FULL:
+    printf("Error: Duplicate key or table full.\n");
+    break;
+  case EXECUTE_TABLE_NOT_FOUND:
+    printf("Error: Table not found.\n");
+    break;
+  }
+
+  if (writes) {
+    statement_finish_write(result == EXECUTE_SUCCESS);
+  } else if (!in_transaction) {
+    db_end_snapshot(current_db);
+  }
+  // Only once the commit is durable
+  if (result == EXECUTE_SUCCESS) {
+    printf("Executed.\n");
+  }
+}
+
+// A statement compiled by PREPARE. EXECUTE binds values to its
+// placeholders and runs it without parsing it again
+typedef struct {
+  char name[32];
+  char *text;          // Source, to compile again if the catalog changes
+  Statement statement; // Placeholders hold the last bound values
+  Schema *schema;
+  SelectPlan plan;     // For a SELECT
+  uint32_t generation; // catalog_generation it was compiled against
+  bool compiled;
+} PreparedStatement;
+
+#define MAX_PREPARED_STATEMENTS 32
+
+static PreparedStatement *prepared_statements[MAX_PREPARED_STATEMENTS];
+static uint32_t num_prepared_statements = 0;
+
+static void release_prepared(PreparedStatement *prepared) {
+  if (!prepared->compiled) {
+    return;
+  }
+  if (prepared->statement.type == STATEMENT_SELECT) {
+    free_select_plan(&prepared->plan);
+  }
+  free_statement(&prepared->statement, current_db);
+  prepared->compiled = false;
+}
+
+// Parse the statement and, for a SELECT, plan it
+static bool compile_prepared(PreparedStatement *prepared) {
+  release_prepared(prepared);
+
+  InputBuffer source = {.buffer = strdup(prepared->text)};
+  source.input_length = strlen(source.buffer);
+  Statement *statement = &prepared->statement;
+  PrepareResult result = prepare_statement(&source, statement, current_db);
+  free(source.buffer);
+  if (result != PREPARE_SUCCESS) {
+    if (result == PREPARE_UNRECOGNIZED_STATEMENT) {
+      printf("Unrecognized keyword at start of '%s'.\n", prepared->text);
+    } else if (result == PREPARE_SYNTAX_ERROR) {
+      printf("Syntax error.\n");
+    }
+    return false;
+  }
+
+  if (statement->type != STATEMENT_INSERT &&
+      statement->type != STATEMENT_SELECT &&
+      statement->type != STATEMENT_UPDATE &&
+      statement->type != STATEMENT_DELETE) {
+    printf("Error: Only INSERT, SELECT, UPDATE and DELETE can be "
+           "prepared.\n");
+    free_statement(statement, current_db);
+    return false;
+  }
+
+  prepared->schema = db_get_table(current_db, statement->table_name);
+  if (statement->type == STATEMENT_SELECT) {
+    plan_select(statement, &prepared->plan);
+  }
+  prepared->generation = catalog_generation;
+  prepared->compiled = true;
+  return true;
+}
+
+static int32_t find_prepared(const char *name) {
+  for (uint32_t i = 0; i < num_prepared_statements; i++) {
+    if (strcasecmp(prepared_statements[i]->name, name) == 0) {
+      return (int32_t)i;
+    }
+  }
+  return -1;
+}
+
+static void deallocate_prepared(uint32_t slot) {
+  PreparedStatement *prepared = prepared_statements[slot];
+  release_prepared(prepared);
+  free(prepared->text);
+  free(prepared);
+  prepared_statements[slot] =
+      prepared_statements[--num_prepared_statements];
+}
+
+// PREPARE replaces any statement already under the name
+static void execute_prepare(Statement *statement) {
+  PreparedStatement *prepared = calloc(1, sizeof(PreparedStatement));
+  strcpy(prepared->name, statement->prepared_name);
+  prepared->text = strdup(statement->prepared_text);
+  if (!compile_prepared(prepared)) {
+    free(prepared->text);
+    free(prepared);
+    return;
+  }
+
+  int32_t slot = find_prepared(prepared->name);
+  if (slot != -1) {
+    deallocate_prepared((uint32_t)slot);
+  } else if (num_prepared_statements == MAX_PREPARED_STATEMENTS) {
+    printf("Error: At most %d prepared statements.\n",
+           MAX_PREPARED_STATEMENTS);
+    release_prepared(prepared);
+    free(prepared->text);
+    free(prepared);
+    return;
+  }
+  prepared_statements[num_prepared_statements++] = prepared;
+  printf("Prepared '%s' (%u parameters).\n", prepared->name,
+         prepared->statement.num_params);
+}
+
+static void execute_prepared(Statement *statement) {
+  int32_t slot = find_prepared(statement->prepared_name);
+  if (slot == -1) {
+    printf("Error: No prepared statement '%s'.\n",
+           statement->prepared_name);
+    return;
+  }
+
+  PreparedStatement *prepared = prepared_statements[slot];
+  if (prepared->generation != catalog_generation &&
+      !compile_prepared(prepared)) {
+    return; // Stays uncompiled; tried again on the next run
+  }
+  if (!prepared->schema) {
+    printf("Error: Table not found.\n");
+    return;
+  }
+  if (bind_params(&prepared->statement, prepared->schema,
+                  statement->prepared_text) != PREPARE_SUCCESS) {
+    return;
+  }
+
+  bool is_select = prepared->statement.type == STATEMENT_SELECT;
+  run_statement(&prepared->statement, is_select ? &prepared->plan : NULL);
+}
+
 int main(int argc, char *argv[]) {
   if (argc < 2) {
     printf("Must supply a database filename.\n");
@@ -479,7 +1478,33 @@ int main(int argc, char *argv[]) {
   }
 
   char *filename = argv[1];
-  current_db = db_open(filename);
+
+  DbOptions options = {.pool_frames = DEFAULT_POOL_FRAMES,
+                       .checkpoint_interval_ms = DEFAULT_CHECKPOINT_INTERVAL_MS,
+                       .use_mmap = false,
+                       .wal_sync = WAL_SYNC_FULL,
+                       .group_commit_size = DEFAULT_GROUP_COMMIT_SIZE,
+                       .group_commit_ms = DEFAULT_GROUP_COMMIT_MS};
+  for (int i = 2; i < argc; i++) {
+    if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+      options.pool_frames = (uint32_t)atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--checkpoint-interval") == 0 && i + 1 < argc) {
+      options.checkpoint_interval_ms = (uint32_t)atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--mmap") == 0) {
+      options.use_mmap = true;
+    } else if (strcmp(argv[i], "--sync") == 0 && i + 1 < argc) {
+      i++;
+      if (strcmp(argv[i], "group") == 0) {
+        options.wal_sync = WAL_SYNC_GROUP;
+      } else if (strcmp(argv[i], "off") == 0) {
+        options.wal_sync = WAL_SYNC_OFF;
+      } else {
+        options.wal_sync = WAL_SYNC_FULL;
+      }
+    }
+  }
+
+  current_db = db_open(filename, &options);
 
   InputBuffer *input_buffer = new_input_buffer();
 
@@ -521,18 +1546,47 @@ int main(int argc, char *argv[]) {
       continue;
     }
 
-    switch (execute_statement(&statement)) {
-    case EXECUTE_SUCCESS:
-      printf("Executed.\n");
-      break;
-    case EXECUTE_TABLE_FULL:
-      printf("Error: Duplicate key or table full.\n");
-      break;
-    case EXECUTE_TABLE_NOT_FOUND:
-      printf("Error: Table not found.\n");
+    if (statement.type == STATEMENT_BEGIN ||
+        statement.type == STATEMENT_COMMIT ||
+        statement.type == STATEMENT_ROLLBACK) {
+      execute_transaction(&statement);
+      continue;
+    }
+    if (transaction_refuses_statement()) {
+      free_statement(&statement, current_db);
+      continue;
+    }
+
+    switch (statement.type) {
+    case STATEMENT_PREPARE:
+      execute_prepare(&statement);
+      continue;
+    case STATEMENT_EXECUTE:
+      execute_prepared(&statement);
+      continue;
+    case STATEMENT_DEALLOCATE: {
+      int32_t slot = find_prepared(statement.prepared_name);
+      if (slot == -1) {
+        printf("Error: No prepared statement '%s'.\n",
+               statement.prepared_name);
+      } else {
+        deallocate_prepared((uint32_t)slot);
+        printf("Executed.\n");
+      }
+      continue;
+    }
+    default:
       break;
     }
 
+    if (statement.num_params > 0) {
+      printf("Error: ? placeholders only work in PREPARE.\n");
+      free_statement(&statement, current_db);
+      continue;
+    }
+
+    run_statement(&statement, NULL);
+
     // Cleanup statement
     free_statement(&statement, current_db);
   }
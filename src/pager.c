@@ -1,11 +1,460 @@
 #include "../include/pager.h"
 #include <errno.h>
+#include <stddef.h>
 #include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
-Pager *pager_open(const char *filename) {
+static uint32_t page_table_bucket(Pager *pager, uint32_t page_num) {
+  // Fibonacci hashing spreads sequential page numbers across buckets
+  return (page_num * 2654435769u) & (pager->page_table_size - 1);
+}
+
+static uint32_t page_table_lookup(Pager *pager, uint32_t page_num) {
+  uint32_t frame = pager->page_table[page_table_bucket(pager, page_num)];
+  while (frame != INVALID_FRAME) {
+    if (pager->frames[frame].page_num == page_num) {
+      return frame;
+    }
+    frame = pager->frames[frame].hash_next;
+  }
+  return INVALID_FRAME;
+}
+
+static void page_table_insert(Pager *pager, uint32_t frame) {
+  uint32_t bucket = page_table_bucket(pager, pager->frames[frame].page_num);
+  pager->frames[frame].hash_next = pager->page_table[bucket];
+  pager->page_table[bucket] = frame;
+}
+
+static void page_table_remove(Pager *pager, uint32_t frame) {
+  uint32_t *link =
+      &pager->page_table[page_table_bucket(pager, pager->frames[frame].page_num)];
+  while (*link != INVALID_FRAME) {
+    if (*link == frame) {
+      *link = pager->frames[frame].hash_next;
+      return;
+    }
+    link = &pager->frames[*link].hash_next;
+  }
+}
+
+static void pager_write_data(Pager *pager, uint32_t page_num,
+                             const void *data) {
+  off_t offset = (off_t)page_num * PAGE_SIZE;
+  ssize_t bytes_written = pwrite(pager->file_descriptor, data, PAGE_SIZE, offset);
+
+  if (bytes_written == -1) {
+    printf("Error writing: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+
+  if (offset + PAGE_SIZE > pager->file_length) {
+    pager->file_length = offset + PAGE_SIZE;
+  }
+}
+
+static void pager_write_frame(Pager *pager, Frame *frame) {
+  // Write-ahead rule: the log must be durable before the page
+  wal_flush_to(pager->wal, frame->page_lsn);
+
+  pager_write_data(pager, frame->page_num, frame->data);
+  frame->dirty = false;
+}
+
+// Writers queue ahead of new readers, so a steady stream of scans can't
+// keep the writer off a hot page such as the root
+static void latch_init(pthread_rwlock_t *latch) {
+  pthread_rwlockattr_t attr;
+  pthread_rwlockattr_init(&attr);
+  pthread_rwlockattr_setkind_np(&attr,
+                                PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+  pthread_rwlock_init(latch, &attr);
+  pthread_rwlockattr_destroy(&attr);
+}
+
+// Add `count` empty frames backed by a fresh chunk of page memory, with
+// the frames' latches after the pages. Existing frames keep their data
+// and latch pointers, so pinned pages stay put.
+static void pager_add_frames(Pager *pager, uint32_t count) {
+  uint32_t first = pager->num_frames;
+  pager->num_frames += count;
+  pager->frames = realloc(pager->frames, sizeof(Frame) * pager->num_frames);
+  pager->frame_chunks = realloc(pager->frame_chunks,
+                                sizeof(void *) * (pager->num_frame_chunks + 1));
+  char *chunk =
+      malloc((size_t)count * (PAGE_SIZE + sizeof(pthread_rwlock_t)));
+
+  if (!pager->frames || !pager->frame_chunks || !chunk) {
+    printf("Unable to allocate buffer pool\n");
+    exit(EXIT_FAILURE);
+  }
+  pager->frame_chunks[pager->num_frame_chunks++] = chunk;
+
+  memset(&pager->frames[first], 0, sizeof(Frame) * count);
+  pthread_rwlock_t *latches =
+      (pthread_rwlock_t *)(chunk + (size_t)count * PAGE_SIZE);
+  for (uint32_t i = 0; i < count; i++) {
+    pager->frames[first + i].data = chunk + (size_t)i * PAGE_SIZE;
+    pager->frames[first + i].latch = &latches[i];
+    pager->frames[first + i].hash_next = INVALID_FRAME;
+    latch_init(&latches[i]);
+  }
+
+  // Rebuild the page table so chains stay short
+  uint32_t page_table_size = pager->page_table_size ? pager->page_table_size : 1;
+  while (page_table_size < 2 * pager->num_frames) {
+    page_table_size <<= 1;
+  }
+  if (page_table_size != pager->page_table_size) {
+    free(pager->page_table);
+    pager->page_table_size = page_table_size;
+    pager->page_table = malloc(sizeof(uint32_t) * page_table_size);
+    if (!pager->page_table) {
+      printf("Unable to allocate buffer pool\n");
+      exit(EXIT_FAILURE);
+    }
+    for (uint32_t i = 0; i < page_table_size; i++) {
+      pager->page_table[i] = INVALID_FRAME;
+    }
+    for (uint32_t i = 0; i < first; i++) {
+      if (pager->frames[i].in_use) {
+        page_table_insert(pager, i);
+      }
+    }
+  }
+}
+
+// CLOCK: sweep the frames, giving referenced pages a second chance.
+// Dirty victims are written back before the frame is reused.
+static uint32_t pager_evict(Pager *pager) {
+  bool txn_held = false;
+
+  for (uint32_t scanned = 0; scanned < 2 * pager->num_frames; scanned++) {
+    uint32_t index = pager->clock_hand;
+    Frame *frame = &pager->frames[index];
+    pager->clock_hand = (pager->clock_hand + 1) % pager->num_frames;
+
+    if (!frame->in_use) {
+      return index;
+    }
+    if (frame->pin_count > 0 || frame->txn_dirty) {
+      txn_held |= frame->txn_dirty;
+      continue;
+    }
+    if (frame->referenced) {
+      frame->referenced = false;
+      continue;
+    }
+
+    if (frame->dirty) {
+      pager_write_frame(pager, frame);
+    }
+    page_table_remove(pager, index);
+    frame->in_use = false;
+    return index;
+  }
+
+  // No-steal: uncommitted pages can't be written out, so make room
+  if (txn_held) {
+    uint32_t index = pager->num_frames;
+    pager_add_frames(pager, pager->num_frames);
+    return index;
+  }
+
+  printf("Buffer pool exhausted: all %u frames are pinned\n",
+         pager->num_frames);
+  exit(EXIT_FAILURE);
+}
+
+// The whole address range is reserved up front, so growing the file never
+// moves the mapping and page pointers held by cursors stay valid.
+// MAP_PRIVATE keeps our writes out of the file until a checkpoint
+// writes them back explicitly.
+static void pager_map_file(Pager *pager) {
+  void *map = mmap(NULL, MMAP_MAX_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                   pager->file_descriptor, 0);
+  if (map == MAP_FAILED) {
+    printf("Error mapping db file: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  pager->map = map;
+  pager->page_dirty_capacity = 0;
+  pager->page_dirty = NULL;
+  pager->map_latches = calloc(MAP_LATCH_CHUNKS, sizeof(pthread_rwlock_t *));
+}
+
+static void *pager_map_get_page(Pager *pager, uint32_t page_num) {
+  if ((uint64_t)(page_num + 1) * PAGE_SIZE > MMAP_MAX_SIZE) {
+    printf("Tried to fetch page number out of bounds. %d\n", page_num);
+    exit(EXIT_FAILURE);
+  }
+
+  // Touching a mapped page past end of file raises SIGBUS, so extend
+  // the file first. New pages read back as zeros.
+  if ((uint64_t)(page_num + 1) * PAGE_SIZE > pager->file_length) {
+    if (ftruncate(pager->file_descriptor, (off_t)(page_num + 1) * PAGE_SIZE) ==
+        -1) {
+      printf("Error extending db file: %d\n", errno);
+      exit(EXIT_FAILURE);
+    }
+    pager->file_length = (page_num + 1) * PAGE_SIZE;
+  }
+
+  if (page_num >= pager->num_pages) {
+    pager->num_pages = page_num + 1;
+  }
+
+  return pager->map + (size_t)page_num * PAGE_SIZE;
+}
+
+static void pager_map_mark_dirty(Pager *pager, uint32_t page_num) {
+  if (page_num >= pager->page_dirty_capacity) {
+    uint32_t capacity = pager->page_dirty_capacity ? pager->page_dirty_capacity : 64;
+    while (capacity <= page_num) {
+      capacity *= 2;
+    }
+    pager->page_dirty = realloc(pager->page_dirty, sizeof(bool) * capacity);
+    memset(pager->page_dirty + pager->page_dirty_capacity, 0,
+           sizeof(bool) * (capacity - pager->page_dirty_capacity));
+    pager->page_dirty_capacity = capacity;
+  }
+  pager->page_dirty[page_num] = true;
+}
+
+// The latch guarding a page, which the caller has pinned. Caller holds
+// pager->lock
+static pthread_rwlock_t *pager_latch(Pager *pager, uint32_t page_num) {
+  if (!pager->map) {
+    return pager->frames[page_table_lookup(pager, page_num)].latch;
+  }
+
+  pthread_rwlock_t **chunk = &pager->map_latches[page_num / MAP_LATCH_CHUNK_PAGES];
+  if (!*chunk) {
+    *chunk = malloc(sizeof(pthread_rwlock_t) * MAP_LATCH_CHUNK_PAGES);
+    if (!*chunk) {
+      printf("Unable to allocate page latches\n");
+      exit(EXIT_FAILURE);
+    }
+    for (uint32_t i = 0; i < MAP_LATCH_CHUNK_PAGES; i++) {
+      latch_init(&(*chunk)[i]);
+    }
+  }
+  return &(*chunk)[page_num % MAP_LATCH_CHUNK_PAGES];
+}
+
+static void pager_map_write_page(Pager *pager, uint32_t page_num) {
+  char *page = pager->map + (size_t)page_num * PAGE_SIZE;
+  if (pwrite(pager->file_descriptor, page, PAGE_SIZE,
+             (off_t)page_num * PAGE_SIZE) == -1) {
+    printf("Error writing: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  // Drop our private copy; the next access maps the page cache page,
+  // which now holds the same bytes
+  madvise(page, PAGE_SIZE, MADV_DONTNEED);
+  pager->page_dirty[page_num] = false;
+}
+
+// Contents of a page before the open transaction touched it, or NULL
+static void *pager_txn_before(Pager *pager, uint32_t page_num) {
+  for (uint32_t i = pager->num_txn_pages; i > 0; i--) {
+    if (pager->txn_pages[i - 1].page_num == page_num) {
+      return pager->txn_pages[i - 1].before->data;
+    }
+  }
+  return NULL;
+}
+
+static uint32_t version_bucket(Pager *pager, uint32_t page_num) {
+  return (page_num * 2654435769u) & (pager->versions_size - 1);
+}
+
+// Versions pile up behind a long snapshot; keep the buckets short
+static void pager_grow_versions(Pager *pager) {
+  uint32_t old_size = pager->versions_size;
+  PageVersion **old = pager->versions;
+  pager->versions_size = old_size * 2;
+  pager->versions = calloc(pager->versions_size, sizeof(PageVersion *));
+
+  for (uint32_t i = 0; i < old_size; i++) {
+    PageVersion *version = old[i];
+    while (version) {
+      PageVersion *next = version->next;
+      uint32_t bucket = version_bucket(pager, version->page_num);
+      version->next = pager->versions[bucket];
+      pager->versions[bucket] = version;
+      version = next;
+    }
+  }
+  free(old);
+}
+
+// Save a page as the open transaction found it. Caller holds pager->lock
+static PageVersion *pager_add_version(Pager *pager, uint32_t page_num,
+                                      const void *page) {
+  if (pager->num_versions >= pager->versions_size) {
+    pager_grow_versions(pager);
+  }
+
+  PageVersion *version = malloc(sizeof(PageVersion));
+  version->page_num = page_num;
+  version->txn_id = UINT32_MAX;
+  version->data = malloc(PAGE_SIZE);
+  memcpy(version->data, page, PAGE_SIZE);
+
+  uint32_t bucket = version_bucket(pager, page_num);
+  version->next = pager->versions[bucket];
+  pager->versions[bucket] = version;
+  pager->num_versions++;
+  return version;
+}
+
+static void pager_unlink_version(Pager *pager, PageVersion **link) {
+  PageVersion *version = *link;
+  *link = version->next;
+  free(version->data);
+  free(version);
+  pager->num_versions--;
+}
+
+static void pager_drop_version(Pager *pager, PageVersion *version) {
+  PageVersion **link =
+      &pager->versions[version_bucket(pager, version->page_num)];
+  while (*link != version) {
+    link = &(*link)->next;
+  }
+  pager_unlink_version(pager, link);
+}
+
+// What a snapshot of txn_id reads for a page: the oldest version replaced
+// after txn_id, or NULL for the page itself. Caller holds pager->lock
+static PageVersion *pager_find_version(Pager *pager, uint32_t page_num,
+                                       uint32_t txn_id) {
+  PageVersion *found = NULL;
+  PageVersion *version = pager->versions[version_bucket(pager, page_num)];
+  for (; version; version = version->next) {
+    if (version->page_num == page_num && version->txn_id > txn_id &&
+        (!found || version->txn_id < found->txn_id)) {
+      found = version;
+    }
+  }
+  return found;
+}
+
+// Caller holds pager->lock
+static uint32_t pager_collect_versions_locked(Pager *pager) {
+  uint32_t oldest = UINT32_MAX;
+  for (uint32_t i = 0; i < pager->num_snapshots; i++) {
+    if (pager->snapshots[i] < oldest) {
+      oldest = pager->snapshots[i];
+    }
+  }
+
+  // A version replaced by txn_id is only read by snapshots older than it.
+  // The open transaction's versions (UINT32_MAX) are the commit's to drop
+  uint32_t freed = 0;
+  for (uint32_t i = 0; i < pager->versions_size; i++) {
+    PageVersion **link = &pager->versions[i];
+    while (*link) {
+      if ((*link)->txn_id != UINT32_MAX && (*link)->txn_id <= oldest) {
+        pager_unlink_version(pager, link);
+        freed++;
+      } else {
+        link = &(*link)->next;
+      }
+    }
+  }
+  return freed;
+}
+
+uint32_t pager_collect_versions(Pager *pager) {
+  pthread_mutex_lock(&pager->lock);
+  uint32_t freed = 0;
+  if (pager->num_versions > pager->num_txn_pages) {
+    freed = pager_collect_versions_locked(pager);
+  }
+  pthread_mutex_unlock(&pager->lock);
+  return freed;
+}
+
+static uint32_t pager_map_checkpoint(Pager *pager) {
+  uint32_t pages_written = 0;
+  // Dirty flags are indexed by page number, so this is already sequential
+  for (uint32_t i = 0; i < pager->page_dirty_capacity; i++) {
+    if (!pager->page_dirty[i]) {
+      continue;
+    }
+    void *before = pager_txn_before(pager, i);
+    if (before) {
+      // Only the committed image may reach the file; the page stays dirty
+      pager_write_data(pager, i, before);
+    } else {
+      pager_map_write_page(pager, i);
+    }
+    pages_written++;
+  }
+  return pages_written;
+}
+
+// The checkpoint LSN lives in the catalog page: every WAL record at or
+// below it is already reflected in the database file
+#define CHECKPOINT_LSN_OFFSET                                                  \
+  ((off_t)CATALOG_PAGE_NUM * PAGE_SIZE + offsetof(Catalog, checkpoint_lsn))
+
+static uint64_t pager_read_checkpoint_lsn(Pager *pager) {
+  uint64_t lsn = 0;
+  if (pager->file_length >= (CATALOG_PAGE_NUM + 1) * PAGE_SIZE &&
+      pread(pager->file_descriptor, &lsn, sizeof(lsn), CHECKPOINT_LSN_OFFSET) ==
+          -1) {
+    printf("Error reading file: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  return lsn;
+}
+
+// Only these 8 bytes are written, so uncommitted catalog changes held in
+// memory never reach the file
+static void pager_write_checkpoint_lsn(Pager *pager, uint64_t lsn) {
+  if (pwrite(pager->file_descriptor, &lsn, sizeof(lsn), CHECKPOINT_LSN_OFFSET) ==
+          -1 ||
+      fsync(pager->file_descriptor) == -1) {
+    printf("Error writing checkpoint LSN: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+
+  // Keep the cached catalog and its before-image in step, so a later
+  // write of page 0 or a rollback can't put an older LSN back
+  size_t offset = offsetof(Catalog, checkpoint_lsn);
+  if (pager->map) {
+    memcpy(pager->map + (size_t)CATALOG_PAGE_NUM * PAGE_SIZE + offset, &lsn,
+           sizeof(lsn));
+  } else {
+    uint32_t index = page_table_lookup(pager, CATALOG_PAGE_NUM);
+    if (index != INVALID_FRAME) {
+      memcpy((char *)pager->frames[index].data + offset, &lsn, sizeof(lsn));
+    }
+  }
+  char *before = pager_txn_before(pager, CATALOG_PAGE_NUM);
+  if (before) {
+    memcpy(before + offset, &lsn, sizeof(lsn));
+  }
+}
+
+// Redo the log past the last checkpoint, then checkpoint so the next
+// open starts from an empty log
+static void pager_recover(Pager *pager) {
+  uint64_t checkpoint_lsn = pager_read_checkpoint_lsn(pager);
+  if (wal_replay(pager->wal, pager, checkpoint_lsn) > 0 ||
+      pager->wal->file_size > 0) {
+    pager_checkpoint(pager);
+  }
+  pager->visible_txn_id = pager->wal->next_txn_id - 1;
+}
+
+Pager *pager_open(const char *filename, const DbOptions *options) {
   int fd = open(filename, O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);
   if (fd == -1) {
     printf("Unable to open file\n");
@@ -15,6 +464,7 @@ Pager *pager_open(const char *filename) {
   off_t file_length = lseek(fd, 0, SEEK_END);
 
   Pager *pager = malloc(sizeof(Pager));
+  pthread_mutex_init(&pager->lock, NULL);
   pager->file_descriptor = fd;
   pager->file_length = file_length;
   pager->num_pages = (file_length / PAGE_SIZE);
@@ -24,78 +474,543 @@ Pager *pager_open(const char *filename) {
     exit(EXIT_FAILURE);
   }
 
-  for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
-    pager->pages[i] = NULL;
+  pager->map = NULL;
+  pager->map_latches = NULL;
+  pager->txn_pages = NULL;
+  pager->num_txn_pages = 0;
+  pager->txn_pages_capacity = 0;
+  pager->visible_txn_id = 0;
+  pager->snapshots = NULL;
+  pager->num_snapshots = 0;
+  pager->snapshots_capacity = 0;
+  pager->versions_size = 64;
+  pager->versions = calloc(pager->versions_size, sizeof(PageVersion *));
+  pager->num_versions = 0;
+
+  char *wal_filename = malloc(strlen(filename) + 5);
+  sprintf(wal_filename, "%s-wal", filename);
+  pager->wal = wal_open(wal_filename, options);
+  free(wal_filename);
+
+  if (options && options->use_mmap) {
+    pager_map_file(pager);
+    pager->num_frames = 0;
+    pager->frames = NULL;
+    pager->frame_chunks = NULL;
+    pager->num_frame_chunks = 0;
+    pager->page_table = NULL;
+    pager_recover(pager);
+    return pager;
+  }
+
+  uint32_t num_frames = options ? options->pool_frames : DEFAULT_POOL_FRAMES;
+  if (num_frames < MIN_POOL_FRAMES) {
+    num_frames = MIN_POOL_FRAMES;
   }
 
+  pager->num_frames = 0;
+  pager->frames = NULL;
+  pager->frame_chunks = NULL;
+  pager->num_frame_chunks = 0;
+  pager->page_table = NULL;
+  pager->page_table_size = 0;
+  pager->clock_hand = 0;
+  pager_add_frames(pager, num_frames);
+
+  pager_recover(pager);
   return pager;
 }
 
-void *pager_get_page(Pager *pager, uint32_t page_num) {
-  if (page_num > TABLE_MAX_PAGES) {
-    printf("Tried to fetch page number out of bounds. %d > %d\n", page_num,
-           TABLE_MAX_PAGES);
-    exit(EXIT_FAILURE);
+// Caller holds pager->lock
+static void *pager_pin_page(Pager *pager, uint32_t page_num) {
+  if (pager->map) {
+    return pager_map_get_page(pager, page_num);
   }
 
-  if (pager->pages[page_num] == NULL) {
-    void *page = malloc(PAGE_SIZE);
-    uint32_t num_pages = pager->file_length / PAGE_SIZE;
+  uint32_t index = page_table_lookup(pager, page_num);
 
-    if (pager->file_length % PAGE_SIZE) {
-      num_pages += 1;
-    }
+  if (index == INVALID_FRAME) {
+    // Cache miss. Load page from disk, or zero it if past end of file
+    index = pager_evict(pager);
+    Frame *frame = &pager->frames[index];
+    uint32_t num_pages_on_disk = pager->file_length / PAGE_SIZE;
 
-    if (page_num <= num_pages) {
-      lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);
-      ssize_t bytes_read = read(pager->file_descriptor, page, PAGE_SIZE);
+    if (page_num < num_pages_on_disk) {
+      ssize_t bytes_read = pread(pager->file_descriptor, frame->data,
+                                 PAGE_SIZE, (off_t)page_num * PAGE_SIZE);
       if (bytes_read == -1) {
         printf("Error reading file: %d\n", errno);
         exit(EXIT_FAILURE);
       }
+    } else {
+      memset(frame->data, 0, PAGE_SIZE);
     }
 
-    pager->pages[page_num] = page;
+    frame->page_num = page_num;
+    frame->in_use = true;
+    frame->dirty = false;
+    frame->txn_dirty = false;
+    frame->pin_count = 0;
+    frame->page_lsn = 0;
+    page_table_insert(pager, index);
 
     if (page_num >= pager->num_pages) {
       pager->num_pages = page_num + 1;
     }
   }
 
-  return pager->pages[page_num];
+  Frame *frame = &pager->frames[index];
+  frame->pin_count++;
+  frame->referenced = true;
+  return frame->data;
 }
 
-void pager_flush(Pager *pager, uint32_t page_num) {
-  if (pager->pages[page_num] == NULL) {
-    printf("Tried to flush null page\n");
+// Caller holds pager->lock
+static void pager_unpin_locked(Pager *pager, uint32_t page_num) {
+  if (pager->map) {
+    return; // Mapped pages are never evicted
+  }
+
+  uint32_t index = page_table_lookup(pager, page_num);
+  if (index == INVALID_FRAME || pager->frames[index].pin_count == 0) {
+    printf("Tried to unpin page %d that is not pinned\n", page_num);
+    exit(EXIT_FAILURE);
+  }
+  pager->frames[index].pin_count--;
+}
+
+void *pager_get_page(Pager *pager, uint32_t page_num) {
+  pthread_mutex_lock(&pager->lock);
+  void *page = pager_pin_page(pager, page_num);
+  pthread_mutex_unlock(&pager->lock);
+  return page;
+}
+
+void pager_unpin_page(Pager *pager, uint32_t page_num) {
+  pthread_mutex_lock(&pager->lock);
+  pager_unpin_locked(pager, page_num);
+  pthread_mutex_unlock(&pager->lock);
+}
+
+// Set on the thread holding the database writer lock
+static __thread Pager *writer_pager = NULL;
+
+void pager_set_writer(Pager *pager, bool is_writer) {
+  writer_pager = is_writer ? pager : NULL;
+}
+
+// The calling thread's snapshot: how deeply its begins nest, and the
+// last commit it sees
+static __thread uint32_t snapshot_depth = 0;
+static __thread uint32_t snapshot_txn_id;
+
+// Caller holds pager->lock
+static void pager_begin_snapshot_locked(Pager *pager, uint32_t txn_id) {
+  if (snapshot_depth++ > 0) {
+    return;
+  }
+  if (pager->num_snapshots == pager->snapshots_capacity) {
+    pager->snapshots_capacity =
+        pager->snapshots_capacity ? pager->snapshots_capacity * 2 : 16;
+    pager->snapshots = realloc(pager->snapshots,
+                               sizeof(uint32_t) * pager->snapshots_capacity);
+  }
+  snapshot_txn_id = txn_id;
+  pager->snapshots[pager->num_snapshots++] = snapshot_txn_id;
+}
+
+// Caller holds pager->lock
+static void pager_end_snapshot_locked(Pager *pager) {
+  if (snapshot_depth == 0) {
+    printf("Ended a snapshot that was never begun\n");
     exit(EXIT_FAILURE);
   }
+  if (--snapshot_depth > 0) {
+    return;
+  }
+  for (uint32_t i = 0; i < pager->num_snapshots; i++) {
+    if (pager->snapshots[i] == snapshot_txn_id) {
+      pager->snapshots[i] = pager->snapshots[--pager->num_snapshots];
+      break;
+    }
+  }
+
+  // The last reader out frees every version; while snapshots overlap the
+  // background writer frees the ones they've moved past
+  if (pager->num_snapshots == 0 && pager->num_versions > pager->num_txn_pages) {
+    pager_collect_versions_locked(pager);
+  }
+}
+
+void pager_begin_snapshot(Pager *pager) {
+  if (writer_pager == pager) {
+    return;
+  }
+  pthread_mutex_lock(&pager->lock);
+  pager_begin_snapshot_locked(pager, pager->visible_txn_id);
+  pthread_mutex_unlock(&pager->lock);
+}
+
+void pager_end_snapshot(Pager *pager) {
+  if (writer_pager == pager) {
+    return;
+  }
+  pthread_mutex_lock(&pager->lock);
+  pager_end_snapshot_locked(pager);
+  pthread_mutex_unlock(&pager->lock);
+}
+
+bool pager_snapshot_txn_id(Pager *pager, uint32_t *txn_id) {
+  if (writer_pager == pager || snapshot_depth == 0) {
+    return false;
+  }
+  *txn_id = snapshot_txn_id;
+  return true;
+}
+
+// The other thread's snapshot keeps every version txn_id reads, and
+// versions are only ever freed past the oldest open snapshot
+void pager_join_snapshot(Pager *pager, uint32_t txn_id) {
+  pthread_mutex_lock(&pager->lock);
+  pager_begin_snapshot_locked(pager, txn_id);
+  pthread_mutex_unlock(&pager->lock);
+}
+
+void *pager_get_page_shared(Pager *pager, uint32_t page_num) {
+  if (writer_pager == pager) {
+    return pager_get_page(pager, page_num);
+  }
+
+  pthread_mutex_lock(&pager->lock);
+  pager_begin_snapshot_locked(pager, pager->visible_txn_id);
 
-  off_t offset = lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);
+  PageVersion *version = pager_find_version(pager, page_num, snapshot_txn_id);
+  if (version) {
+    // Kept at least as long as our snapshot, so needs no pin
+    pthread_mutex_unlock(&pager->lock);
+    return version->data;
+  }
 
-  if (offset == -1) {
-    printf("Error seeking: %d\n", errno);
+  // pager_mark_dirty saves a version before it latches a page, so the
+  // writer can't be holding or waiting for this one
+  void *page = pager_pin_page(pager, page_num);
+  if (pthread_rwlock_tryrdlock(pager_latch(pager, page_num)) != 0) {
+    printf("Page %d is latched with no version to read\n", page_num);
     exit(EXIT_FAILURE);
   }
+  pthread_mutex_unlock(&pager->lock);
+  return page;
+}
 
-  ssize_t bytes_written =
-      write(pager->file_descriptor, pager->pages[page_num], PAGE_SIZE);
+void pager_release_page_shared(Pager *pager, uint32_t page_num, void *page) {
+  if (writer_pager == pager) {
+    pager_unpin_page(pager, page_num);
+    return;
+  }
 
-  if (bytes_written == -1) {
-    printf("Error writing: %d\n", errno);
+  pthread_mutex_lock(&pager->lock);
+  bool is_version;
+  if (pager->map) {
+    is_version = page != pager->map + (size_t)page_num * PAGE_SIZE;
+  } else {
+    uint32_t index = page_table_lookup(pager, page_num);
+    is_version = index == INVALID_FRAME || pager->frames[index].data != page;
+  }
+  if (!is_version) {
+    pthread_rwlock_unlock(pager_latch(pager, page_num));
+    pager_unpin_locked(pager, page_num);
+  }
+  pager_end_snapshot_locked(pager);
+  pthread_mutex_unlock(&pager->lock);
+}
+
+// Remember what a page held before the open transaction first touched it
+static void pager_txn_track(Pager *pager, uint32_t page_num, void *page) {
+  if (pager->num_txn_pages == pager->txn_pages_capacity) {
+    pager->txn_pages_capacity =
+        pager->txn_pages_capacity ? pager->txn_pages_capacity * 2 : 16;
+    pager->txn_pages =
+        realloc(pager->txn_pages, sizeof(TxnPage) * pager->txn_pages_capacity);
+  }
+  TxnPage *txn_page = &pager->txn_pages[pager->num_txn_pages++];
+  txn_page->page_num = page_num;
+  txn_page->page = page;
+  txn_page->before = pager_add_version(pager, page_num, page);
+}
+
+void pager_mark_dirty(Pager *pager, uint32_t page_num) {
+  pthread_mutex_lock(&pager->lock);
+
+  uint32_t index = INVALID_FRAME;
+  if (!pager->map) {
+    index = page_table_lookup(pager, page_num);
+    if (index == INVALID_FRAME) {
+      printf("Tried to mark non-resident page %d dirty\n", page_num);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  bool tracked = pager->map ? pager_txn_before(pager, page_num) != NULL
+                            : pager->frames[index].txn_dirty;
+  if (!tracked) {
+    // Readers that come along from now on read the saved version, so
+    // only those already on the page hold up the latch. The caller's pin
+    // keeps the latch in place while we wait for them
+    if (pager->map) {
+      pager_txn_track(pager, page_num,
+                      pager->map + (size_t)page_num * PAGE_SIZE);
+    } else {
+      pager_txn_track(pager, page_num, pager->frames[index].data);
+      pager->frames[index].txn_dirty = true;
+    }
+    pthread_rwlock_t *latch = pager_latch(pager, page_num);
+    pthread_mutex_unlock(&pager->lock);
+    pthread_rwlock_wrlock(latch);
+    pthread_mutex_lock(&pager->lock);
+  }
+
+  // The pool may have grown while we waited, moving the frames
+  if (pager->map) {
+    pager_map_mark_dirty(pager, page_num);
+  } else {
+    pager->frames[index].dirty = true;
+  }
+
+  pthread_mutex_unlock(&pager->lock);
+}
+
+// Log the byte ranges that differ between before and after. Runs of up
+// to WAL_DIFF_GAP unchanged bytes are folded into one record, which is
+// cheaper than a second record header.
+#define WAL_DIFF_GAP 32
+
+static uint64_t pager_log_page_diff(Pager *pager, uint32_t txn_id,
+                                    uint32_t page_num, const char *before,
+                                    const char *after) {
+  uint64_t lsn = 0;
+  uint32_t i = 0;
+
+  while (i < PAGE_SIZE) {
+    if (before[i] == after[i]) {
+      i++;
+      continue;
+    }
+
+    uint32_t start = i;
+    uint32_t end = i + 1;
+    for (i = i + 1; i < PAGE_SIZE && i - end <= WAL_DIFF_GAP; i++) {
+      if (before[i] != after[i]) {
+        end = i + 1;
+      }
+    }
+
+    lsn = wal_log_write(pager->wal, txn_id, page_num, start, after + start,
+                        end - start);
+    i = end;
+  }
+
+  return lsn;
+}
+
+static uint32_t pager_checkpoint_locked(Pager *pager);
+
+uint64_t pager_commit(Pager *pager) {
+  pthread_mutex_lock(&pager->lock);
+  if (pager->num_txn_pages == 0) {
+    pthread_mutex_unlock(&pager->lock);
+    return 0;
+  }
+
+  uint32_t txn_id = pager->wal->next_txn_id++;
+
+  for (uint32_t i = 0; i < pager->num_txn_pages; i++) {
+    TxnPage *txn_page = &pager->txn_pages[i];
+    uint64_t lsn = pager_log_page_diff(pager, txn_id, txn_page->page_num,
+                                       txn_page->before->data, txn_page->page);
+    if (!pager->map && lsn > 0) {
+      pager->frames[page_table_lookup(pager, txn_page->page_num)].page_lsn = lsn;
+    }
+  }
+
+  // Readers keep going during the commit's fsync. The pages stay
+  // txn_dirty, so none can be evicted ahead of the COMMIT record
+  pthread_mutex_unlock(&pager->lock);
+  uint64_t commit_lsn = wal_log_commit(pager->wal, txn_id);
+  pthread_mutex_lock(&pager->lock);
+
+  for (uint32_t i = 0; i < pager->num_txn_pages; i++) {
+    TxnPage *txn_page = &pager->txn_pages[i];
+    if (!pager->map) {
+      pager->frames[page_table_lookup(pager, txn_page->page_num)].txn_dirty =
+          false;
+    }
+    // Open snapshots predate this commit and may still read the old page
+    if (pager->num_snapshots > 0) {
+      txn_page->before->txn_id = txn_id;
+    } else {
+      pager_drop_version(pager, txn_page->before);
+    }
+    pthread_rwlock_unlock(pager_latch(pager, txn_page->page_num));
+  }
+  pager->num_txn_pages = 0;
+  pager->visible_txn_id = txn_id;
+
+  // Bound recovery time: don't let the log outgrow WAL_CHECKPOINT_SIZE
+  // between the background writer's periodic checkpoints
+  if (wal_size(pager->wal) >= WAL_CHECKPOINT_SIZE) {
+    pager_checkpoint_locked(pager);
+  }
+  pthread_mutex_unlock(&pager->lock);
+  return commit_lsn;
+}
+
+void pager_rollback(Pager *pager) {
+  pthread_mutex_lock(&pager->lock);
+  for (uint32_t i = 0; i < pager->num_txn_pages; i++) {
+    TxnPage *txn_page = &pager->txn_pages[i];
+    memcpy(txn_page->page, txn_page->before->data, PAGE_SIZE);
+    if (!pager->map) {
+      pager->frames[page_table_lookup(pager, txn_page->page_num)].txn_dirty =
+          false;
+    }
+    // Readers may be part way through the version, which still shows the
+    // page as of the last commit
+    if (pager->num_snapshots > 0) {
+      txn_page->before->txn_id = pager->visible_txn_id + 1;
+    } else {
+      pager_drop_version(pager, txn_page->before);
+    }
+    pthread_rwlock_unlock(pager_latch(pager, txn_page->page_num));
+  }
+  pager->num_txn_pages = 0;
+  pthread_mutex_unlock(&pager->lock);
+}
+
+void pager_redo(Pager *pager, uint32_t page_num, uint32_t offset,
+                const void *data, uint32_t size) {
+  if (offset + size > PAGE_SIZE) {
+    printf("Corrupt WAL record for page %d\n", page_num);
+    exit(EXIT_FAILURE);
+  }
+
+  pthread_mutex_lock(&pager->lock);
+  char *page = pager_pin_page(pager, page_num);
+  memcpy(page + offset, data, size);
+
+  // Already durable in the log, so this is not part of a transaction
+  if (pager->map) {
+    pager_map_mark_dirty(pager, page_num);
+  } else {
+    pager->frames[page_table_lookup(pager, page_num)].dirty = true;
+  }
+
+  pager_unpin_locked(pager, page_num);
+  pthread_mutex_unlock(&pager->lock);
+}
+
+void pager_flush(Pager *pager, uint32_t page_num) {
+  pthread_mutex_lock(&pager->lock);
+  if (pager->map) {
+    pager_map_mark_dirty(pager, page_num);
+    pager_map_write_page(pager, page_num);
+  } else {
+    uint32_t index = page_table_lookup(pager, page_num);
+    if (index == INVALID_FRAME) {
+      printf("Tried to flush null page\n");
+      exit(EXIT_FAILURE);
+    }
+    pager_write_frame(pager, &pager->frames[index]);
+  }
+  pthread_mutex_unlock(&pager->lock);
+}
+
+void pager_write_new_page(Pager *pager, uint32_t page_num, const void *data) {
+  pthread_mutex_lock(&pager->lock);
+  pager_write_data(pager, page_num, data);
+  pthread_mutex_unlock(&pager->lock);
+}
+
+void pager_sync(Pager *pager) {
+  if (fsync(pager->file_descriptor) == -1) {
+    printf("Error syncing db file: %d\n", errno);
     exit(EXIT_FAILURE);
   }
 }
 
+static int compare_frames_by_page(const void *a, const void *b) {
+  uint32_t page_a = (*(Frame *const *)a)->page_num;
+  uint32_t page_b = (*(Frame *const *)b)->page_num;
+  return (page_a > page_b) - (page_a < page_b);
+}
+
+// Flush the log, write every committed page image in page order and
+// sync. The log is then covered up to checkpoint_lsn and is truncated.
+// Caller holds pager->lock
+static uint32_t pager_checkpoint_locked(Pager *pager) {
+  uint64_t checkpoint_lsn = wal_flush(pager->wal);
+  uint32_t pages_written;
+
+  if (pager->map) {
+    pages_written = pager_map_checkpoint(pager);
+  } else {
+    Frame **dirty = malloc(sizeof(Frame *) * pager->num_frames);
+    uint32_t num_dirty = 0;
+
+    for (uint32_t i = 0; i < pager->num_frames; i++) {
+      Frame *frame = &pager->frames[i];
+      if (frame->in_use && frame->dirty) {
+        dirty[num_dirty++] = frame;
+      }
+    }
+
+    // Write in page order so the disk sees one sequential sweep
+    qsort(dirty, num_dirty, sizeof(Frame *), compare_frames_by_page);
+    for (uint32_t i = 0; i < num_dirty; i++) {
+      Frame *frame = dirty[i];
+      if (frame->txn_dirty) {
+        // Uncommitted changes never reach the database file, but the
+        // committed image under them must: the log is about to go
+        pager_write_data(pager, frame->page_num,
+                         pager_txn_before(pager, frame->page_num));
+      } else {
+        pager_write_frame(pager, frame);
+      }
+    }
+    free(dirty);
+    pages_written = num_dirty;
+  }
+
+  if (pages_written > 0) {
+    pager_sync(pager);
+  }
+
+  if (wal_size(pager->wal) > 0) {
+    pager_write_checkpoint_lsn(pager, checkpoint_lsn);
+    wal_truncate(pager->wal);
+  }
+
+  return pages_written;
+}
+
+uint32_t pager_checkpoint(Pager *pager) {
+  pthread_mutex_lock(&pager->lock);
+  uint32_t pages_written = pager_checkpoint_locked(pager);
+  pthread_mutex_unlock(&pager->lock);
+  return pages_written;
+}
+
 void pager_close(Pager *pager) {
-  for (uint32_t i = 0; i < pager->num_pages; i++) {
-    if (pager->pages[i] == NULL) {
-      continue;
+  pager_checkpoint(pager);
+  wal_close(pager->wal);
+
+  for (uint32_t i = 0; i < pager->versions_size; i++) {
+    while (pager->versions[i]) {
+      pager_unlink_version(pager, &pager->versions[i]);
     }
-    pager_flush(pager, i);
-    free(pager->pages[i]);
-    pager->pages[i] = NULL;
   }
+  free(pager->versions);
+  free(pager->snapshots);
+  free(pager->txn_pages);
 
   int result = close(pager->file_descriptor);
   if (result == -1) {
@@ -103,19 +1018,143 @@ void pager_close(Pager *pager) {
     exit(EXIT_FAILURE);
   }
 
-  for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
-    void *page = pager->pages[i];
-    if (page) {
-      free(page);
-      pager->pages[i] = NULL;
+  if (pager->map) {
+    munmap(pager->map, MMAP_MAX_SIZE);
+    free(pager->page_dirty);
+    for (uint32_t i = 0; i < MAP_LATCH_CHUNKS; i++) {
+      if (pager->map_latches[i]) {
+        for (uint32_t j = 0; j < MAP_LATCH_CHUNK_PAGES; j++) {
+          pthread_rwlock_destroy(&pager->map_latches[i][j]);
+        }
+        free(pager->map_latches[i]);
+      }
     }
+    free(pager->map_latches);
   }
 
+  for (uint32_t i = 0; i < pager->num_frames; i++) {
+    pthread_rwlock_destroy(pager->frames[i].latch);
+  }
+  free(pager->page_table);
+  for (uint32_t i = 0; i < pager->num_frame_chunks; i++) {
+    free(pager->frame_chunks[i]);
+  }
+  free(pager->frame_chunks);
+  free(pager->frames);
+  pthread_mutex_destroy(&pager->lock);
   free(pager);
 }
 
+static uint32_t *free_trunk_next(void *trunk) {
+  return (uint32_t *)((char *)trunk + FREE_TRUNK_NEXT_OFFSET);
+}
+
+static uint32_t *free_trunk_count(void *trunk) {
+  return (uint32_t *)((char *)trunk + FREE_TRUNK_COUNT_OFFSET);
+}
+
+static uint32_t *free_trunk_page(void *trunk, uint32_t index) {
+  return (uint32_t *)((char *)trunk + FREE_TRUNK_PAGES_OFFSET) + index;
+}
+
 uint32_t pager_allocate_page(Pager *pager) {
+  Catalog *catalog = pager_get_page(pager, CATALOG_PAGE_NUM);
+  uint32_t trunk_page_num = catalog->free_list_head;
+  if (trunk_page_num == 0) {
+    pager_unpin_page(pager, CATALOG_PAGE_NUM);
+    return pager_allocate_new_page(pager);
+  }
+
+  void *trunk = pager_get_page(pager, trunk_page_num);
+  uint32_t count = *free_trunk_count(trunk);
+  uint32_t page_num;
+
+  pager_mark_dirty(pager, CATALOG_PAGE_NUM);
+  if (count > 0) {
+    pager_mark_dirty(pager, trunk_page_num);
+    page_num = *free_trunk_page(trunk, count - 1);
+    *free_trunk_count(trunk) = count - 1;
+  } else {
+    page_num = trunk_page_num;
+    catalog->free_list_head = *free_trunk_next(trunk);
+  }
+  catalog->num_free_pages--;
+
+  pager_unpin_page(pager, trunk_page_num);
+  pager_unpin_page(pager, CATALOG_PAGE_NUM);
+  return page_num;
+}
+
+uint32_t pager_allocate_new_page(Pager *pager) {
+  pthread_mutex_lock(&pager->lock);
   uint32_t page_num = pager->num_pages;
   pager->num_pages++; // Increment for next allocation
+  pthread_mutex_unlock(&pager->lock);
   return page_num;
 }
+
+void pager_free_page(Pager *pager, uint32_t page_num) {
+  Catalog *catalog = pager_get_page(pager, CATALOG_PAGE_NUM);
+  pager_mark_dirty(pager, CATALOG_PAGE_NUM);
+
+  uint32_t trunk_page_num = catalog->free_list_head;
+  void *trunk = trunk_page_num ? pager_get_page(pager, trunk_page_num) : NULL;
+  if (trunk && *free_trunk_count(trunk) < FREE_TRUNK_MAX_PAGES) {
+    pager_mark_dirty(pager, trunk_page_num);
+    uint32_t count = *free_trunk_count(trunk);
+    *free_trunk_page(trunk, count) = page_num;
+    *free_trunk_count(trunk) = count + 1;
+  } else {
+    // The freed page becomes the new head trunk
+    void *page = pager_get_page(pager, page_num);
+    pager_mark_dirty(pager, page_num);
+    *free_trunk_next(page) = trunk_page_num;
+    *free_trunk_count(page) = 0;
+    pager_unpin_page(pager, page_num);
+    catalog->free_list_head = page_num;
+  }
+  catalog->num_free_pages++;
+
+  if (trunk) {
+    pager_unpin_page(pager, trunk_page_num);
+  }
+  pager_unpin_page(pager, CATALOG_PAGE_NUM);
+}
+
+void pager_truncate(Pager *pager, uint32_t num_pages) {
+  pthread_mutex_lock(&pager->lock);
+  pager_checkpoint_locked(pager);
+
+  if (pager->map) {
+    for (uint32_t i = num_pages; i < pager->page_dirty_capacity; i++) {
+      pager->page_dirty[i] = false;
+    }
+    if (pager->file_length > (uint64_t)num_pages * PAGE_SIZE) {
+      madvise(pager->map + (size_t)num_pages * PAGE_SIZE,
+              pager->file_length - (size_t)num_pages * PAGE_SIZE, MADV_DONTNEED);
+    }
+  } else {
+    for (uint32_t i = 0; i < pager->num_frames; i++) {
+      Frame *frame = &pager->frames[i];
+      if (!frame->in_use || frame->page_num < num_pages) {
+        continue;
+      }
+      if (frame->pin_count > 0) {
+        printf("Tried to truncate pinned page %d\n", frame->page_num);
+        exit(EXIT_FAILURE);
+      }
+      page_table_remove(pager, i);
+      frame->in_use = false;
+      frame->dirty = false;
+    }
+  }
+
+  if (ftruncate(pager->file_descriptor, (off_t)num_pages * PAGE_SIZE) == -1 ||
+      fsync(pager->file_descriptor) == -1) {
+    printf("Error truncating db file: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  pager->file_length = num_pages * PAGE_SIZE;
+  pager->num_pages = num_pages;
+  pthread_mutex_unlock(&pager->lock);
+}
@@ -0,0 +1,322 @@
+#include "../include/scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86 1
+#endif
+
+static uint32_t filter_range_scalar(const int32_t *values, uint32_t start,
+                                    uint32_t count, int32_t lo, int32_t hi,
+                                    uint64_t *selection) {
+  uint32_t matches = 0;
+  for (uint32_t i = start; i < count; i++) {
+    if (values[i] >= lo && values[i] <= hi) {
+      selection[i / 64] |= 1ULL << (i % 64);
+      matches++;
+    }
+  }
+  return matches;
+}
+
+#ifdef SCAN_X86
+// A lane matches unless lo > value or value > hi. Lane groups start at
+// multiples of 4 or 8, so a group's bits never straddle two words.
+
+__attribute__((target("sse2"))) static uint32_t
+filter_range_sse2(const int32_t *values, uint32_t count, int32_t lo, int32_t hi,
+                  uint64_t *selection) {
+  __m128i low = _mm_set1_epi32(lo);
+  __m128i high = _mm_set1_epi32(hi);
+  uint32_t matches = 0;
+  uint32_t i = 0;
+
+  for (; i + 4 <= count; i += 4) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(values + i));
+    __m128i out = _mm_or_si128(_mm_cmpgt_epi32(low, v), _mm_cmpgt_epi32(v, high));
+    uint32_t mask = ~(uint32_t)_mm_movemask_ps(_mm_castsi128_ps(out)) & 0xF;
+    selection[i / 64] |= (uint64_t)mask << (i % 64);
+    matches += __builtin_popcount(mask);
+  }
+
+  return matches + filter_range_scalar(values, i, count, lo, hi, selection);
+}
+
+__attribute__((target("avx2"))) static uint32_t
+filter_range_avx2(const int32_t *values, uint32_t count, int32_t lo, int32_t hi,
+                  uint64_t *selection) {
+  __m256i low = _mm256_set1_epi32(lo);
+  __m256i high = _mm256_set1_epi32(hi);
+  uint32_t matches = 0;
+  uint32_t i = 0;
+
+  for (; i + 8 <= count; i += 8) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(values + i));
+    __m256i out =
+        _mm256_or_si256(_mm256_cmpgt_epi32(low, v), _mm256_cmpgt_epi32(v, high));
+    uint32_t mask = ~(uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(out)) & 0xFF;
+    selection[i / 64] |= (uint64_t)mask << (i % 64);
+    matches += __builtin_popcount(mask);
+  }
+
+  return matches + filter_range_scalar(values, i, count, lo, hi, selection);
+}
+#endif
+
+typedef uint32_t (*FilterKernel)(const int32_t *, uint32_t, int32_t, int32_t,
+                                 uint64_t *);
+
+static uint32_t filter_range_portable(const int32_t *values, uint32_t count,
+                                      int32_t lo, int32_t hi,
+                                      uint64_t *selection) {
+  return filter_range_scalar(values, 0, count, lo, hi, selection);
+}
+
+// Picked on first use from what the CPU supports. Parallel scan workers
+// may all get here at once
+static FilterKernel filter_kernel = NULL;
+static pthread_once_t filter_kernel_once = PTHREAD_ONCE_INIT;
+
+static void filter_select_kernel() {
+  filter_kernel = filter_range_portable;
+#ifdef SCAN_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    filter_kernel = filter_range_avx2;
+  } else if (__builtin_cpu_supports("sse2")) {
+    filter_kernel = filter_range_sse2;
+  }
+#endif
+}
+
+uint32_t filter_int32_range(const int32_t *values, uint32_t count, int32_t lo,
+                            int32_t hi, uint64_t *selection) {
+  pthread_once(&filter_kernel_once, filter_select_kernel);
+  memset(selection, 0, sizeof(uint64_t) * ((count + 63) / 64));
+  return filter_kernel(values, count, lo, hi, selection);
+}
+
+BatchScan *batch_scan_open(Table *table, uint32_t column, int32_t lo,
+                           int32_t hi) {
+  return batch_scan_open_range(table, column, lo, hi, 0, UINT64_MAX);
+}
+
+BatchScan *batch_scan_open_range(Table *table, int32_t column, int32_t lo,
+                                 int32_t hi, uint64_t first_key,
+                                 uint64_t last_key) {
+  BatchScan *scan = malloc(sizeof(BatchScan));
+  scan->table = table;
+  scan->filtered = column != -1;
+  scan->column_offset = scan->filtered ? table->schema->columns[column].offset : 0;
+  scan->lo = lo;
+  scan->hi = hi;
+  scan->last_key = last_key;
+  scan->cursor = table_find_greater_or_equal(table, first_key);
+  scan->started = false;
+  return scan;
+}
+
+bool batch_scan_next(BatchScan *scan, ScanBatch *batch) {
+  Cursor *cursor = scan->cursor;
+  if (scan->started && !cursor->end_of_table) {
+    cursor_next_leaf(cursor);
+  }
+  scan->started = true;
+  if (cursor->end_of_table) {
+    return false;
+  }
+
+  // Gather the filtered column into a vector the kernels can stream. The
+  // first leaf may be entered part way along; the last ends at last_key
+  void *leaf = cursor->node;
+  uint32_t num_cells = *leaf_node_num_cells(leaf);
+  uint32_t count = 0;
+  for (uint32_t i = cursor->cell_num; i < num_cells; i++, count++) {
+    uint64_t key = *leaf_node_key(leaf, i);
+    if (key > scan->last_key) {
+      cursor->end_of_table = true;
+      break;
+    }
+    const char *row = leaf_node_value(leaf, i);
+    batch->keys[count] = key;
+    batch->rows[count] = row;
+    if (scan->filtered) {
+      memcpy(&batch->column[count], row + scan->column_offset, sizeof(int32_t));
+    }
+  }
+  if (count == 0) {
+    return false; // Only the first leaf of the range can hold nothing in it
+  }
+
+  batch->count = count;
+  if (scan->filtered) {
+    batch->matches = filter_int32_range(batch->column, count, scan->lo,
+                                        scan->hi, batch->selection);
+  } else {
+    memset(batch->selection, 0, sizeof(batch->selection));
+    for (uint32_t i = 0; i < count; i++) {
+      batch->selection[i / 64] |= 1ULL << (i % 64);
+    }
+    batch->matches = count;
+  }
+  return true;
+}
+
+void batch_scan_close(BatchScan *scan) {
+  cursor_free(scan->cursor);
+  free(scan);
+}
+
+// Scan partition index on the calling worker, inside the caller's snapshot
+static void scan_run_partition(ParallelScan *scan, uint32_t index) {
+  ScanPartition *partition = &scan->partitions[index];
+  uint64_t first_key = index == 0 ? 0 : scan->split_keys[index - 1] + 1;
+  uint64_t last_key = index == scan->num_partitions - 1
+                          ? UINT64_MAX
+                          : scan->split_keys[index];
+  Pager *pager = scan->table->pager;
+  pager_join_snapshot(pager, scan->snapshot_txn_id);
+
+  BatchScan *batch_scan = batch_scan_open_range(
+      scan->table, scan->column, scan->lo, scan->hi, first_key, last_key);
+  ScanBatch *batch = malloc(sizeof(ScanBatch));
+  FILE *out = open_memstream(&partition->output, &partition->output_size);
+
+  while (batch_scan_next(batch_scan, batch)) {
+    partition->matches += batch->matches;
+    for (uint32_t word = 0; word * 64 < batch->count; word++) {
+      uint64_t bits = batch->selection[word];
+      while (bits) {
+        uint32_t i = word * 64 + __builtin_ctzll(bits);
+        bits &= bits - 1;
+        scan->emit(scan->context, out, batch->rows[i]);
+      }
+    }
+  }
+
+  fclose(out);
+  free(batch);
+  batch_scan_close(batch_scan);
+  pager_end_snapshot(pager);
+}
+
+static void *scan_worker(void *arg) {
+  ScanPool *pool = arg;
+  pthread_mutex_lock(&pool->lock);
+  while (true) {
+    ParallelScan *scan = pool->scan;
+    if (scan && scan->next_partition < scan->num_partitions) {
+      uint32_t index = scan->next_partition++;
+      pthread_mutex_unlock(&pool->lock);
+      scan_run_partition(scan, index);
+      pthread_mutex_lock(&pool->lock);
+      scan->partitions[index].finished = true;
+      pthread_cond_signal(&pool->finished);
+    } else if (pool->closing) {
+      break;
+    } else {
+      pthread_cond_wait(&pool->work, &pool->lock);
+    }
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+ScanPool *scan_pool_open(uint32_t num_workers) {
+  ScanPool *pool = malloc(sizeof(ScanPool));
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->work, NULL);
+  pthread_cond_init(&pool->finished, NULL);
+  pool->num_workers = num_workers;
+  pool->scan = NULL;
+  pool->closing = false;
+  pool->workers = malloc(sizeof(pthread_t) * num_workers);
+  for (uint32_t i = 0; i < num_workers; i++) {
+    if (pthread_create(&pool->workers[i], NULL, scan_worker, pool) != 0) {
+      printf("Error starting scan worker\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  return pool;
+}
+
+void scan_pool_close(ScanPool *pool) {
+  pthread_mutex_lock(&pool->lock);
+  pool->closing = true;
+  pthread_cond_broadcast(&pool->work);
+  pthread_mutex_unlock(&pool->lock);
+  for (uint32_t i = 0; i < pool->num_workers; i++) {
+    pthread_join(pool->workers[i], NULL);
+  }
+  pthread_cond_destroy(&pool->work);
+  pthread_cond_destroy(&pool->finished);
+  pthread_mutex_destroy(&pool->lock);
+  free(pool->workers);
+  free(pool);
+}
+
+// Next finished partition to write out, or NULL if it isn't done yet.
+// Caller holds pool->lock
+static ScanPartition *scan_next_output(ParallelScan *scan, bool ordered,
+                                       uint32_t written) {
+  if (ordered) {
+    ScanPartition *partition = &scan->partitions[written];
+    return partition->finished ? partition : NULL;
+  }
+  for (uint32_t i = 0; i < scan->num_partitions; i++) {
+    ScanPartition *partition = &scan->partitions[i];
+    if (partition->finished && !partition->written) {
+      return partition;
+    }
+  }
+  return NULL;
+}
+
+uint32_t parallel_scan(ScanPool *pool, Table *table, int32_t column,
+                       int32_t lo, int32_t hi, ScanEmitRow emit,
+                       void *context, bool ordered, FILE *out) {
+  ParallelScan scan = {.table = table,
+                       .column = column,
+                       .lo = lo,
+                       .hi = hi,
+                       .emit = emit,
+                       .context = context,
+                       .next_partition = 0};
+  if (!pager_snapshot_txn_id(table->pager, &scan.snapshot_txn_id)) {
+    printf("Parallel scan started outside a snapshot\n");
+    exit(EXIT_FAILURE);
+  }
+
+  uint32_t max_split_keys = pool->num_workers * SCAN_PARTITIONS_PER_WORKER - 1;
+  scan.split_keys = malloc(sizeof(uint64_t) * max_split_keys);
+  scan.num_partitions =
+      table_split_keys(table, scan.split_keys, max_split_keys) + 1;
+  scan.partitions = calloc(scan.num_partitions, sizeof(ScanPartition));
+
+  pthread_mutex_lock(&pool->lock);
+  pool->scan = &scan;
+  pthread_cond_broadcast(&pool->work);
+
+  // Write each partition out as soon as it may go, while the rest run
+  uint32_t rows_matched = 0;
+  uint32_t written = 0;
+  while (written < scan.num_partitions) {
+    ScanPartition *partition = scan_next_output(&scan, ordered, written);
+    if (!partition) {
+      pthread_cond_wait(&pool->finished, &pool->lock);
+      continue;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    fwrite(partition->output, 1, partition->output_size, out);
+    free(partition->output);
+    rows_matched += partition->matches;
+    pthread_mutex_lock(&pool->lock);
+    partition->written = true;
+    written++;
+  }
+  pool->scan = NULL;
+  pthread_mutex_unlock(&pool->lock);
+
+  free(scan.partitions);
+  free(scan.split_keys);
+  return rows_matched;
+}
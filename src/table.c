@@ -1,53 +1,50 @@
 #include "../include/table.h"
+#include <strings.h>
 
 void serialize_row(Schema *schema, void **values, void *destination) {
-  uint32_t offset = 0;
   for (uint32_t i = 0; i < schema->num_columns; i++) {
     Column *col = &schema->columns[i];
     if (col->type == COL_TYPE_INT) {
-      memcpy(destination + offset, values[i], sizeof(int32_t));
-      offset += sizeof(int32_t);
+      memcpy(destination + col->offset, values[i], sizeof(int32_t));
     } else if (col->type == COL_TYPE_TEXT) {
-      memcpy(destination + offset, values[i], col->size);
-      offset += col->size;
+      memcpy(destination + col->offset, values[i], col->size);
     }
   }
 }
 
-// Deserialize a row from buffer based on schema
-void **deserialize_row(Schema *schema, void *source) {
-  void **values = malloc(sizeof(void *) * schema->num_columns);
-  uint32_t offset = 0;
-
+int32_t schema_find_column(Schema *schema, const char *name) {
   for (uint32_t i = 0; i < schema->num_columns; i++) {
-    Column *col = &schema->columns[i];
-    if (col->type == COL_TYPE_INT) {
-      values[i] = malloc(sizeof(int32_t));
-      memcpy(values[i], source + offset, sizeof(int32_t));
-      offset += sizeof(int32_t);
-    } else if (col->type == COL_TYPE_TEXT) {
-      values[i] = malloc(col->size);
-      memcpy(values[i], source + offset, col->size);
-      offset += col->size;
+    if (strcasecmp(name, schema->columns[i].name) == 0) {
+      return i;
     }
   }
+  return -1;
+}
 
-  return values;
+void fprint_column(FILE *out, Schema *schema, const void *row,
+                   uint32_t column) {
+  Column *col = &schema->columns[column];
+  fprintf(out, "%s: ", col->name);
+  if (col->type == COL_TYPE_INT) {
+    fprintf(out, "%d", row_int(schema, row, column));
+  } else if (col->type == COL_TYPE_TEXT) {
+    fprintf(out, "%s", row_text(schema, row, column));
+  }
+}
+
+void print_column(Schema *schema, const void *row, uint32_t column) {
+  fprint_column(stdout, schema, row, column);
 }
 
 // Print a row
-void print_row(Schema *schema, void **values) {
+void fprint_row(FILE *out, Schema *schema, const void *row) {
   for (uint32_t i = 0; i < schema->num_columns; i++) {
-    Column *col = &schema->columns[i];
-    printf("%s: ", col->name);
-    if (col->type == COL_TYPE_INT) {
-      printf("%d", *(int32_t *)values[i]);
-    } else if (col->type == COL_TYPE_TEXT) {
-      printf("%s", (char *)values[i]);
-    }
+    fprint_column(out, schema, row, i);
     if (i < schema->num_columns - 1) {
-      printf(", ");
+      fprintf(out, ", ");
     }
   }
-  printf("\n");
+  fprintf(out, "\n");
 }
+
+void print_row(Schema *schema, const void *row) { fprint_row(stdout, schema, row); }
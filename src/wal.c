@@ -1,85 +1,357 @@
 // wal.c
+#include <errno.h>
 #include <fcntl.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
-#include "../include/pager.h" // pager_get_page()
+#include "../include/pager.h" // pager_redo()
+#include "../include/wal.h"
 
 /*
  WAL RECORD FORMAT (PHYSICAL LOGGING)
  -----------------------------------
- [uint32 page_num]
- [uint32 offset]
- [uint32 size]
+ [WalRecordHeader: lsn, checksum, type, txn_id, page_num, offset, size]
  [bytes  data[size]]
+
+ A transaction is its PAGE_WRITE records followed by a COMMIT record.
+ Replay applies a transaction only once its COMMIT has been read and
+ every checksum matched, so a torn tail is simply dropped.
+
+ A checkpoint stores the last LSN it covers in the catalog page and
+ truncates the log, so recovery only ever reads what came after it.
 */
 
-static int wal_fd = -1;
+// Staged records are written early once the buffer grows past this,
+// so a large transaction doesn't hold its whole log in memory
+#define WAL_BUFFER_SPILL_SIZE (1024 * 1024)
+
+static uint32_t crc_table[256];
+static bool crc_table_ready = false;
+
+static void crc32_init() {
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t c = i;
+    for (int k = 0; k < 8; k++) {
+      c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+    }
+    crc_table[i] = c;
+  }
+  crc_table_ready = true;
+}
+
+static uint32_t crc32_update(uint32_t crc, const void *data, size_t size) {
+  const uint8_t *bytes = data;
+  for (size_t i = 0; i < size; i++) {
+    crc = crc_table[(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
+  }
+  return crc;
+}
+
+static uint32_t wal_record_checksum(const WalRecordHeader *header,
+                                    const void *data) {
+  WalRecordHeader copy = *header;
+  copy.checksum = 0;
+  uint32_t crc = crc32_update(0xFFFFFFFFu, &copy, sizeof(copy));
+  crc = crc32_update(crc, data, header->size);
+  return crc ^ 0xFFFFFFFFu;
+}
+
+// Write staged records without syncing
+static void wal_write_buffer(Wal *wal) {
+  size_t written = 0;
+  while (written < wal->buffer_used) {
+    ssize_t r = write(wal->fd, wal->buffer + written, wal->buffer_used - written);
+    if (r == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      printf("Error writing WAL: %d\n", errno);
+      exit(EXIT_FAILURE);
+    }
+    written += r;
+  }
+  wal->file_size += wal->buffer_used;
+  wal->buffer_used = 0;
+}
+
+static uint64_t wal_append(Wal *wal, uint32_t type, uint32_t txn_id,
+                           uint32_t page_num, uint32_t offset,
+                           const void *data, uint32_t size) {
+  WalRecordHeader header = {.lsn = wal->next_lsn++,
+                            .checksum = 0,
+                            .type = type,
+                            .txn_id = txn_id,
+                            .page_num = page_num,
+                            .offset = offset,
+                            .size = size};
+  header.checksum = wal_record_checksum(&header, data);
+
+  size_t needed = wal->buffer_used + sizeof(header) + size;
+  if (needed > wal->buffer_capacity) {
+    size_t capacity = wal->buffer_capacity ? wal->buffer_capacity : 4096;
+    while (capacity < needed) {
+      capacity *= 2;
+    }
+    wal->buffer = realloc(wal->buffer, capacity);
+    wal->buffer_capacity = capacity;
+  }
+
+  memcpy(wal->buffer + wal->buffer_used, &header, sizeof(header));
+  memcpy(wal->buffer + wal->buffer_used + sizeof(header), data, size);
+  wal->buffer_used = needed;
+
+  return header.lsn;
+}
 
 /* Open WAL file */
-void wal_open(const char *filename) {
-  wal_fd = open(filename, O_RDWR | O_CREAT | O_APPEND, 0644);
-  if (wal_fd < 0) {
+Wal *wal_open(const char *filename, const DbOptions *options) {
+  if (!crc_table_ready) {
+    crc32_init();
+  }
+
+  Wal *wal = malloc(sizeof(Wal));
+  wal->fd = open(filename, O_RDWR | O_CREAT | O_APPEND, 0644);
+  if (wal->fd < 0) {
     perror("wal_open");
     exit(1);
   }
+
+  pthread_mutex_init(&wal->lock, NULL);
+  pthread_cond_init(&wal->flushed, NULL);
+  wal->sync_mode = options ? options->wal_sync : WAL_SYNC_FULL;
+  wal->group_commit_size =
+      options ? options->group_commit_size : DEFAULT_GROUP_COMMIT_SIZE;
+  if (wal->group_commit_size == 0) {
+    wal->group_commit_size = 1;
+  }
+  wal->group_commit_ms =
+      options ? options->group_commit_ms : DEFAULT_GROUP_COMMIT_MS;
+  wal->next_lsn = 1;
+  wal->flushed_lsn = 0;
+  wal->next_txn_id = 1;
+  wal->file_size = 0;
+  wal->buffer = NULL;
+  wal->buffer_used = 0;
+  wal->buffer_capacity = 0;
+  wal->pending_commits = 0;
+
+  return wal;
 }
 
 /* Close WAL file */
-void wal_close() {
-  if (wal_fd >= 0) {
-    close(wal_fd);
-    wal_fd = -1;
+void wal_close(Wal *wal) {
+  wal_flush(wal);
+  close(wal->fd);
+  pthread_cond_destroy(&wal->flushed);
+  pthread_mutex_destroy(&wal->lock);
+  free(wal->buffer);
+  free(wal);
+}
+
+/* Write staged records and make them durable. Caller holds wal->lock */
+static void wal_flush_locked(Wal *wal) {
+  if (wal->buffer_used > 0) {
+    wal_write_buffer(wal);
+  }
+  if (wal->flushed_lsn + 1 == wal->next_lsn) {
+    return; // Nothing new since the last flush
   }
+
+  if (wal->sync_mode != WAL_SYNC_OFF && fsync(wal->fd) == -1) {
+    printf("Error syncing WAL: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  wal->flushed_lsn = wal->next_lsn - 1;
+  wal->pending_commits = 0;
+  pthread_cond_broadcast(&wal->flushed);
 }
 
-/* Write-ahead log write (MUST fsync) */
-void wal_log_write(uint32_t page_num, uint32_t offset, const void *data,
-                   uint32_t size) {
-  if (wal_fd < 0) {
-    fprintf(stderr, "WAL not opened\n");
-    exit(1);
+uint64_t wal_log_write(Wal *wal, uint32_t txn_id, uint32_t page_num,
+                       uint32_t offset, const void *data, uint32_t size) {
+  pthread_mutex_lock(&wal->lock);
+  uint64_t lsn =
+      wal_append(wal, WAL_RECORD_PAGE_WRITE, txn_id, page_num, offset, data, size);
+  if (wal->buffer_used >= WAL_BUFFER_SPILL_SIZE) {
+    // Safe to write early: without its COMMIT replay ignores it
+    wal_write_buffer(wal);
+  }
+  pthread_mutex_unlock(&wal->lock);
+  return lsn;
+}
+
+uint64_t wal_log_commit(Wal *wal, uint32_t txn_id) {
+  pthread_mutex_lock(&wal->lock);
+  uint64_t lsn = wal_append(wal, WAL_RECORD_COMMIT, txn_id, 0, 0, NULL, 0);
+  wal->pending_commits++;
+
+  switch (wal->sync_mode) {
+  case WAL_SYNC_FULL:
+    wal_flush_locked(wal);
+    break;
+  case WAL_SYNC_GROUP:
+    // The commit that fills the group syncs it for everyone waiting in
+    // wal_wait_commit
+    if (wal->pending_commits >= wal->group_commit_size) {
+      wal_flush_locked(wal);
+    }
+    break;
+  case WAL_SYNC_OFF:
+    if (wal->buffer_used >= WAL_BUFFER_SPILL_SIZE) {
+      wal_write_buffer(wal);
+    }
+    break;
+  }
+
+  pthread_mutex_unlock(&wal->lock);
+  return lsn;
+}
+
+void wal_wait_commit(Wal *wal, uint64_t lsn) {
+  if (wal->sync_mode != WAL_SYNC_GROUP) {
+    return; // Already synced, or never will be
+  }
+
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += wal->group_commit_ms / 1000;
+  deadline.tv_nsec += (long)(wal->group_commit_ms % 1000) * 1000000;
+  if (deadline.tv_nsec >= 1000000000) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000;
+  }
+
+  pthread_mutex_lock(&wal->lock);
+  while (wal->flushed_lsn < lsn) {
+    // Nobody else synced the group in time, so this commit does
+    if (pthread_cond_timedwait(&wal->flushed, &wal->lock, &deadline) ==
+        ETIMEDOUT) {
+      wal_flush_locked(wal);
+    }
   }
+  pthread_mutex_unlock(&wal->lock);
+}
+
+uint64_t wal_flush(Wal *wal) {
+  pthread_mutex_lock(&wal->lock);
+  wal_flush_locked(wal);
+  uint64_t flushed_lsn = wal->flushed_lsn;
+  pthread_mutex_unlock(&wal->lock);
+  return flushed_lsn;
+}
 
-  write(wal_fd, &page_num, sizeof(page_num));
-  write(wal_fd, &offset, sizeof(offset));
-  write(wal_fd, &size, sizeof(size));
-  write(wal_fd, data, size);
+void wal_flush_to(Wal *wal, uint64_t lsn) {
+  pthread_mutex_lock(&wal->lock);
+  if (lsn > wal->flushed_lsn) {
+    wal_flush_locked(wal);
+  }
+  pthread_mutex_unlock(&wal->lock);
+}
+
+uint64_t wal_size(Wal *wal) {
+  pthread_mutex_lock(&wal->lock);
+  uint64_t size = wal->file_size + wal->buffer_used;
+  pthread_mutex_unlock(&wal->lock);
+  return size;
+}
 
-  printf("%s", "WAL used here\n");
-  /* Durability guarantee */
-  fsync(wal_fd);
+/* Truncate WAL after a checkpoint */
+void wal_truncate(Wal *wal) {
+  pthread_mutex_lock(&wal->lock);
+  wal_flush_locked(wal);
+  if (ftruncate(wal->fd, 0) == -1 ||
+      (wal->sync_mode != WAL_SYNC_OFF && fsync(wal->fd) == -1)) {
+    printf("Error truncating WAL: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
+  // LSNs keep counting up; the checkpoint LSN remembers where we were
+  wal->file_size = 0;
+  pthread_mutex_unlock(&wal->lock);
 }
 
 /* Replay WAL on startup */
-void wal_replay() {
-  if (wal_fd < 0)
-    return;
+uint32_t wal_replay(Wal *wal, Pager *pager, uint64_t checkpoint_lsn) {
+  // New records must sort after everything the checkpoint covers
+  wal->next_lsn = checkpoint_lsn + 1;
+  wal->flushed_lsn = checkpoint_lsn;
+
+  off_t length = lseek(wal->fd, 0, SEEK_END);
+  if (length <= 0) {
+    return 0;
+  }
 
-  lseek(wal_fd, 0, SEEK_SET);
+  char *log = malloc(length);
+  if (pread(wal->fd, log, length, 0) != length) {
+    printf("Error reading WAL: %d\n", errno);
+    exit(EXIT_FAILURE);
+  }
 
-  while (1) {
-    uint32_t page_num, offset, size;
+  size_t offset = 0;
+  size_t txn_start = 0; // First record not yet covered by a COMMIT
+  size_t valid_end = 0; // End of the last complete transaction
+  uint64_t last_lsn = checkpoint_lsn;
+  uint32_t last_txn_id = 0;
+  uint32_t txns_applied = 0;
 
-    ssize_t r = read(wal_fd, &page_num, sizeof(page_num));
-    if (r <= 0)
+  while (offset + sizeof(WalRecordHeader) <= (size_t)length) {
+    WalRecordHeader header;
+    memcpy(&header, log + offset, sizeof(header));
+    if (header.size > (size_t)length - offset - sizeof(header)) {
+      break; // Torn record
+    }
+    char *data = log + offset + sizeof(header);
+    if (wal_record_checksum(&header, data) != header.checksum) {
       break;
+    }
+    offset += sizeof(header) + header.size;
 
-    read(wal_fd, &offset, sizeof(offset));
-    read(wal_fd, &size, sizeof(size));
+    if (header.type != WAL_RECORD_COMMIT) {
+      continue;
+    }
 
-    void *data = malloc(size);
-    read(wal_fd, data, size);
+    // A log that outlived its checkpoint (crash before the truncate) only
+    // repeats what the file already holds
+    if (header.lsn <= checkpoint_lsn) {
+      txn_start = offset;
+      valid_end = offset;
+      last_txn_id = header.txn_id;
+      continue;
+    }
+
+    // Redo the committed transaction's page writes in log order
+    size_t cursor = txn_start;
+    while (cursor < offset) {
+      WalRecordHeader record;
+      memcpy(&record, log + cursor, sizeof(record));
+      if (record.type == WAL_RECORD_PAGE_WRITE &&
+          record.txn_id == header.txn_id) {
+        pager_redo(pager, record.page_num, record.offset,
+                   log + cursor + sizeof(record), record.size);
+      }
+      cursor += sizeof(record) + record.size;
+    }
+
+    txn_start = offset;
+    valid_end = offset;
+    last_lsn = header.lsn;
+    last_txn_id = header.txn_id;
+    txns_applied++;
+  }
 
-    void *page = pager_get_page(page_num);
-    memcpy((char *)page + offset, data, size);
+  free(log);
 
-    free(data);
+  // Drop the torn or uncommitted tail so new records follow a clean end
+  if (valid_end < (size_t)length && ftruncate(wal->fd, valid_end) == -1) {
+    printf("Error truncating WAL: %d\n", errno);
+    exit(EXIT_FAILURE);
   }
 
-  /* Move back to append mode */
-  lseek(wal_fd, 0, SEEK_END);
+  wal->file_size = valid_end;
+  wal->next_lsn = last_lsn + 1;
+  wal->flushed_lsn = last_lsn;
+  wal->next_txn_id = last_txn_id + 1;
+  return txns_applied;
 }